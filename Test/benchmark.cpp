@@ -0,0 +1,787 @@
+#include "pch.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+extern "C"
+{
+#include "btree.h"
+}
+#include "btree.hpp"
+#include <map>
+#include <mutex>
+#include <thread>
+
+// Benchmarks are gtest cases that check the cost model (comparator calls
+// are counted, so the checks are exact) and print timings. They are
+// disabled, so the default test run skips them; run them on request with
+//   Test.exe --gtest_also_run_disabled_tests --gtest_filter=DISABLED_Benchmark_*
+
+//----------------------------------------------------------//
+
+typedef struct {
+    char name[16];
+} BenchKey;
+
+static size_t comparator_calls = 0;
+
+static int compare_counted(const void* lhsp, const void* rhsp) {
+    comparator_calls++;
+    return strcmp(static_cast<const BenchKey*>(lhsp)->name, static_cast<const BenchKey*>(rhsp)->name);
+}
+
+static std::vector<BenchKey> make_keys(size_t count, unsigned seed) {
+    std::vector<BenchKey> keys(count);
+    for (size_t i = 0; i < count; i++) {
+        snprintf(keys[i].name, sizeof(keys[i].name), "key%09zu", i);
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(seed));
+    return keys;
+}
+
+static void* make_tree(const std::vector<BenchKey>& keys) {
+    void* btree = btree_create(sizeof(BenchKey), sizeof(size_t), compare_counted);
+    bool isCreated = false;
+    for (size_t i = 0; i < keys.size(); i++) {
+        *(size_t*)btree_insert(btree, &keys[i], &isCreated) = i;
+    }
+    return btree;
+}
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+//----------------------------------------------------------//
+
+TEST(DISABLED_Benchmark_iteration, Comparator_calls) {
+    for (size_t count : { 1000, 100000, 1000000 }) {
+        void* btree = make_tree(make_keys(count, 1));
+
+        comparator_calls = 0;
+        size_t visited = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t item_id = btree_first(btree); item_id != btree_stop(btree); item_id = btree_next(btree, item_id)) {
+            visited++;
+        }
+        const double forward_ns = elapsed_ns(start);
+        EXPECT_EQ(visited, count);
+        EXPECT_EQ(comparator_calls, 0);
+
+        start = std::chrono::steady_clock::now();
+        for (size_t item_id = btree_last(btree); item_id != btree_stop(btree); item_id = btree_prev(btree, item_id)) {
+            visited--;
+        }
+        const double backward_ns = elapsed_ns(start);
+        EXPECT_EQ(visited, 0);
+        EXPECT_EQ(comparator_calls, 0);
+
+        std::cout << "[ BENCH    ] full scan of " << count << " string keys: "
+            << comparator_calls << " comparator calls, "
+            << forward_ns / count << " ns/item forward, "
+            << backward_ns / count << " ns/item backward" << std::endl;
+
+        btree_destroy(btree, NULL);
+    }
+}
+
+TEST(DISABLED_Benchmark_iteration, Scan_and_erase) {
+    const size_t count = 200000;
+    void* btree = make_tree(make_keys(count, 2));
+
+    comparator_calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    size_t item_id = btree_first(btree);
+    while (item_id != btree_stop(btree)) {
+        const size_t next_id = btree_next(btree, item_id);
+        const BTreeItem* item = (const BTreeItem*)btree_current(btree, item_id);
+        if (*(const size_t*)item->value % 2 == 0) {
+            btree_erase(btree, item_id, NULL);
+        }
+        item_id = next_id;
+    }
+    const double scan_ns = elapsed_ns(start);
+    EXPECT_EQ(comparator_calls, 0);
+    EXPECT_EQ(btree_count(btree), count / 2);
+
+    std::cout << "[ BENCH    ] scan and erase half of " << count << " string keys: "
+        << comparator_calls << " comparator calls, "
+        << scan_ns / count << " ns/item" << std::endl;
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(DISABLED_Benchmark_remove, Value_size) {
+    const size_t count = 20000;
+    std::vector<BenchKey> keys = make_keys(count, 3);
+
+    for (size_t value_size : { 8, 1024, 8192 }) {
+        void* btree = btree_create(sizeof(BenchKey), value_size, compare_counted);
+        std::vector<void*> values(count);
+        bool isCreated = false;
+        for (size_t i = 0; i < count; i++) {
+            values[i] = btree_insert(btree, &keys[i], &isCreated);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; i += 2) {
+            btree_remove(btree, &keys[i], NULL);
+        }
+        const double remove_ns = elapsed_ns(start);
+
+        // Survivors keep their value blocks: nothing was copied over them.
+        for (size_t i = 1; i < count; i += 2) {
+            EXPECT_TRUE(btree_item(btree, &keys[i]) == values[i]);
+        }
+        std::cout << "[ BENCH    ] remove with " << value_size << "-byte values: "
+            << remove_ns / (count / 2) << " ns/remove" << std::endl;
+
+        btree_destroy(btree, NULL);
+    }
+}
+
+TEST(DISABLED_Benchmark_remove, Comparator_calls) {
+    const size_t count = 100000;
+    std::vector<BenchKey> keys = make_keys(count, 4);
+    void* btree = make_tree(keys);
+
+    // A remove should cost exactly the search that finds the key: the
+    // unlink and any rebalancing work by node identity only.
+    size_t lookup_calls = 0;
+    size_t remove_calls = 0;
+    for (size_t i = 0; i < count; i += 2) {
+        comparator_calls = 0;
+        btree_item(btree, &keys[i]);
+        lookup_calls += comparator_calls;
+
+        comparator_calls = 0;
+        btree_remove(btree, &keys[i], NULL);
+        remove_calls += comparator_calls;
+    }
+    EXPECT_EQ(remove_calls, lookup_calls);
+    EXPECT_EQ(btree_count(btree), count / 2);
+
+    std::cout << "[ BENCH    ] remove of " << count / 2 << " string keys: "
+        << static_cast<double>(remove_calls) / (count / 2) << " comparator calls/remove, "
+        << static_cast<double>(remove_calls - lookup_calls) / (count / 2) << " of them for unlinking" << std::endl;
+
+    btree_destroy(btree, NULL);
+}
+
+static int compare_u64_callback(const void* lhsp, const void* rhsp) {
+    const uint64_t lhs = *static_cast<const uint64_t*>(lhsp);
+    const uint64_t rhs = *static_cast<const uint64_t*>(rhsp);
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+TEST(DISABLED_Benchmark_lookup, Builtin_u64) {
+    const size_t count = 1000000;
+    std::vector<uint64_t> keys(count);
+    std::mt19937_64 random(5);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = random();
+    }
+
+    // Same keys and lookups, once through a comparator callback and once
+    // through the built-in 64-bit comparison.
+    void* trees[2] = {
+        btree_create(sizeof(uint64_t), sizeof(size_t), compare_u64_callback),
+        btree_create_u64(sizeof(size_t))
+    };
+    const char* names[2] = { "callback", "built-in" };
+    for (int t = 0; t < 2; t++) {
+        bool isCreated = false;
+        for (size_t i = 0; i < count; i++) {
+            *(size_t*)btree_insert(trees[t], &keys[i], &isCreated) = i;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        size_t hits = 0;
+        for (size_t i = 0; i < count; i++) {
+            hits += (btree_item(trees[t], &keys[(i * 7919) % count]) != NULL) ? 1 : 0;
+        }
+        const double lookup_ns = elapsed_ns(start);
+        EXPECT_EQ(hits, count);
+        std::cout << "[ BENCH    ] u64 lookup, " << names[t] << " comparison: "
+            << lookup_ns / count << " ns/lookup" << std::endl;
+    }
+    EXPECT_EQ(btree_count(trees[0]), btree_count(trees[1]));
+
+    btree_destroy(trees[0], NULL);
+    btree_destroy(trees[1], NULL);
+}
+
+TEST(DISABLED_Benchmark_lookup, Template_map) {
+    const size_t count = 1000000;
+    std::vector<uint64_t> keys(count);
+    std::mt19937_64 random(6);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = random();
+    }
+
+    // The C tree through a callback comparator, the template with an
+    // inlined std::less, and std::map, on the same lookups.
+    void* c_tree = btree_create(sizeof(uint64_t), sizeof(size_t), compare_u64_callback);
+    btree::map<uint64_t, size_t> template_tree;
+    std::map<uint64_t, size_t> std_tree;
+    bool isCreated = false;
+    for (size_t i = 0; i < count; i++) {
+        *(size_t*)btree_insert(c_tree, &keys[i], &isCreated) = i;
+        template_tree.emplace(keys[i], i);
+        std_tree.emplace(keys[i], i);
+    }
+
+    size_t hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        hits += (btree_item(c_tree, &keys[(i * 7919) % count]) != NULL) ? 1 : 0;
+    }
+    const double c_ns = elapsed_ns(start);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        hits += (template_tree.find(keys[(i * 7919) % count]) != template_tree.end()) ? 1 : 0;
+    }
+    const double template_ns = elapsed_ns(start);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        hits += (std_tree.find(keys[(i * 7919) % count]) != std_tree.end()) ? 1 : 0;
+    }
+    const double std_ns = elapsed_ns(start);
+
+    EXPECT_EQ(hits, 3 * count);
+    EXPECT_EQ(template_tree.size(), btree_count(c_tree));
+    std::cout << "[ BENCH    ] u64 lookup: C API " << c_ns / count << " ns, btree::map "
+        << template_ns / count << " ns, std::map " << std_ns / count << " ns" << std::endl;
+
+    btree_destroy(c_tree, NULL);
+}
+
+TEST(DISABLED_Benchmark_lookup, Normalized_prefix) {
+    const size_t count = 1000000;
+    std::vector<BenchKey> keys(count);
+    std::mt19937 random(7);
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j + 1 < sizeof(keys[i].name); j++) {
+            keys[i].name[j] = static_cast<char>('a' + random() % 26);
+        }
+        keys[i].name[sizeof(keys[i].name) - 1] = 0;
+    }
+
+    // Random strings almost never share 8 bytes, so with prefixes the
+    // comparator should run about once per lookup, for the final match.
+    void* trees[2] = {
+        btree_create(sizeof(BenchKey), sizeof(size_t), compare_counted),
+        btree_create_normalized(sizeof(BenchKey), sizeof(size_t), compare_counted, btree_prefix_string)
+    };
+    const char* names[2] = { "comparator only", "normalized prefix" };
+    size_t calls[2] = { 0, 0 };
+    for (int t = 0; t < 2; t++) {
+        bool isCreated = false;
+        for (size_t i = 0; i < count; i++) {
+            *(size_t*)btree_insert(trees[t], &keys[i], &isCreated) = i;
+        }
+
+        comparator_calls = 0;
+        auto start = std::chrono::steady_clock::now();
+        size_t hits = 0;
+        for (size_t i = 0; i < count; i++) {
+            hits += (btree_item(trees[t], &keys[(i * 7919) % count]) != NULL) ? 1 : 0;
+        }
+        const double lookup_ns = elapsed_ns(start);
+        calls[t] = comparator_calls;
+        EXPECT_EQ(hits, count);
+        std::cout << "[ BENCH    ] string lookup, " << names[t] << ": " << lookup_ns / count << " ns/lookup, "
+            << static_cast<double>(comparator_calls) / count << " comparator calls/lookup" << std::endl;
+        btree_destroy(trees[t], NULL);
+    }
+    EXPECT_LT(calls[1] * 5, calls[0]);
+}
+
+TEST(DISABLED_Benchmark_order_statistics, Select_and_rank) {
+    const size_t count = 1000000;
+    std::vector<uint64_t> keys(count);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = i * 3;
+    }
+    void* btree = btree_create_u64(sizeof(size_t));
+    EXPECT_TRUE(btree_build_sorted(btree, keys.data(), NULL, count, false));
+
+    // Pagination the old way, walking from the first item, against select.
+    const size_t target = count / 2;
+    auto start = std::chrono::steady_clock::now();
+    size_t walked = btree_first(btree);
+    for (size_t i = 0; i < target; i++) {
+        walked = btree_next(btree, walked);
+    }
+    const double walk_ns = elapsed_ns(start);
+
+    start = std::chrono::steady_clock::now();
+    size_t selected = btree_stop(btree);
+    for (size_t i = 0; i < 1000; i++) {
+        selected = btree_select(btree, target);
+    }
+    const double select_ns = elapsed_ns(start) / 1000;
+    EXPECT_EQ(selected, walked);
+
+    start = std::chrono::steady_clock::now();
+    size_t ranks = 0;
+    for (size_t i = 0; i < 1000; i++) {
+        ranks += btree_rank(btree, &keys[(i * 7919) % count]);
+    }
+    const double rank_ns = elapsed_ns(start) / 1000;
+    EXPECT_GT(ranks, 0);
+
+    std::cout << "[ BENCH    ] item " << target << " of " << count << ": walk " << walk_ns / 1000 << " us, select "
+        << select_ns << " ns, rank " << rank_ns << " ns" << std::endl;
+
+    btree_destroy(btree, NULL);
+}
+
+// Runs ops random point operations per thread over keys [0, range), reads
+// with probability read_percent, and returns millions of operations/s.
+template <class Read, class Write>
+static double run_mixed(size_t threads, size_t ops, uint64_t range, unsigned read_percent, Read read, Write write) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([=]() {
+            std::mt19937_64 random(t + 1);
+            for (size_t i = 0; i < ops; i++) {
+                const uint64_t key = random() % range;
+                if (random() % 100 < read_percent) {
+                    read(key);
+                }
+                else {
+                    write(key);
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return static_cast<double>(threads * ops) / elapsed_ns(start) * 1000.0;
+}
+
+TEST(DISABLED_Benchmark_concurrent, Mixed_throughput) {
+    const uint64_t range = 1000000;
+    const size_t ops = 200000;
+    const size_t cores = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), 16));
+
+    // Baseline: the single-threaded tree behind one global mutex, against
+    // the latch-coupled concurrent tree; both start with half the keys.
+    void* locked = btree_create_u64(sizeof(uint64_t));
+    void* concurrent = btree_create_concurrent(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    std::mutex mutex;
+    bool isCreated = false;
+    for (uint64_t key = 0; key < range; key += 2) {
+        *(uint64_t*)btree_insert(locked, &key, &isCreated) = key;
+        btree_concurrent_put(concurrent, &key, &key, NULL);
+    }
+
+    for (unsigned read_percent : { 50u, 90u, 99u }) {
+        for (size_t threads = 1; threads <= cores; threads *= 2) {
+            const double locked_mops = run_mixed(threads, ops, range, read_percent,
+                [&](uint64_t key) {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    btree_item(locked, &key);
+                },
+                [&](uint64_t key) {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    if (key % 4 < 2) {
+                        bool created = false;
+                        *(uint64_t*)btree_insert(locked, &key, &created) = key;
+                    }
+                    else {
+                        btree_remove(locked, &key, NULL);
+                    }
+                });
+            const double concurrent_mops = run_mixed(threads, ops, range, read_percent,
+                [&](uint64_t key) {
+                    uint64_t value = 0;
+                    btree_concurrent_get(concurrent, &key, &value);
+                },
+                [&](uint64_t key) {
+                    if (key % 4 < 2) {
+                        btree_concurrent_put(concurrent, &key, &key, NULL);
+                    }
+                    else {
+                        btree_concurrent_remove(concurrent, &key, NULL);
+                    }
+                });
+            std::cout << "[ BENCH    ] " << read_percent << "% reads, " << threads << " threads: global mutex "
+                << locked_mops << " Mops/s, concurrent " << concurrent_mops << " Mops/s" << std::endl;
+        }
+    }
+
+    size_t checked = 0;
+    for (uint64_t key = 0; key < range; key += 997) {
+        uint64_t value = 0;
+        if (btree_concurrent_get(concurrent, &key, &value)) {
+            EXPECT_EQ(value, key);
+            checked++;
+        }
+    }
+    EXPECT_GT(checked, 0);
+
+    btree_destroy(locked, NULL);
+    btree_concurrent_destroy(concurrent, NULL);
+}
+
+
+// Runs threads readers for ops lookups each while one writer keeps
+// inserting and removing, and returns millions of lookups/s.
+template <class Read, class Write>
+static double run_readers(size_t threads, size_t ops, uint64_t range, Read read, Write write) {
+    std::atomic<bool> reading(true);
+    std::thread writer([&]() {
+        std::mt19937_64 random(0);
+        while (reading) {
+            write(random() % range);
+        }
+    });
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([=]() {
+            read(t + 1, ops);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    const double mops = static_cast<double>(threads * ops) / elapsed_ns(start) * 1000.0;
+    reading = false;
+    writer.join();
+    return mops;
+}
+
+TEST(DISABLED_Benchmark_concurrent, Read_scaling) {
+    const uint64_t range = 1000000;
+    const size_t ops = 200000;
+    const size_t cores = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), 16));
+
+    // Both trees start with half the keys; the writer flips keys in and out
+    // while readers look them up.
+    void* concurrent = btree_create_concurrent(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    void* rcu = btree_create_rcu(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    for (uint64_t key = 0; key < range; key += 2) {
+        btree_concurrent_put(concurrent, &key, &key, NULL);
+        btree_rcu_put(rcu, &key, &key, NULL, NULL);
+    }
+    std::atomic<size_t> wrong_values(0);
+
+    for (size_t threads = 1; threads <= cores; threads *= 2) {
+        const double latched_mops = run_readers(threads, ops, range,
+            [&](size_t seed, size_t count) {
+                std::mt19937_64 random(seed);
+                for (size_t i = 0; i < count; i++) {
+                    const uint64_t key = random() % range;
+                    uint64_t value = key;
+                    btree_concurrent_get(concurrent, &key, &value);
+                    if (value != key) {
+                        wrong_values++;
+                    }
+                }
+            },
+            [&](uint64_t key) {
+                if (key % 4 < 2) {
+                    btree_concurrent_put(concurrent, &key, &key, NULL);
+                }
+                else {
+                    btree_concurrent_remove(concurrent, &key, NULL);
+                }
+            });
+        const double rcu_mops = run_readers(threads, ops, range,
+            [&](size_t seed, size_t count) {
+                void* reader = btree_rcu_reader(rcu);
+                std::mt19937_64 random(seed);
+                for (size_t i = 0; i < count; i++) {
+                    const uint64_t key = random() % range;
+                    uint64_t value = key;
+                    btree_rcu_get(reader, &key, &value);
+                    if (value != key) {
+                        wrong_values++;
+                    }
+                }
+                btree_rcu_reader_free(reader);
+            },
+            [&](uint64_t key) {
+                if (key % 4 < 2) {
+                    btree_rcu_put(rcu, &key, &key, NULL, NULL);
+                }
+                else {
+                    btree_rcu_remove(rcu, &key, NULL);
+                }
+            });
+        std::cout << "[ BENCH    ] " << threads << " readers + 1 writer: latch-coupled "
+            << latched_mops << " Mlookups/s, rcu " << rcu_mops << " Mlookups/s" << std::endl;
+    }
+    EXPECT_EQ(wrong_values.load(), 0);
+
+    btree_concurrent_destroy(concurrent, NULL);
+    btree_rcu_destroy(rcu, NULL);
+}
+
+
+TEST(DISABLED_Benchmark_concurrent, Sharded_ingest) {
+    const uint64_t per_thread = 250000;
+    const size_t cores = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), 16));
+
+    // Each thread ingests random keys of its own range, into one tree
+    // behind a global mutex or into a container sharded on those ranges.
+    for (size_t threads = 1; threads <= cores; threads *= 2) {
+        std::vector<uint64_t> sample;
+        for (uint64_t key = 0; key < threads * per_thread; key += 1000) {
+            sample.push_back(key);
+        }
+        void* locked = btree_create(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+        void* sharded = btree_create_sharded(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback, threads, sample.data(), sample.size());
+        std::mutex mutex;
+        auto ingest = [&](bool use_shards) {
+            std::vector<std::thread> workers;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    std::mt19937_64 random(t + 1);
+                    bool isCreated = false;
+                    for (uint64_t i = 0; i < per_thread; i++) {
+                        const uint64_t key = t * per_thread + random() % per_thread;
+                        if (use_shards) {
+                            *(uint64_t*)btree_sharded_insert(sharded, &key, &isCreated) = key;
+                        }
+                        else {
+                            std::lock_guard<std::mutex> guard(mutex);
+                            *(uint64_t*)btree_insert(locked, &key, &isCreated) = key;
+                        }
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            return static_cast<double>(threads * per_thread) / elapsed_ns(start) * 1000.0;
+        };
+        const double locked_mops = ingest(false);
+        const double sharded_mops = ingest(true);
+        std::cout << "[ BENCH    ] " << threads << " ingest threads: global mutex " << locked_mops
+            << " Minserts/s, " << btree_sharded_shards(sharded) << " shards " << sharded_mops << " Minserts/s" << std::endl;
+        EXPECT_EQ(btree_sharded_count(sharded), btree_count(locked));
+        btree_destroy(locked, NULL);
+        btree_sharded_destroy(sharded, NULL);
+    }
+}
+
+TEST(DISABLED_Benchmark_file, Reload_versus_mmap) {
+    const uint64_t count = 2000000;
+    const char* path = "btree_benchmark_file.bin";
+    void* btree = btree_create(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    bool isCreated = false;
+    for (uint64_t key = 0; key < count; key++) {
+        *(uint64_t*)btree_insert(btree, &key, &isCreated) = key * 2;
+    }
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(btree_save(btree, path));
+    const double save_ms = elapsed_ns(start) / 1e6;
+    btree_destroy(btree, NULL);
+
+    // Startup the old way: every pair read back and inserted again.
+    start = std::chrono::steady_clock::now();
+    void* mapped = btree_open_mmap(path, compare_u64_callback);
+    ASSERT_TRUE(mapped != NULL);
+    const double open_us = elapsed_ns(start) / 1e3;
+    start = std::chrono::steady_clock::now();
+    void* reloaded = btree_create(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    for (size_t id = btree_mapped_first(mapped); id != btree_stop(mapped); id = btree_mapped_next(mapped, id)) {
+        *(uint64_t*)btree_insert(reloaded, btree_mapped_key(mapped, id), &isCreated) = *(const uint64_t*)btree_mapped_value(mapped, id);
+    }
+    const double reload_ms = elapsed_ns(start) / 1e6;
+
+    std::mt19937_64 random(7);
+    std::vector<uint64_t> probes(1000000);
+    for (auto& probe : probes) {
+        probe = random() % count;
+    }
+    uint64_t sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (uint64_t probe : probes) {
+        sum += *(const uint64_t*)btree_mapped_item(mapped, &probe);
+    }
+    const double mapped_ns = elapsed_ns(start) / probes.size();
+    start = std::chrono::steady_clock::now();
+    for (uint64_t probe : probes) {
+        sum -= *(const uint64_t*)btree_item(reloaded, &probe);
+    }
+    const double tree_ns = elapsed_ns(start) / probes.size();
+    EXPECT_EQ(sum, 0);
+    std::cout << "[ BENCH    ] " << count << " keys: save " << save_ms << " ms, reload by insert " << reload_ms
+        << " ms, open_mmap " << open_us << " us" << std::endl;
+    std::cout << "[ BENCH    ] lookup: mapped " << mapped_ns << " ns, reloaded tree " << tree_ns << " ns" << std::endl;
+    btree_destroy(reloaded, NULL);
+    btree_mapped_close(mapped);
+    std::remove(path);
+}
+
+TEST(DISABLED_Benchmark_durable, Logging_and_recovery) {
+    const char* path = "btree_benchmark_durable";
+    const std::string checkpoint = std::string(path) + ".ckpt";
+    const std::string log = std::string(path) + ".wal";
+    const uint64_t count = 200000;
+    std::mt19937_64 random(11);
+    std::vector<uint64_t> keys(count);
+    for (auto& key : keys) {
+        key = random();
+    }
+
+    // Logging overhead against plain inserts, by how many puts share an
+    // fsync; a group of 0 commits once at the end.
+    auto start = std::chrono::steady_clock::now();
+    void* plain = btree_create(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    bool isCreated = false;
+    for (uint64_t key : keys) {
+        *(uint64_t*)btree_insert(plain, &key, &isCreated) = key;
+    }
+    std::cout << "[ BENCH    ] plain insert " << elapsed_ns(start) / count << " ns/op" << std::endl;
+    btree_destroy(plain, NULL);
+    for (size_t group : { 1, 16, 256, 0 }) {
+        std::remove(checkpoint.c_str());
+        std::remove(log.c_str());
+        const uint64_t ops = (group == 1) ? count / 20 : count;
+        void* durable = btree_create_durable(path, sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback, group, 0);
+        ASSERT_TRUE(durable != NULL);
+        start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < ops; i++) {
+            ASSERT_TRUE(btree_durable_put(durable, &keys[i], &keys[i], &isCreated));
+        }
+        ASSERT_TRUE(btree_durable_commit(durable));
+        std::cout << "[ BENCH    ] durable put, group of " << group << ": " << elapsed_ns(start) / ops << " ns/op" << std::endl;
+        btree_durable_close(durable, NULL);
+    }
+
+    // Recovery replaying the whole log against loading a checkpoint and
+    // replaying a tail of a tenth of the keys.
+    for (bool checkpointed : { false, true }) {
+        std::remove(checkpoint.c_str());
+        std::remove(log.c_str());
+        void* durable = btree_create_durable(path, sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback, 0, 0);
+        for (uint64_t i = 0; i < count; i++) {
+            if (checkpointed && (i == count - count / 10)) {
+                ASSERT_TRUE(btree_durable_checkpoint(durable));
+            }
+            ASSERT_TRUE(btree_durable_put(durable, &keys[i], &keys[i], &isCreated));
+        }
+        btree_durable_close(durable, NULL);
+        start = std::chrono::steady_clock::now();
+        durable = btree_create_durable(path, sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback, 0, 0);
+        const double recovery_ms = elapsed_ns(start) / 1e6;
+        ASSERT_TRUE(durable != NULL);
+        EXPECT_EQ(btree_count(btree_durable_tree(durable)), count);
+        std::cout << "[ BENCH    ] recovery of " << count << " keys, " << (checkpointed ? "checkpoint + tail: " : "whole log: ")
+            << recovery_ms << " ms" << std::endl;
+        btree_durable_close(durable, NULL);
+    }
+    std::remove(checkpoint.c_str());
+    std::remove(log.c_str());
+}
+
+TEST(DISABLED_Benchmark_set, Union_intersect_difference) {
+    const uint64_t count = 1000000;
+    void* lhs = btree_create(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    void* rhs = btree_create(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    bool isCreated = false;
+    std::mt19937_64 random(13);
+    for (uint64_t i = 0; i < count; i++) {
+        const uint64_t key = random() % (2 * count);
+        *(uint64_t*)btree_insert((i % 2 == 0) ? lhs : rhs, &key, &isCreated) = key;
+    }
+
+    // The old way: walk both trees and insert what the result keeps.
+    auto start = std::chrono::steady_clock::now();
+    void* walked = btree_create(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    for (const void* tree : { rhs, lhs }) {
+        for (size_t id = btree_first(tree); id != btree_stop(tree); id = btree_next(tree, id)) {
+            const BTreeItem* item = (const BTreeItem*)btree_current(tree, id);
+            *(uint64_t*)btree_insert(walked, item->key, &isCreated) = *(const uint64_t*)item->value;
+        }
+    }
+    std::cout << "[ BENCH    ] union by insert: " << elapsed_ns(start) / 1e6 << " ms" << std::endl;
+
+    const size_t cores = std::max<size_t>(1, std::thread::hardware_concurrency());
+    for (size_t threads = 1; threads <= cores; threads *= 2) {
+        start = std::chrono::steady_clock::now();
+        void* merged = btree_union(lhs, rhs, threads);
+        const double union_ms = elapsed_ns(start) / 1e6;
+        start = std::chrono::steady_clock::now();
+        void* common = btree_intersect(lhs, rhs, threads);
+        const double intersect_ms = elapsed_ns(start) / 1e6;
+        start = std::chrono::steady_clock::now();
+        void* only = btree_difference(lhs, rhs, threads);
+        const double difference_ms = elapsed_ns(start) / 1e6;
+        std::cout << "[ BENCH    ] " << threads << " threads: union " << union_ms << " ms, intersect " << intersect_ms
+            << " ms, difference " << difference_ms << " ms" << std::endl;
+        EXPECT_EQ(btree_count(merged), btree_count(walked));
+        EXPECT_EQ(btree_count(common) + btree_count(only), btree_count(lhs));
+        btree_destroy(merged, NULL);
+        btree_destroy(common, NULL);
+        btree_destroy(only, NULL);
+    }
+    btree_destroy(walked, NULL);
+    btree_destroy(lhs, NULL);
+    btree_destroy(rhs, NULL);
+}
+
+TEST(DISABLED_Benchmark_split, Split_and_join_versus_reinsert) {
+    const uint64_t count = 1000000;
+    const size_t rounds = 1000;
+    void* btree = btree_create(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    bool isCreated = false;
+    std::mt19937_64 random(17);
+    for (uint64_t i = 0; i < count; i++) {
+        const uint64_t key = random();
+        *(uint64_t*)btree_insert(btree, &key, &isCreated) = key;
+    }
+    const uint64_t middle = ~(uint64_t)0 / 2;
+
+    // The old way: move the upper half into a tree of its own by inserting.
+    auto start = std::chrono::steady_clock::now();
+    void* upper = btree_create(sizeof(uint64_t), sizeof(uint64_t), compare_u64_callback);
+    for (size_t id = btree_lower_bound(btree, &middle); id != btree_stop(btree); id = btree_next(btree, id)) {
+        const BTreeItem* item = (const BTreeItem*)btree_current(btree, id);
+        *(uint64_t*)btree_insert(upper, item->key, &isCreated) = *(const uint64_t*)item->value;
+    }
+    std::cout << "[ BENCH    ] split by insert: " << elapsed_ns(start) / 1e6 << " ms" << std::endl;
+    btree_destroy(upper, NULL);
+
+    // Split and join alone, then each followed by a call handing out an
+    // item id, which must not pay for the items that moved.
+    for (bool renumber : { false, true }) {
+        const size_t runs = rounds;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < runs; i++) {
+            const uint64_t key = random();
+            void* left = NULL;
+            void* right = NULL;
+            ASSERT_TRUE(btree_split(btree, &key, &left, &right));
+            if (renumber) {
+                btree_select(left, btree_count(left) / 2);
+                btree_select(right, btree_count(right) / 2);
+            }
+            ASSERT_TRUE(btree_join(left, right));
+            if (renumber) {
+                btree_select(left, count / 2);
+            }
+            btree_destroy(btree, NULL);
+            btree_destroy(right, NULL);
+            btree = left;
+        }
+        std::cout << "[ BENCH    ] split + join" << (renumber ? " + first id" : "") << ": "
+            << elapsed_ns(start) / 1e3 / runs << " us per round" << std::endl;
+    }
+    EXPECT_EQ(btree_count(btree), count);
+    btree_destroy(btree, NULL);
+}
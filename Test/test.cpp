@@ -1,5 +1,16 @@
 #include "pch.h"
 #include <random>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
 
 //#include <assert.h>
 //#include <stdlib.h>
@@ -8,6 +19,7 @@ extern "C"
 {
 #include "btree.h"
 }
+#include "btree.hpp"
 
 //----------------------------------------------------------//
 
@@ -1008,3 +1020,2113 @@ TEST(EmergencySituation_btree_remove_and_insert, Test_2) {
 //    free(item);
 //}
 
+
+//----------------------------------------------------------//
+
+static bool height_is_logarithmic(const void* btree) {
+    // AVL bound: h < 1.4405 * log2(n + 2) - 0.3277. Any B+tree with at
+    // least three children per internal node stays well below it.
+    const double count = static_cast<double>(btree_count(btree));
+    const double bound = 1.4405 * std::log2(count + 2.0) - 0.3277;
+    return static_cast<double>(btree_height(btree)) < bound;
+}
+
+static bool keys_are_sorted(const void* btree) {
+    size_t count = 0;
+    const BTreeItem* item_prev = NULL;
+    for (size_t node_id = btree_first(btree); node_id != btree_stop(btree); node_id = btree_next(btree, node_id)) {
+        const BTreeItem* item = static_cast<const BTreeItem*>(btree_current(btree, node_id));
+        if ((item_prev != NULL) && (compare_int(item_prev->key, item->key) >= 0)) {
+            return false;
+        }
+        item_prev = item;
+        count++;
+    }
+    return count == btree_count(btree);
+}
+
+TEST(EmergencySituation_btree_height, Test_1) {
+    //haven't tree
+    void* btree = NULL;
+    EXPECT_TRUE(btree_height(btree) == INVALID);
+
+    btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    EXPECT_TRUE(btree_height(btree) == 0);
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_height, Test_2) {
+    //ascending and descending keys
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    bool isCreated = false;
+
+    for (int i = 0; i < 10000; i++) {
+        *(int*)btree_insert(btree, &i, &isCreated) = i;
+        EXPECT_TRUE(height_is_logarithmic(btree));
+    }
+    for (int i = -1; i > -10000; i--) {
+        *(int*)btree_insert(btree, &i, &isCreated) = i;
+    }
+    EXPECT_TRUE(height_is_logarithmic(btree));
+    EXPECT_TRUE(keys_are_sorted(btree));
+
+    for (int i = -9999; i < 10000; i++) {
+        EXPECT_TRUE(*(int*)btree_item(btree, &i) == i);
+    }
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_height, Test_3) {
+    //zigzag inserts, then removal of one side and of every other key
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    bool isCreated = false;
+
+    for (int i = 0; i < 5000; i++) {
+        int key = (i % 2 == 0) ? i : 10000 - i;
+        *(int*)btree_insert(btree, &key, &isCreated) = key;
+    }
+    EXPECT_TRUE(height_is_logarithmic(btree));
+
+    for (int i = 0; i < 10000; i += 2) {
+        btree_remove(btree, &i, NULL);
+        EXPECT_TRUE(height_is_logarithmic(btree));
+    }
+    EXPECT_TRUE(btree_count(btree) == 2500);
+    EXPECT_TRUE(keys_are_sorted(btree));
+
+    for (int i = 9999; i > 5000; i -= 4) {
+        btree_remove(btree, &i, NULL);
+        EXPECT_TRUE(height_is_logarithmic(btree));
+    }
+    EXPECT_TRUE(btree_count(btree) == 1250);
+    EXPECT_TRUE(keys_are_sorted(btree));
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_height, Test_4) {
+    //random inserts and removals
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> rnd_key(0, 4096);
+    bool isCreated = false;
+
+    for (int i = 0; i < 20000; i++) {
+        int key = rnd_key(rng);
+        if (i % 3 == 2) {
+            btree_remove(btree, &key, NULL);
+        }
+        else {
+            *(int*)btree_insert(btree, &key, &isCreated) = key;
+        }
+    }
+    EXPECT_TRUE(height_is_logarithmic(btree));
+    EXPECT_TRUE(keys_are_sorted(btree));
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_height, Test_5) {
+    //wide nodes keep sorted ingest shallow
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    bool isCreated = false;
+
+    for (int i = 0; i < 100000; i++) {
+        *(int*)btree_insert(btree, &i, &isCreated) = i;
+    }
+    EXPECT_TRUE(btree_height(btree) <= 4);
+    EXPECT_TRUE(keys_are_sorted(btree));
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_insert, Test_2) {
+    //value addresses survive node splits and merges
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    std::vector<int*> values;
+    bool isCreated = false;
+
+    for (int i = 0; i < 5000; i++) {
+        int* val = (int*)btree_insert(btree, &i, &isCreated);
+        *val = i;
+        values.push_back(val);
+    }
+    for (int i = 1; i < 5000; i += 2) {
+        btree_remove(btree, &i, NULL);
+    }
+    for (int i = 0; i < 5000; i += 2) {
+        EXPECT_TRUE(btree_item(btree, &i) == values[i]);
+        EXPECT_TRUE(*values[i] == i);
+    }
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_remove_and_insert, Test_3) {
+    //random workload checked against std::map in both directions
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    std::map<int, int> reference;
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> rnd_key(0, 2000);
+    bool isCreated = false;
+
+    for (int i = 0; i < 50000; i++) {
+        int key = rnd_key(rng);
+        if (rng() % 2 == 0) {
+            int* val = (int*)btree_insert(btree, &key, &isCreated);
+            EXPECT_EQ(isCreated, reference.count(key) == 0);
+            *val = i;
+            reference[key] = i;
+        }
+        else {
+            btree_remove(btree, &key, NULL);
+            reference.erase(key);
+        }
+    }
+    EXPECT_EQ(btree_count(btree), reference.size());
+
+    size_t node_id = btree_first(btree);
+    for (const auto& pair : reference) {
+        const BTreeItem* item = (const BTreeItem*)btree_current(btree, node_id);
+        EXPECT_EQ(*(const int*)item->key, pair.first);
+        EXPECT_EQ(*(const int*)item->value, pair.second);
+        node_id = btree_next(btree, node_id);
+    }
+    EXPECT_EQ(node_id, btree_stop(btree));
+
+    node_id = btree_last(btree);
+    for (auto it = reference.rbegin(); it != reference.rend(); ++it) {
+        EXPECT_EQ(*(const int*)((const BTreeItem*)btree_current(btree, node_id))->key, it->first);
+        node_id = btree_prev(btree, node_id);
+    }
+    EXPECT_EQ(node_id, btree_stop(btree));
+
+    btree_destroy(btree, NULL);
+}
+
+typedef struct {
+    int id;
+    char payload[252];
+} WideKey;
+
+static int compare_wide(const void* a, const void* b) {
+    return compare_int(&static_cast<const WideKey*>(a)->id, &static_cast<const WideKey*>(b)->id);
+}
+
+TEST(EmergencySituation_btree_remove_and_insert, Test_4) {
+    //keys too large for more than a few per node
+    void* btree = btree_create(sizeof(WideKey), sizeof(int), compare_wide);
+    std::map<int, int> reference;
+    std::mt19937 rng(11);
+    std::uniform_int_distribution<int> rnd_key(0, 500);
+    WideKey key = { 0, "" };
+    bool isCreated = false;
+
+    for (int i = 0; i < 20000; i++) {
+        key.id = rnd_key(rng);
+        if (rng() % 3 != 0) {
+            *(int*)btree_insert(btree, &key, &isCreated) = key.id;
+            reference[key.id] = key.id;
+        }
+        else {
+            btree_remove(btree, &key, NULL);
+            reference.erase(key.id);
+        }
+        EXPECT_EQ(btree_count(btree), reference.size());
+    }
+
+    size_t node_id = btree_first(btree);
+    for (const auto& pair : reference) {
+        EXPECT_EQ(static_cast<const WideKey*>(((const BTreeItem*)btree_current(btree, node_id))->key)->id, pair.first);
+        node_id = btree_next(btree, node_id);
+    }
+    EXPECT_EQ(node_id, btree_stop(btree));
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_current, Test_3) {
+    //key and value live inline and stay aligned for their types
+    void* btree = btree_create(sizeof(Key), sizeof(double), compare);
+    Key key = { "key" };
+    bool isCreated = false;
+
+    for (int i = 0; i < 100; i++) {
+        key.name[3] = static_cast<char>('0' + i % 10);
+        key.name[4] = static_cast<char>('0' + i / 10);
+        double* val = (double*)btree_insert(btree, &key, &isCreated);
+        EXPECT_TRUE(reinterpret_cast<size_t>(val) % alignof(double) == 0);
+        *val = i;
+    }
+
+    for (size_t node_id = btree_first(btree); node_id != btree_stop(btree); node_id = btree_next(btree, node_id)) {
+        const BTreeItem* item = (const BTreeItem*)btree_current(btree, node_id);
+        EXPECT_TRUE(btree_item(btree, item->key) == item->value);
+        EXPECT_TRUE(compare(item->key, item->key) == 0);
+    }
+
+    btree_destroy(btree, NULL);
+}
+
+//----------------------------------------------------------//
+
+typedef struct {
+    size_t allocated;
+    size_t released;
+    size_t released_all;
+} AllocatorStats;
+
+static void* counting_allocate(void* context, size_t size) {
+    static_cast<AllocatorStats*>(context)->allocated++;
+    return malloc(size);
+}
+
+static void counting_release(void* context, void* block, size_t size) {
+    (void)size;
+    static_cast<AllocatorStats*>(context)->released++;
+    free(block);
+}
+
+static size_t destroyed_items = 0;
+
+static void count_destroy(void* item) {
+    (void)item;
+    destroyed_items++;
+}
+
+TEST(EmergencySituation_btree_create_ex, Test_1) {
+    //incomplete allocator
+    BTreeAllocator allocator = { NULL, NULL, NULL, NULL };
+    EXPECT_TRUE(btree_create_ex(sizeof(int), sizeof(int), compare_int, &allocator) == NULL);
+
+    //NULL falls back to the heap
+    void* btree = btree_create_ex(sizeof(int), sizeof(int), compare_int, NULL);
+    EXPECT_TRUE(btree != NULL);
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_create_ex, Test_2) {
+    //every block goes back through release when there is no release_all
+    AllocatorStats stats = { 0, 0, 0 };
+    BTreeAllocator allocator = { counting_allocate, counting_release, NULL, &stats };
+    void* btree = btree_create_ex(sizeof(int), sizeof(int), compare_int, &allocator);
+    bool isCreated = false;
+
+    for (int i = 0; i < 10000; i++) {
+        *(int*)btree_insert(btree, &i, &isCreated) = i;
+    }
+    for (int i = 0; i < 10000; i += 3) {
+        btree_remove(btree, &i, NULL);
+    }
+    btree_destroy(btree, NULL);
+
+    EXPECT_TRUE(stats.allocated > 10000);
+    EXPECT_EQ(stats.allocated, stats.released);
+}
+
+TEST(EmergencySituation_btree_create_ex, Test_3) {
+    //slab pool: reuse after bulk clear, destroy callbacks still run
+    void* slab = btree_slab_create(64 * 1024, false);
+    BTreeAllocator allocator = btree_slab_allocator(slab);
+    void* btree = btree_create_ex(sizeof(int), sizeof(int), compare_int, &allocator);
+    std::map<int, int> reference;
+    std::mt19937 rng(3);
+    bool isCreated = false;
+
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 20000; i++) {
+            int key = static_cast<int>(rng() % 5000);
+            if (i % 4 == 3) {
+                btree_remove(btree, &key, NULL);
+                reference.erase(key);
+            }
+            else {
+                *(int*)btree_insert(btree, &key, &isCreated) = key;
+                reference[key] = key;
+            }
+        }
+        EXPECT_EQ(btree_count(btree), reference.size());
+        for (const auto& pair : reference) {
+            EXPECT_TRUE(*(int*)btree_item(btree, &pair.first) == pair.second);
+        }
+        btree_clear(btree, NULL);
+        reference.clear();
+        EXPECT_TRUE(btree_first(btree) == btree_stop(btree));
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        btree_insert(btree, &i, &isCreated);
+    }
+    destroyed_items = 0;
+    btree_destroy(btree, count_destroy);
+    EXPECT_EQ(destroyed_items, 1000);
+
+    btree_slab_destroy(slab);
+}
+
+TEST(EmergencySituation_btree_create_ex, Test_4) {
+    //huge pages fall back to ordinary chunks when the system has none
+    void* slab = btree_slab_create(0, true);
+    BTreeAllocator allocator = btree_slab_allocator(slab);
+    void* btree = btree_create_ex(sizeof(Key), sizeof(Value), compare, &allocator);
+    Key key = { "key" };
+    bool isCreated = false;
+
+    for (int i = 0; i < 1000; i++) {
+        key.name[3] = static_cast<char>('a' + i % 26);
+        key.name[4] = static_cast<char>('a' + i / 26 % 26);
+        btree_insert(btree, &key, &isCreated);
+    }
+    EXPECT_TRUE(btree_count(btree) == 676);
+
+    btree_destroy(btree, NULL);
+    btree_slab_destroy(slab);
+}
+
+TEST(EmergencySituation_btree_build_sorted, Test_1) {
+    //invalid input leaves the tree untouched
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    int keys[5] = { 1, 2, 4, 3, 5 };
+    bool isCreated = false;
+
+    EXPECT_FALSE(btree_build_sorted(NULL, keys, NULL, 5, true));
+    EXPECT_FALSE(btree_build_sorted(btree, NULL, NULL, 5, true));
+    EXPECT_FALSE(btree_build_sorted(btree, keys, NULL, 5, true));
+    EXPECT_TRUE(btree_count(btree) == 0);
+    EXPECT_TRUE(btree_build_sorted(btree, keys, NULL, 0, true));
+
+    btree_insert(btree, &keys[0], &isCreated);
+    EXPECT_FALSE(btree_build_sorted(btree, keys, NULL, 2, true));
+    EXPECT_TRUE(btree_count(btree) == 1);
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_build_sorted, Test_2) {
+    //every size up to a few levels builds a valid, minimal tree
+    for (int count = 1; count < 3000; count += (count < 100) ? 1 : 97) {
+        void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+        std::vector<int> keys(count);
+        std::vector<int> values(count);
+        for (int i = 0; i < count; i++) {
+            keys[i] = 2 * i;
+            values[i] = -i;
+        }
+        EXPECT_TRUE(btree_build_sorted(btree, keys.data(), values.data(), count, true));
+        EXPECT_EQ(btree_count(btree), static_cast<size_t>(count));
+        EXPECT_TRUE(keys_are_sorted(btree));
+        for (int i = 0; i < count; i++) {
+            EXPECT_TRUE(*(int*)btree_item(btree, &keys[i]) == values[i]);
+        }
+
+        //the built tree keeps working as a normal tree
+        bool isCreated = false;
+        for (int i = 0; i < count; i++) {
+            int key = 2 * i + 1;
+            btree_insert(btree, &key, &isCreated);
+            EXPECT_TRUE(isCreated);
+        }
+        for (int i = 0; i < 2 * count; i += 3) {
+            btree_remove(btree, &i, NULL);
+        }
+        EXPECT_EQ(btree_count(btree), static_cast<size_t>(2 * count - (2 * count + 2) / 3));
+        EXPECT_TRUE(keys_are_sorted(btree));
+        btree_destroy(btree, NULL);
+    }
+}
+
+TEST(EmergencySituation_btree_build_sorted, Test_3) {
+    //bulk load is as shallow as incremental insertion and zero-fills values
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    std::vector<int> keys(200000);
+    for (int i = 0; i < 200000; i++) {
+        keys[i] = i;
+    }
+    EXPECT_TRUE(btree_build_sorted(btree, keys.data(), NULL, keys.size(), false));
+    EXPECT_TRUE(btree_height(btree) <= 4);
+    EXPECT_TRUE(*(int*)btree_item(btree, &keys[12345]) == 0);
+    EXPECT_TRUE(*(const int*)((const BTreeItem*)btree_current(btree, btree_last(btree)))->key == 199999);
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_insert_many, Test_1) {
+    //sorted, reversed and shuffled batches with duplicates match btree_insert
+    for (int pattern = 0; pattern < 3; pattern++) {
+        void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+        std::map<int, int> reference;
+        std::mt19937 rng(pattern);
+        bool isCreated = false;
+
+        for (int i = 0; i < 3000; i += 7) {
+            *(int*)btree_insert(btree, &i, &isCreated) = i;
+            reference[i] = i;
+        }
+
+        for (int batch = 0; batch < 20; batch++) {
+            std::vector<int> keys(500);
+            const int base = static_cast<int>(rng() % 2500);
+            for (size_t i = 0; i < keys.size(); i++) {
+                keys[i] = base + static_cast<int>(rng() % 700);
+            }
+            if (pattern == 0) {
+                std::sort(keys.begin(), keys.end());
+            }
+            else if (pattern == 1) {
+                std::sort(keys.rbegin(), keys.rend());
+            }
+
+            std::vector<void*> values(keys.size());
+            bool created[500];
+            EXPECT_EQ(btree_insert_many(btree, keys.data(), keys.size(), values.data(), created), keys.size());
+            for (size_t i = 0; i < keys.size(); i++) {
+                const bool expected = (reference.count(keys[i]) == 0);
+                EXPECT_EQ(created[i], expected);
+                EXPECT_TRUE(values[i] == btree_item(btree, &keys[i]));
+                if (expected) {
+                    *(int*)values[i] = keys[i];
+                    reference[keys[i]] = keys[i];
+                }
+            }
+        }
+
+        EXPECT_EQ(btree_count(btree), reference.size());
+        EXPECT_TRUE(keys_are_sorted(btree));
+        for (const auto& pair : reference) {
+            EXPECT_TRUE(*(int*)btree_item(btree, &pair.first) == pair.second);
+        }
+        btree_destroy(btree, NULL);
+    }
+}
+
+TEST(EmergencySituation_btree_insert_many, Test_2) {
+    //optional outputs and an empty tree
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    std::vector<int> keys;
+    for (int i = 100000; i > 0; i--) {
+        keys.push_back(i % 50000);
+    }
+    EXPECT_EQ(btree_insert_many(NULL, keys.data(), keys.size(), NULL, NULL), 0);
+    EXPECT_EQ(btree_insert_many(btree, keys.data(), keys.size(), NULL, NULL), keys.size());
+    EXPECT_EQ(btree_count(btree), 50000);
+    EXPECT_TRUE(keys_are_sorted(btree));
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_item_many, Test_1) {
+    //batch lookups agree with btree_item, including misses and a partial group
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    std::vector<int> keys;
+    std::vector<void*> values(1003);
+    bool isCreated = false;
+
+    EXPECT_EQ(btree_item_many(NULL, keys.data(), 0, values.data()), 0);
+    for (int i = 0; i < 1003; i++) {
+        keys.push_back(i * 37 % 2003);
+    }
+    EXPECT_EQ(btree_item_many(btree, keys.data(), keys.size(), values.data()), 0);
+    EXPECT_TRUE(values[0] == NULL);
+
+    for (int i = 0; i < 2003; i += 2) {
+        *(int*)btree_insert(btree, &i, &isCreated) = i;
+    }
+    size_t hits = 0;
+    for (int key : keys) {
+        hits += (key % 2 == 0) ? 1 : 0;
+    }
+    EXPECT_EQ(btree_item_many(btree, keys.data(), keys.size(), values.data()), hits);
+    for (size_t i = 0; i < keys.size(); i++) {
+        EXPECT_TRUE(values[i] == btree_item(btree, &keys[i]));
+    }
+
+    btree_destroy(btree, NULL);
+}
+
+static bool collect_key(void* item, void* context) {
+    static_cast<std::vector<int>*>(context)->push_back(*static_cast<const int*>(static_cast<BTreeItem*>(item)->key));
+    return true;
+}
+
+static bool stop_after_three(void* item, void* context) {
+    (void)item;
+    return ++*static_cast<int*>(context) < 3;
+}
+
+TEST(EmergencySituation_btree_bounds, Test_1) {
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    bool isCreated = false;
+    int key = 5;
+
+    EXPECT_TRUE(btree_lower_bound(NULL, &key) == btree_stop(btree));
+    EXPECT_TRUE(btree_lower_bound(btree, &key) == btree_stop(btree));
+    EXPECT_TRUE(btree_upper_bound(btree, &key) == btree_stop(btree));
+
+    for (int i = 0; i < 3000; i += 3) {
+        *(int*)btree_insert(btree, &i, &isCreated) = i;
+    }
+    for (int i = -2; i < 3002; i++) {
+        const size_t lower = btree_lower_bound(btree, &i);
+        const size_t upper = btree_upper_bound(btree, &i);
+        if (i > 2997) {
+            EXPECT_TRUE(lower == btree_stop(btree));
+            EXPECT_TRUE(upper == btree_stop(btree));
+            continue;
+        }
+        const int expected_lower = (i < 0) ? 0 : (i + 2) / 3 * 3;
+        const int expected_upper = (i < 0) ? 0 : i / 3 * 3 + 3;
+        EXPECT_EQ(*(const int*)((const BTreeItem*)btree_current(btree, lower))->key, expected_lower);
+        if (expected_upper > 2997) {
+            EXPECT_TRUE(upper == btree_stop(btree));
+        }
+        else {
+            EXPECT_EQ(*(const int*)((const BTreeItem*)btree_current(btree, upper))->key, expected_upper);
+        }
+    }
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_range, Test_1) {
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    bool isCreated = false;
+    std::vector<int> keys;
+
+    for (int i = 0; i < 3000; i += 3) {
+        btree_insert(btree, &i, &isCreated);
+    }
+
+    int low = 100;
+    int high = 200;
+    EXPECT_EQ(btree_range(btree, &low, &high, collect_key, &keys), 33);
+    EXPECT_EQ(keys.front(), 102);
+    EXPECT_EQ(keys.back(), 198);
+    EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+
+    keys.clear();
+    EXPECT_EQ(btree_range(btree, &high, &low, collect_key, &keys), 0);
+    EXPECT_EQ(btree_range(btree, NULL, &low, collect_key, &keys), 34);
+    EXPECT_EQ(btree_range(btree, &high, NULL, collect_key, &keys), 933);
+    EXPECT_EQ(btree_range(btree, NULL, NULL, collect_key, &keys), 1000);
+
+    int visits = 0;
+    EXPECT_EQ(btree_range(btree, NULL, NULL, stop_after_three, &visits), 3);
+
+    btree_destroy(btree, NULL);
+}
+
+static size_t counted_compares = 0;
+
+static int compare_int_counted(const void* a, const void* b) {
+    counted_compares++;
+    return compare_int(a, b);
+}
+
+TEST(EmergencySituation_btree_handles, Test_1) {
+    //handles of removed entries stop validating, even when the slot is reused
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    bool isCreated = false;
+
+    for (int i = 0; i < 100; i++) {
+        btree_insert(btree, &i, &isCreated);
+    }
+    int key = 50;
+    const size_t stale = btree_lower_bound(btree, &key);
+    EXPECT_TRUE(btree_current(btree, stale) != NULL);
+
+    btree_remove(btree, &key, NULL);
+    EXPECT_TRUE(btree_current(btree, stale) == NULL);
+    EXPECT_TRUE(btree_next(btree, stale) == btree_stop(btree));
+    EXPECT_TRUE(btree_prev(btree, stale) == btree_stop(btree));
+    btree_erase(btree, stale, NULL);
+    EXPECT_TRUE(btree_count(btree) == 99);
+
+    btree_insert(btree, &key, &isCreated);
+    EXPECT_TRUE(btree_current(btree, stale) == NULL);
+    EXPECT_TRUE(btree_current(btree, btree_lower_bound(btree, &key)) != NULL);
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_handles, Test_2) {
+    //clear invalidates every handle
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    std::vector<size_t> handles;
+    bool isCreated = false;
+
+    for (int i = 0; i < 100; i++) {
+        btree_insert(btree, &i, &isCreated);
+    }
+    for (size_t node_id = btree_first(btree); node_id != btree_stop(btree); node_id = btree_next(btree, node_id)) {
+        handles.push_back(node_id);
+    }
+    btree_clear(btree, NULL);
+    for (int i = 0; i < 100; i++) {
+        btree_insert(btree, &i, &isCreated);
+    }
+    for (size_t handle : handles) {
+        EXPECT_TRUE(btree_current(btree, handle) == NULL);
+    }
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_handles, Test_3) {
+    //validation and erase by handle never search the tree
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int_counted);
+    bool isCreated = false;
+
+    for (int i = 0; i < 10000; i++) {
+        *(int*)btree_insert(btree, &i, &isCreated) = i;
+    }
+
+    counted_compares = 0;
+    size_t node_id = btree_first(btree);
+    while (node_id != btree_stop(btree)) {
+        const size_t next_id = btree_next(btree, node_id);
+        const BTreeItem* item = (const BTreeItem*)btree_current(btree, node_id);
+        if (*(const int*)item->value % 3 != 0) {
+            btree_erase(btree, node_id, NULL);
+        }
+        node_id = next_id;
+    }
+    EXPECT_EQ(counted_compares, 0);
+    EXPECT_EQ(btree_count(btree), 3334);
+    EXPECT_TRUE(keys_are_sorted(btree));
+
+    btree_destroy(btree, NULL);
+}
+
+typedef struct {
+    int id;
+    char payload[4096 - sizeof(int)];
+} LargeValue;
+
+static std::vector<int> destroyed_ids;
+
+static void record_destroy(void* _item) {
+    destroyed_ids.push_back(static_cast<const LargeValue*>(static_cast<BTreeItem*>(_item)->value)->id);
+}
+
+TEST(EmergencySituation_btree_remove, Test_8) {
+    //removing an entry never moves the value of another one
+    void* btree = btree_create(sizeof(int), sizeof(LargeValue), compare_int);
+    std::vector<LargeValue*> values;
+    bool isCreated = false;
+
+    for (int i = 0; i < 2000; i++) {
+        LargeValue* val = (LargeValue*)btree_insert(btree, &i, &isCreated);
+        val->id = i;
+        memset(val->payload, i % 128, sizeof(val->payload));
+        values.push_back(val);
+    }
+
+    destroyed_ids.clear();
+    for (int i = 0; i < 2000; i++) {
+        if (i % 4 != 1) {
+            btree_remove(btree, &i, record_destroy);
+        }
+    }
+    EXPECT_EQ(destroyed_ids.size(), 1500);
+    for (size_t i = 0; i < destroyed_ids.size(); i++) {
+        EXPECT_TRUE(destroyed_ids[i] % 4 != 1);
+    }
+
+    for (int i = 1; i < 2000; i += 4) {
+        EXPECT_TRUE(btree_item(btree, &i) == values[i]);
+        EXPECT_EQ(values[i]->id, i);
+        EXPECT_EQ(values[i]->payload[sizeof(values[i]->payload) - 1], static_cast<char>(i % 128));
+    }
+
+    btree_destroy(btree, NULL);
+}
+
+
+
+static std::atomic<int> destroy_visits[200000];
+
+static void mark_destroy(void* _item) {
+    destroy_visits[*static_cast<const int*>(static_cast<BTreeItem*>(_item)->key)]++;
+}
+
+TEST(EmergencySituation_btree_clear, Test_2) {
+    //clearing a deep tree neither recurses per level nor leaks, with or without destroy
+    std::vector<int> keys(300000);
+    for (int i = 0; i < static_cast<int>(keys.size()); i++) {
+        keys[i] = i;
+    }
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    EXPECT_TRUE(btree_build_sorted(btree, keys.data(), keys.data(), keys.size(), false));
+    btree_clear(btree, NULL);
+    EXPECT_EQ(btree_count(btree), 0);
+
+    EXPECT_TRUE(btree_build_sorted(btree, keys.data(), keys.data(), keys.size(), false));
+    destroyed_items = 0;
+    btree_clear(btree, count_destroy);
+    EXPECT_EQ(destroyed_items, keys.size());
+    EXPECT_EQ(btree_first(btree), btree_stop(btree));
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_clear, Test_3) {
+    //parallel destroy visits every item exactly once
+    const int count = 200000;
+    std::vector<int> keys(count);
+    for (int i = 0; i < count; i++) {
+        keys[i] = i;
+        destroy_visits[i] = 0;
+    }
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    btree_set_destroy_threads(btree, 4);
+    EXPECT_TRUE(btree_build_sorted(btree, keys.data(), keys.data(), keys.size(), false));
+    for (int i = 0; i < count; i += 3) {
+        btree_remove(btree, &i, NULL);
+    }
+
+    btree_clear(btree, mark_destroy);
+    EXPECT_EQ(btree_count(btree), 0);
+    for (int i = 0; i < count; i++) {
+        EXPECT_EQ(destroy_visits[i].load(), (i % 3 == 0) ? 0 : 1);
+    }
+
+    btree_set_destroy_threads(btree, 0);
+    EXPECT_TRUE(btree_build_sorted(btree, keys.data(), keys.data(), keys.size(), false));
+    btree_destroy(btree, mark_destroy);
+    for (int i = 0; i < count; i++) {
+        EXPECT_EQ(destroy_visits[i].load(), (i % 3 == 0) ? 1 : 2);
+    }
+}
+
+TEST(EmergencySituation_btree_clear, Test_4) {
+    //trees cleared from several threads at once share the pool's workers
+    const int count = 40000;
+    const int trees = 4;
+    for (int i = 0; i < count * trees; i++) {
+        destroy_visits[i] = 0;
+    }
+    std::vector<std::thread> workers;
+    for (int t = 0; t < trees; t++) {
+        workers.emplace_back([t, count]() {
+            std::vector<int> keys(count);
+            for (int i = 0; i < count; i++) {
+                keys[i] = t * count + i;
+            }
+            void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+            btree_set_destroy_threads(btree, 3);
+            for (int round = 0; round < 5; round++) {
+                EXPECT_TRUE(btree_build_sorted(btree, keys.data(), keys.data(), keys.size(), false));
+                btree_clear(btree, mark_destroy);
+            }
+            btree_destroy(btree, NULL);
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    for (int i = 0; i < count * trees; i++) {
+        EXPECT_EQ(destroy_visits[i].load(), 5);
+    }
+}
+
+
+
+TEST(EmergencySituation_btree_create_u64, Test_1) {
+    //built-in uint64_t order agrees with std::map, including keys above INT64_MAX
+    void* btree = btree_create_u64(sizeof(int));
+    std::map<uint64_t, int> reference;
+    std::mt19937_64 random(14);
+    bool isCreated = false;
+
+    for (int i = 0; i < 20000; i++) {
+        const uint64_t key = (i % 2 == 0) ? random() : random() % 1000;
+        *(int*)btree_insert(btree, &key, &isCreated) = i;
+        reference[key] = i;
+    }
+    for (int i = 0; i < 5000; i++) {
+        const uint64_t key = random() % 1000;
+        btree_remove(btree, &key, NULL);
+        reference.erase(key);
+    }
+
+    EXPECT_EQ(btree_count(btree), reference.size());
+    auto expected = reference.begin();
+    for (size_t it = btree_first(btree); it != btree_stop(btree); it = btree_next(btree, it), ++expected) {
+        const BTreeItem* item = static_cast<const BTreeItem*>(btree_current(btree, it));
+        EXPECT_EQ(*static_cast<const uint64_t*>(item->key), expected->first);
+        EXPECT_EQ(*static_cast<const int*>(item->value), expected->second);
+    }
+    for (const auto& pair : reference) {
+        EXPECT_TRUE(btree_item(btree, &pair.first) != NULL);
+    }
+    const uint64_t missing = 1000;
+    EXPECT_TRUE((btree_item(btree, &missing) != NULL) == (reference.count(missing) != 0));
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_create_i32, Test_1) {
+    //negative keys sort before positive ones, and bounds see the same order
+    void* btree = btree_create_i32(sizeof(int));
+    bool isCreated = false;
+    for (int i = -5000; i < 5000; i += 2) {
+        *(int*)btree_insert(btree, &i, &isCreated) = -i;
+    }
+    EXPECT_EQ(btree_count(btree), 5000);
+
+    int expected = -5000;
+    for (size_t it = btree_first(btree); it != btree_stop(btree); it = btree_next(btree, it), expected += 2) {
+        EXPECT_EQ(*static_cast<const int*>(static_cast<const BTreeItem*>(btree_current(btree, it))->key), expected);
+    }
+    const int probe = -7;
+    const size_t bound = btree_lower_bound(btree, &probe);
+    EXPECT_EQ(*static_cast<const int*>(static_cast<const BTreeItem*>(btree_current(btree, bound))->key), -6);
+
+    std::vector<int> sorted = { -3, -1, 1, 3 };
+    void* other = btree_create_i32(sizeof(int));
+    EXPECT_TRUE(btree_build_sorted(other, sorted.data(), NULL, sorted.size(), true));
+    std::vector<int> unsorted = { 1, -1 };
+    btree_clear(other, NULL);
+    EXPECT_FALSE(btree_build_sorted(other, unsorted.data(), NULL, unsorted.size(), true));
+
+    btree_destroy(other, NULL);
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_create_bytes, Test_1) {
+    //byte keys are ordered as unsigned bytes, like memcmp
+    typedef struct { unsigned char bytes[12]; } Bytes12;
+    void* btree = btree_create_bytes(sizeof(Bytes12), sizeof(int));
+    EXPECT_TRUE(btree_create_bytes(0, sizeof(int)) == NULL);
+    std::vector<Bytes12> keys;
+    std::mt19937 random(3);
+    bool isCreated = false;
+    for (int i = 0; i < 3000; i++) {
+        Bytes12 key;
+        for (size_t j = 0; j < sizeof(key.bytes); j++) {
+            key.bytes[j] = static_cast<unsigned char>((j < 10) ? (i % 2) * 0xFF : random());
+        }
+        *(int*)btree_insert(btree, &key, &isCreated) = i;
+        if (isCreated) {
+            keys.push_back(key);
+        }
+    }
+    std::sort(keys.begin(), keys.end(), [](const Bytes12& lhs, const Bytes12& rhs) {
+        return memcmp(lhs.bytes, rhs.bytes, sizeof(lhs.bytes)) < 0;
+    });
+
+    EXPECT_EQ(btree_count(btree), keys.size());
+    size_t index = 0;
+    for (size_t it = btree_first(btree); it != btree_stop(btree); it = btree_next(btree, it), index++) {
+        EXPECT_EQ(memcmp(static_cast<const BTreeItem*>(btree_current(btree, it))->key, keys[index].bytes, sizeof(Bytes12)), 0);
+    }
+    EXPECT_EQ(*static_cast<const unsigned char*>(static_cast<const BTreeItem*>(btree_current(btree, btree_last(btree)))->key), 0xFF);
+
+    btree_destroy(btree, NULL);
+}
+
+
+
+TEST(EmergencySituation_btree_map, Test_1) {
+    //btree::map agrees with std::map through inserts, lookups, bounds and erases
+    btree::map<std::string, int> tree;
+    std::map<std::string, int> reference;
+    std::mt19937 random(15);
+
+    for (int i = 0; i < 30000; i++) {
+        const std::string key = "key" + std::to_string(random() % 20000);
+        if (random() % 3 == 0) {
+            EXPECT_EQ(tree.erase(key), reference.erase(key));
+        }
+        else {
+            EXPECT_EQ(tree.insert({ key, i }).second, reference.insert({ key, i }).second);
+        }
+    }
+    EXPECT_EQ(tree.size(), reference.size());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), reference.begin(), reference.end()));
+
+    for (int i = 0; i < 1000; i++) {
+        const std::string key = "key" + std::to_string(random() % 20000);
+        auto lower = tree.lower_bound(key);
+        auto expected_lower = reference.lower_bound(key);
+        EXPECT_EQ(lower == tree.end(), expected_lower == reference.end());
+        if (expected_lower != reference.end()) {
+            EXPECT_EQ(lower->first, expected_lower->first);
+        }
+        auto upper = tree.upper_bound(key);
+        auto expected_upper = reference.upper_bound(key);
+        EXPECT_EQ(upper == tree.end(), expected_upper == reference.end());
+        if (expected_upper != reference.end()) {
+            EXPECT_EQ(upper->first, expected_upper->first);
+        }
+        EXPECT_EQ(tree.contains(key), reference.count(key) != 0);
+    }
+
+    tree.clear();
+    EXPECT_TRUE(tree.empty());
+    EXPECT_TRUE(tree.begin() == tree.end());
+}
+
+TEST(EmergencySituation_btree_map, Test_2) {
+    //emplace and try_emplace move values in, and try_emplace leaves them alone on a hit
+    btree::map<int, std::unique_ptr<int>> tree;
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_TRUE(tree.emplace(i, std::make_unique<int>(i * 2)).second);
+    }
+    std::unique_ptr<int> spare = std::make_unique<int>(-1);
+    EXPECT_FALSE(tree.try_emplace(10, std::move(spare)).second);
+    EXPECT_TRUE(spare != nullptr);
+    EXPECT_TRUE(tree.try_emplace(1000, std::move(spare)).second);
+    EXPECT_TRUE(spare == nullptr);
+    EXPECT_EQ(*tree.at(1000), -1);
+
+    const int* address = tree.at(500).get();
+    const std::unique_ptr<int>* slot = &tree.at(500);
+    for (int i = 0; i < 1000; i += 2) {
+        tree.erase(i + 1);
+    }
+    EXPECT_EQ(tree.size(), 501);
+    EXPECT_EQ(&tree.at(500), slot);
+    EXPECT_EQ(tree.at(500).get(), address);
+    EXPECT_THROW(tree.at(501), std::out_of_range);
+
+    tree[2000] = std::make_unique<int>(7);
+    EXPECT_EQ(*tree[2000], 7);
+    EXPECT_TRUE(tree[3000] == nullptr);
+}
+
+TEST(EmergencySituation_btree_map, Test_3) {
+    //iterators are bidirectional and work with <algorithm>
+    btree::map<int, int, std::greater<int>> tree;
+    for (int i = 0; i < 5000; i++) {
+        tree.emplace(i, i * i);
+    }
+    EXPECT_EQ(std::distance(tree.begin(), tree.end()), 5000);
+    EXPECT_EQ(tree.begin()->first, 4999);
+    EXPECT_EQ(std::prev(tree.end())->first, 0);
+    EXPECT_TRUE(std::is_sorted(tree.begin(), tree.end(), [](const auto& lhs, const auto& rhs) { return lhs.first > rhs.first; }));
+
+    int expected = 0;
+    for (auto it = tree.rbegin(); it != tree.rend(); ++it, ++expected) {
+        EXPECT_EQ(it->first, expected);
+    }
+    auto found = std::find_if(tree.cbegin(), tree.cend(), [](const auto& item) { return item.second == 100 * 100; });
+    EXPECT_EQ(found->first, 100);
+
+    //erasing through iterators returns the next element even across rebalancing
+    for (auto it = tree.begin(); it != tree.end();) {
+        if (it->first % 3 != 0) {
+            it = tree.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    EXPECT_EQ(tree.size(), 1667);
+    EXPECT_TRUE(std::all_of(tree.begin(), tree.end(), [](const auto& item) { return item.first % 3 == 0; }));
+
+    btree::map<int, int, std::greater<int>> copy(tree);
+    EXPECT_TRUE(std::equal(copy.begin(), copy.end(), tree.begin(), tree.end()));
+    btree::map<int, int, std::greater<int>> moved(std::move(copy));
+    EXPECT_TRUE(copy.empty());
+    EXPECT_EQ(moved.size(), tree.size());
+}
+
+
+
+static size_t key_compares = 0;
+
+static int compare_counted_key(const void* lhsp, const void* rhsp) {
+    key_compares++;
+    return compare(lhsp, rhsp);
+}
+
+TEST(EmergencySituation_btree_create_normalized, Test_1) {
+    //prefixes keep the strcmp order, also for keys that only differ past 8 bytes
+    void* btree = btree_create_normalized(sizeof(Key), sizeof(int), compare_counted_key, btree_prefix_string);
+    EXPECT_TRUE(btree_create_normalized(sizeof(Key), sizeof(int), compare, NULL) == NULL);
+    std::map<std::string, int> reference;
+    std::mt19937 random(16);
+    bool isCreated = false;
+
+    for (int i = 0; i < 20000; i++) {
+        Key key = {};
+        if (i % 4 == 0) {
+            snprintf(key.name, sizeof(key.name), "prefix%03u", static_cast<unsigned>(random() % 1000));
+        }
+        else {
+            const size_t length = 1 + random() % (sizeof(key.name) - 1);
+            for (size_t j = 0; j < length; j++) {
+                key.name[j] = static_cast<char>('a' + random() % 26);
+            }
+        }
+        if (random() % 5 == 0) {
+            btree_remove(btree, &key, NULL);
+            reference.erase(key.name);
+        }
+        else {
+            *(int*)btree_insert(btree, &key, &isCreated) = i;
+            reference[key.name] = i;
+        }
+    }
+
+    EXPECT_EQ(btree_count(btree), reference.size());
+    auto expected = reference.begin();
+    for (size_t it = btree_first(btree); it != btree_stop(btree); it = btree_next(btree, it), ++expected) {
+        const BTreeItem* item = static_cast<const BTreeItem*>(btree_current(btree, it));
+        EXPECT_EQ(static_cast<const Key*>(item->key)->name, expected->first);
+        EXPECT_EQ(*static_cast<const int*>(item->value), expected->second);
+    }
+
+    //random keys rarely share 8 bytes, so lookups hardly reach the comparator
+    key_compares = 0;
+    size_t lookups = 0;
+    for (const auto& pair : reference) {
+        if (pair.first.compare(0, 6, "prefix") != 0) {
+            Key key = {};
+            memcpy(key.name, pair.first.c_str(), pair.first.size());
+            EXPECT_TRUE(btree_item(btree, &key) != NULL);
+            lookups++;
+        }
+    }
+    EXPECT_LT(key_compares, 2 * lookups);
+
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_prefix_string, Test_1) {
+    //the prefix is the first 8 bytes big-endian, zero after the terminator
+    EXPECT_EQ(btree_prefix_string(""), 0u);
+    EXPECT_EQ(btree_prefix_string("a"), 0x6100000000000000u);
+    EXPECT_EQ(btree_prefix_string("abcdefghij"), 0x6162636465666768u);
+    EXPECT_LT(btree_prefix_string("ab"), btree_prefix_string("ab\x01"));
+    EXPECT_LT(btree_prefix_string("\x7f"), btree_prefix_string("\x80"));
+}
+
+
+
+TEST(EmergencySituation_btree_rank, Test_1) {
+    //rank, select and count_range match a sorted copy through every kind of update
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    std::vector<int> sorted;
+    for (int i = 0; i < 20000; i += 2) {
+        sorted.push_back(i);
+    }
+    EXPECT_TRUE(btree_build_sorted(btree, sorted.data(), NULL, sorted.size(), false));
+
+    std::mt19937 random(17);
+    std::vector<int> batch;
+    for (int i = 0; i < 3000; i++) {
+        batch.push_back(static_cast<int>(random() % 30000));
+    }
+    btree_insert_many(btree, batch.data(), batch.size(), NULL, NULL);
+    bool isCreated = false;
+    for (int i = 0; i < 3000; i++) {
+        const int key = static_cast<int>(random() % 30000);
+        btree_insert(btree, &key, &isCreated);
+    }
+    for (int i = 0; i < 8000; i++) {
+        const int key = static_cast<int>(random() % 30000);
+        btree_remove(btree, &key, NULL);
+    }
+    for (int i = 0; i < 1000; i++) {
+        btree_erase(btree, btree_first(btree), NULL);
+    }
+
+    std::vector<int> reference;
+    for (size_t it = btree_first(btree); it != btree_stop(btree); it = btree_next(btree, it)) {
+        reference.push_back(*static_cast<const int*>(static_cast<const BTreeItem*>(btree_current(btree, it))->key));
+    }
+    EXPECT_EQ(reference.size(), btree_count(btree));
+
+    for (size_t i = 0; i < reference.size(); i++) {
+        const size_t it = btree_select(btree, i);
+        EXPECT_EQ(*static_cast<const int*>(static_cast<const BTreeItem*>(btree_current(btree, it))->key), reference[i]);
+        EXPECT_EQ(btree_rank(btree, &reference[i]), i);
+    }
+    EXPECT_EQ(btree_select(btree, reference.size()), btree_stop(btree));
+
+    for (int i = 0; i < 2000; i++) {
+        const int low = static_cast<int>(random() % 32000) - 1000;
+        const int high = static_cast<int>(random() % 32000) - 1000;
+        const size_t below_low = std::lower_bound(reference.begin(), reference.end(), low) - reference.begin();
+        const size_t below_high = std::lower_bound(reference.begin(), reference.end(), high) - reference.begin();
+        EXPECT_EQ(btree_rank(btree, &low), below_low);
+        EXPECT_EQ(btree_count_range(btree, &low, &high), (below_high > below_low) ? below_high - below_low : 0);
+        EXPECT_EQ(btree_count_range(btree, &low, NULL), reference.size() - below_low);
+        EXPECT_EQ(btree_count_range(btree, NULL, &high), below_high);
+    }
+
+    btree_clear(btree, NULL);
+    const int key = 5;
+    EXPECT_EQ(btree_rank(btree, &key), 0);
+    EXPECT_EQ(btree_select(btree, 0), btree_stop(btree));
+    EXPECT_EQ(btree_count_range(btree, NULL, NULL), 0);
+
+    btree_destroy(btree, NULL);
+}
+
+
+
+static bool collect_pair(void* _item, void* _context) {
+    const BTreeItem* item = static_cast<const BTreeItem*>(_item);
+    static_cast<std::vector<std::pair<int, int>>*>(_context)->push_back({ *static_cast<const int*>(item->key), *static_cast<const int*>(item->value) });
+    return true;
+}
+
+TEST(EmergencySituation_btree_create_concurrent, Test_1) {
+    //threads inserting, overwriting and removing their own keys while others read
+    void* btree = btree_create_concurrent(sizeof(int), sizeof(int), compare_int);
+    EXPECT_TRUE(btree_create_concurrent(sizeof(int), sizeof(int), NULL) == NULL);
+    const int threads = 4;
+    const int per_thread = 20000;
+    std::vector<std::thread> workers;
+    std::atomic<int> wrong_reads(0);
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            bool isCreated = false;
+            for (int i = 0; i < per_thread; i++) {
+                const int key = i * threads + t;
+                const int value = key * 2;
+                if (!btree_concurrent_put(btree, &key, &value, &isCreated) || !isCreated) {
+                    wrong_reads++;
+                }
+            }
+            for (int i = 0; i < per_thread; i += 2) {
+                const int key = i * threads + t;
+                int removed = 0;
+                if (!btree_concurrent_remove(btree, &key, &removed) || (removed != key * 2)) {
+                    wrong_reads++;
+                }
+            }
+            for (int i = 1; i < per_thread; i += 2) {
+                const int key = i * threads + t;
+                const int value = -key;
+                btree_concurrent_put(btree, &key, &value, &isCreated);
+                if (isCreated) {
+                    wrong_reads++;
+                }
+            }
+        });
+    }
+    workers.emplace_back([&]() {
+        //a reader sees either no value or one of the values written for the key
+        std::mt19937 random(18);
+        for (int i = 0; i < 50000; i++) {
+            const int key = static_cast<int>(random() % (threads * per_thread));
+            int value = 0;
+            if (btree_concurrent_get(btree, &key, &value) && (value != key * 2) && (value != -key)) {
+                wrong_reads++;
+            }
+        }
+    });
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    EXPECT_EQ(wrong_reads.load(), 0);
+    EXPECT_EQ(btree_concurrent_count(btree), threads * per_thread / 2);
+    std::vector<std::pair<int, int>> items;
+    const size_t visited = btree_concurrent_scan(btree, NULL, NULL, collect_pair, &items);
+    EXPECT_EQ(visited, items.size());
+    EXPECT_EQ(items.size(), threads * per_thread / 2);
+    for (size_t i = 0; i < items.size(); i++) {
+        EXPECT_EQ(items[i].second, -items[i].first);
+        EXPECT_TRUE((items[i].first / threads) % 2 == 1);
+        if (i > 0) {
+            EXPECT_LT(items[i - 1].first, items[i].first);
+        }
+    }
+
+    items.clear();
+    const int low = 1000;
+    const int high = 2000;
+    btree_concurrent_scan(btree, &low, &high, collect_pair, &items);
+    EXPECT_FALSE(items.empty());
+    EXPECT_TRUE(items.front().first >= low);
+    EXPECT_TRUE(items.back().first < high);
+
+    destroyed_items = 0;
+    btree_concurrent_destroy(btree, count_destroy);
+    EXPECT_EQ(destroyed_items, threads * per_thread / 2);
+}
+
+TEST(EmergencySituation_btree_create_concurrent, Test_2) {
+    //sliding windows of timestamp keys while a scanner walks the leaves being merged
+    void* btree = btree_create_concurrent(sizeof(int), sizeof(int), compare_int);
+    const int threads = 4;
+    const int window = 64;
+    const int per_thread = 50000;
+    std::vector<std::thread> workers;
+    std::atomic<int> wrong_reads(0);
+    std::atomic<int> running(threads);
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            bool isCreated = false;
+            for (int i = 0; i < per_thread; i++) {
+                const int key = i * threads + t;
+                if (!btree_concurrent_put(btree, &key, &key, &isCreated) || !isCreated) {
+                    wrong_reads++;
+                }
+                const int old = key - window * threads;
+                int removed = 0;
+                if ((old >= 0) && (!btree_concurrent_remove(btree, &old, &removed) || (removed != old))) {
+                    wrong_reads++;
+                }
+            }
+            running--;
+        });
+    }
+    workers.emplace_back([&]() {
+        //keys come out ascending and without repeats however the leaves shift
+        while (running.load() > 0) {
+            std::vector<std::pair<int, int>> items;
+            btree_concurrent_scan(btree, NULL, NULL, collect_pair, &items);
+            for (size_t i = 1; i < items.size(); i++) {
+                if (items[i - 1].first >= items[i].first) {
+                    wrong_reads++;
+                }
+            }
+        }
+    });
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    EXPECT_EQ(wrong_reads.load(), 0);
+    EXPECT_EQ(btree_concurrent_count(btree), threads * window);
+    EXPECT_LE(btree_concurrent_height(btree), 2);
+    for (int key = (per_thread - window) * threads; key < per_thread * threads; key++) {
+        EXPECT_TRUE(btree_concurrent_remove(btree, &key, NULL));
+    }
+    EXPECT_EQ(btree_concurrent_count(btree), 0);
+    EXPECT_EQ(btree_concurrent_height(btree), 1);
+    EXPECT_EQ(btree_concurrent_height(NULL), INVALID);
+    btree_concurrent_destroy(btree, NULL);
+}
+
+
+TEST(EmergencySituation_btree_create_rcu, Test_1) {
+    //one writer inserting, overwriting and removing while readers get and scan
+    void* btree = btree_create_rcu(sizeof(int), sizeof(int), compare_int);
+    EXPECT_TRUE(btree_create_rcu(sizeof(int), sizeof(int), NULL) == NULL);
+    const int keys = 40000;
+    std::atomic<bool> writing(true);
+    std::atomic<int> wrong_reads(0);
+    destroyed_items = 0;
+    std::vector<std::thread> workers;
+
+    workers.emplace_back([&]() {
+        bool isCreated = false;
+        for (int key = 0; key < keys; key++) {
+            const int value = key * 2;
+            if (!btree_rcu_put(btree, &key, &value, &isCreated, count_destroy) || !isCreated) {
+                wrong_reads++;
+            }
+        }
+        for (int key = 1; key < keys; key += 2) {
+            const int value = -key;
+            if (!btree_rcu_put(btree, &key, &value, &isCreated, count_destroy) || isCreated) {
+                wrong_reads++;
+            }
+        }
+        for (int key = 0; key < keys; key += 2) {
+            if (!btree_rcu_remove(btree, &key, count_destroy)) {
+                wrong_reads++;
+            }
+        }
+        writing = false;
+    });
+    for (int t = 0; t < 2; t++) {
+        workers.emplace_back([&, t]() {
+            //a reader sees a sorted tree holding one of the values written for each key
+            void* reader = btree_rcu_reader(btree);
+            std::mt19937 random(19 + t);
+            while (writing) {
+                for (int i = 0; i < 1000; i++) {
+                    const int key = static_cast<int>(random() % keys);
+                    int value = 0;
+                    if (btree_rcu_get(reader, &key, &value) && (value != key * 2) && (value != -key)) {
+                        wrong_reads++;
+                    }
+                }
+                std::vector<std::pair<int, int>> items;
+                const int low = static_cast<int>(random() % keys);
+                btree_rcu_scan(reader, &low, NULL, collect_pair, &items);
+                for (size_t i = 0; i < items.size(); i++) {
+                    if ((items[i].first < low) || ((items[i].second != items[i].first * 2) && (items[i].second != -items[i].first))
+                        || ((i > 0) && (items[i - 1].first >= items[i].first))) {
+                        wrong_reads++;
+                    }
+                }
+            }
+            btree_rcu_reader_free(reader);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    EXPECT_EQ(wrong_reads.load(), 0);
+    EXPECT_EQ(btree_rcu_count(btree), keys / 2);
+    const int missing = 4;
+    EXPECT_FALSE(btree_rcu_remove(btree, &missing, count_destroy));
+    void* reader = btree_rcu_reader(btree);
+    std::vector<std::pair<int, int>> items;
+    const int low = 1001;
+    const int high = 2001;
+    const size_t visited = btree_rcu_scan(reader, &low, &high, collect_pair, &items);
+    EXPECT_EQ(visited, 500);
+    ASSERT_EQ(items.size(), 500);
+    for (size_t i = 0; i < items.size(); i++) {
+        EXPECT_EQ(items[i].first, low + 2 * static_cast<int>(i));
+        EXPECT_EQ(items[i].second, -items[i].first);
+    }
+    btree_rcu_reader_free(reader);
+
+    //removed and overwritten items are destroyed once unreachable, the rest with the tree
+    btree_rcu_destroy(btree, count_destroy);
+    EXPECT_EQ(destroyed_items, keys + keys / 2);
+}
+
+
+TEST(EmergencySituation_btree_create_sharded, Test_1) {
+    //threads ingesting disjoint key ranges, then one ordered pass over every shard
+    const int threads = 4;
+    const int per_thread = 20000;
+    std::vector<int> sample;
+    for (int key = 0; key < threads * per_thread; key += 100) {
+        sample.push_back(threads * per_thread - key);
+    }
+    void* sharded = btree_create_sharded(sizeof(int), sizeof(int), compare_int, threads, sample.data(), sample.size());
+    EXPECT_TRUE(btree_create_sharded(sizeof(int), sizeof(int), NULL, threads, NULL, 0) == NULL);
+    EXPECT_EQ(btree_sharded_shards(sharded), threads);
+    std::vector<std::thread> workers;
+    std::atomic<int> failures(0);
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            bool isCreated = false;
+            for (int i = 0; i < per_thread; i++) {
+                const int key = t * per_thread + i;
+                int* value = (int*)btree_sharded_insert(sharded, &key, &isCreated);
+                if ((value == NULL) || !isCreated) {
+                    failures++;
+                    continue;
+                }
+                *value = key * 2;
+            }
+            for (int i = 0; i < per_thread; i += 2) {
+                const int key = t * per_thread + i;
+                btree_sharded_remove(sharded, &key, NULL);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    EXPECT_EQ(failures.load(), 0);
+    EXPECT_EQ(btree_sharded_count(sharded), threads * per_thread / 2);
+
+    int expected = 1;
+    for (BTreeShardedCursor cursor = btree_sharded_first(sharded); cursor.item_id != btree_stop(NULL); cursor = btree_sharded_next(sharded, cursor)) {
+        const BTreeItem* item = (const BTreeItem*)btree_sharded_current(sharded, cursor);
+        ASSERT_EQ(*(const int*)item->key, expected);
+        EXPECT_EQ(*(int*)item->value, expected * 2);
+        expected += 2;
+    }
+    EXPECT_EQ(expected, threads * per_thread + 1);
+    const int missing = 0;
+    const int present = 777;
+    EXPECT_TRUE(btree_sharded_item(sharded, &missing) == NULL);
+    EXPECT_EQ(*(int*)btree_sharded_item(sharded, &present), present * 2);
+    btree_sharded_destroy(sharded, NULL);
+}
+
+TEST(EmergencySituation_btree_create_sharded, Test_2) {
+    //without a sample everything lands in one shard until a rebalance spreads it
+    void* sharded = btree_create_sharded(sizeof(int), sizeof(int), compare_int, 8, NULL, 0);
+    EXPECT_EQ(btree_sharded_shards(sharded), 1);
+    EXPECT_TRUE(btree_sharded_first(sharded).item_id == btree_stop(NULL));
+    bool isCreated = false;
+    for (int key = 999; key >= 0; key--) {
+        *(int*)btree_sharded_insert(sharded, &key, &isCreated) = -key;
+    }
+    ASSERT_TRUE(btree_sharded_rebalance(sharded));
+    EXPECT_EQ(btree_sharded_shards(sharded), 8);
+    EXPECT_EQ(btree_sharded_count(sharded), 1000);
+
+    std::vector<size_t> per_shard(8, 0);
+    int expected = 0;
+    for (BTreeShardedCursor cursor = btree_sharded_first(sharded); cursor.item_id != btree_stop(NULL); cursor = btree_sharded_next(sharded, cursor)) {
+        const BTreeItem* item = (const BTreeItem*)btree_sharded_current(sharded, cursor);
+        ASSERT_EQ(*(const int*)item->key, expected);
+        EXPECT_EQ(*(int*)item->value, -expected);
+        per_shard[cursor.shard]++;
+        expected++;
+    }
+    EXPECT_EQ(expected, 1000);
+    for (size_t count : per_shard) {
+        EXPECT_EQ(count, 125);
+    }
+
+    //a second rebalance pulls keys appended to the last shard back into line
+    for (int key = 1000; key < 1800; key++) {
+        *(int*)btree_sharded_insert(sharded, &key, &isCreated) = -key;
+    }
+    ASSERT_TRUE(btree_sharded_rebalance(sharded));
+    std::fill(per_shard.begin(), per_shard.end(), 0);
+    expected = 0;
+    for (BTreeShardedCursor cursor = btree_sharded_first(sharded); cursor.item_id != btree_stop(NULL); cursor = btree_sharded_next(sharded, cursor)) {
+        const BTreeItem* item = (const BTreeItem*)btree_sharded_current(sharded, cursor);
+        ASSERT_EQ(*(const int*)item->key, expected);
+        EXPECT_EQ(*(int*)item->value, -expected);
+        per_shard[cursor.shard]++;
+        expected++;
+    }
+    EXPECT_EQ(expected, 1800);
+    for (size_t count : per_shard) {
+        EXPECT_EQ(count, 225);
+    }
+
+    //a skewed sample collapses duplicate split points
+    std::vector<int> skewed(100, 5);
+    void* narrow = btree_create_sharded(sizeof(int), sizeof(int), compare_int, 4, skewed.data(), skewed.size());
+    EXPECT_EQ(btree_sharded_shards(narrow), 2);
+    btree_sharded_destroy(narrow, NULL);
+    btree_sharded_destroy(sharded, NULL);
+}
+
+TEST(EmergencySituation_btree_snapshot, Test_1) {
+    //a snapshot keeps the contents it was taken with while the tree changes
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    bool isCreated = false;
+    const int keys = 5000;
+    for (int key = 0; key < keys; key++) {
+        *(int*)btree_insert(btree, &key, &isCreated) = key;
+    }
+    void* snapshot = btree_snapshot(btree);
+    ASSERT_TRUE(snapshot != NULL);
+    EXPECT_TRUE(btree_snapshot(snapshot) == NULL);
+    for (int key = 0; key < keys; key += 2) {
+        btree_remove(btree, &key, count_destroy);
+    }
+    for (int key = 1; key < keys; key += 2) {
+        *(int*)btree_insert(btree, &key, &isCreated) = -key;
+    }
+    for (int key = keys; key < 2 * keys; key++) {
+        *(int*)btree_insert(btree, &key, &isCreated) = key;
+    }
+    EXPECT_TRUE(btree_insert(snapshot, &keys, &isCreated) == NULL);
+    EXPECT_EQ(btree_count(btree), keys / 2 + keys);
+    EXPECT_EQ(btree_count(snapshot), keys);
+
+    int expected = 0;
+    for (size_t id = btree_first(snapshot); id != btree_stop(snapshot); id = btree_next(snapshot, id)) {
+        const BTreeItem* item = (const BTreeItem*)btree_current(snapshot, id);
+        ASSERT_EQ(*(const int*)item->key, expected);
+        EXPECT_EQ(*(const int*)item->value, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, keys);
+    const int present = 1235;
+    const int later = keys + 1;
+    EXPECT_EQ(*(int*)btree_item(snapshot, &present), present);
+    EXPECT_EQ(*(int*)btree_item(btree, &present), -present);
+    EXPECT_TRUE(btree_item(snapshot, &later) == NULL);
+    EXPECT_EQ(*(const int*)((const BTreeItem*)btree_current(snapshot, btree_lower_bound(snapshot, &present)))->key, present);
+    EXPECT_EQ(*(const int*)((const BTreeItem*)btree_current(snapshot, btree_upper_bound(snapshot, &present)))->key, present + 1);
+    EXPECT_EQ(*(const int*)((const BTreeItem*)btree_current(snapshot, btree_prev(snapshot, btree_last(snapshot))))->key, keys - 2);
+    std::vector<std::pair<int, int>> items;
+    const int high = present + 3;
+    EXPECT_EQ(btree_range(snapshot, &present, &high, collect_pair, &items), 3);
+    EXPECT_EQ(items, (std::vector<std::pair<int, int>>{ { 1235, 1235 }, { 1236, 1236 }, { 1237, 1237 } }));
+
+    //the live tree is still whole and ordered
+    expected = 1;
+    for (size_t id = btree_first(btree); id != btree_stop(btree); id = btree_next(btree, id)) {
+        const int key = *(const int*)((const BTreeItem*)btree_current(btree, id))->key;
+        ASSERT_EQ(key, expected);
+        expected = (key < keys - 1) ? key + 2 : key + 1;
+    }
+    EXPECT_EQ(expected, 2 * keys);
+
+    //removed keys the snapshot held are destroyed with it
+    destroyed_items = 0;
+    btree_snapshot_release(snapshot, count_destroy);
+    EXPECT_EQ(destroyed_items, keys / 2);
+    btree_remove(btree, &present, count_destroy);
+    EXPECT_EQ(destroyed_items, keys / 2 + 1);
+    btree_destroy(btree, count_destroy);
+    EXPECT_EQ(destroyed_items, 2 * keys);
+}
+
+TEST(EmergencySituation_btree_snapshot, Test_2) {
+    //readers walk snapshots on other threads while the tree keeps changing
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    bool isCreated = false;
+    const int keys = 20000;
+    for (int key = 0; key < keys; key++) {
+        *(int*)btree_insert(btree, &key, &isCreated) = 0;
+    }
+    std::atomic<int> wrong_reads(0);
+    std::mt19937 random(23);
+    for (int round = 1; round <= 4; round++) {
+        void* snapshot = btree_snapshot(btree);
+        const size_t count = btree_count(snapshot);
+        std::thread reader([&, snapshot, round, count]() {
+            size_t seen = 0;
+            int last = -1;
+            for (size_t id = btree_first(snapshot); id != btree_stop(snapshot); id = btree_next(snapshot, id)) {
+                const BTreeItem* item = (const BTreeItem*)btree_current(snapshot, id);
+                if ((*(const int*)item->key <= last) || (*(const int*)item->value != round - 1)) {
+                    wrong_reads++;
+                }
+                last = *(const int*)item->key;
+                seen++;
+            }
+            if (seen != count) {
+                wrong_reads++;
+            }
+        });
+        for (int i = 0; i < keys; i++) {
+            const int key = static_cast<int>(random() % (2 * keys));
+            if (random() % 4 == 0) {
+                btree_remove(btree, &key, NULL);
+            }
+            else {
+                *(int*)btree_insert(btree, &key, &isCreated) = round;
+            }
+        }
+        //values are overwritten through btree_insert, which unshares them first
+        for (size_t id = btree_first(btree); id != btree_stop(btree); id = btree_next(btree, id)) {
+            const int key = *(const int*)((const BTreeItem*)btree_current(btree, id))->key;
+            *(int*)btree_insert(btree, &key, &isCreated) = round;
+        }
+        reader.join();
+        btree_snapshot_release(snapshot, NULL);
+    }
+    EXPECT_EQ(wrong_reads.load(), 0);
+    btree_destroy(btree, NULL);
+}
+
+TEST(EmergencySituation_btree_save, Test_1) {
+    //a saved tree is served from the mapped file in the same order
+    void* btree = btree_create(sizeof(int), sizeof(double), compare_int);
+    bool isCreated = false;
+    const int keys = 100000;
+    for (int key = 0; key < keys; key++) {
+        const int stored = key * 3;
+        *(double*)btree_insert(btree, &stored, &isCreated) = key / 2.0;
+    }
+    const char* path = "btree_save_test_1.bin";
+    EXPECT_FALSE(btree_save(NULL, path));
+    ASSERT_TRUE(btree_save(btree, path));
+    EXPECT_TRUE(btree_open_mmap(path, NULL) == NULL);
+    void* mapped = btree_open_mmap(path, compare_int);
+    ASSERT_TRUE(mapped != NULL);
+    EXPECT_EQ(btree_mapped_count(mapped), keys);
+
+    int expected = 0;
+    for (size_t id = btree_mapped_first(mapped); id != btree_stop(mapped); id = btree_mapped_next(mapped, id)) {
+        ASSERT_EQ(*(const int*)btree_mapped_key(mapped, id), expected * 3);
+        EXPECT_EQ(*(const double*)btree_mapped_value(mapped, id), expected / 2.0);
+        expected++;
+    }
+    EXPECT_EQ(expected, keys);
+    for (int key = -1; key < 3 * keys + 1; key += 7) {
+        const double* value = (const double*)btree_mapped_item(mapped, &key);
+        if (key % 3 == 0) {
+            ASSERT_TRUE(value != NULL);
+            EXPECT_EQ(*value, key / 6.0);
+        }
+        else {
+            EXPECT_TRUE(value == NULL);
+        }
+    }
+    const int between = 3001;
+    const int past = 3 * keys;
+    EXPECT_EQ(*(const int*)btree_mapped_key(mapped, btree_mapped_lower_bound(mapped, &between)), 3003);
+    EXPECT_EQ(btree_mapped_lower_bound(mapped, &past), btree_stop(mapped));
+    btree_mapped_close(mapped);
+    btree_destroy(btree, NULL);
+    std::remove(path);
+}
+
+TEST(EmergencySituation_btree_save, Test_2) {
+    //empty trees and snapshots save too, foreign files are refused
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    const char* path = "btree_save_test_2.bin";
+    ASSERT_TRUE(btree_save(btree, path));
+    void* mapped = btree_open_mmap(path, compare_int);
+    ASSERT_TRUE(mapped != NULL);
+    EXPECT_EQ(btree_mapped_count(mapped), 0);
+    EXPECT_EQ(btree_mapped_first(mapped), btree_stop(mapped));
+    const int key = 5;
+    EXPECT_TRUE(btree_mapped_item(mapped, &key) == NULL);
+    btree_mapped_close(mapped);
+
+    bool isCreated = false;
+    for (int i = 0; i < 1000; i++) {
+        *(int*)btree_insert(btree, &i, &isCreated) = i;
+    }
+    void* snapshot = btree_snapshot(btree);
+    for (int i = 0; i < 1000; i += 2) {
+        btree_remove(btree, &i, NULL);
+    }
+    ASSERT_TRUE(btree_save(snapshot, path));
+    btree_snapshot_release(snapshot, NULL);
+    mapped = btree_open_mmap(path, compare_int);
+    ASSERT_TRUE(mapped != NULL);
+    EXPECT_EQ(btree_mapped_count(mapped), 1000);
+    EXPECT_EQ(*(const int*)btree_mapped_item(mapped, &key), key);
+    btree_mapped_close(mapped);
+
+    //a truncated or foreign file is not opened
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << "not a tree";
+    EXPECT_TRUE(btree_open_mmap(path, compare_int) == NULL);
+    EXPECT_TRUE(btree_open_mmap("btree_save_missing.bin", compare_int) == NULL);
+    btree_destroy(btree, NULL);
+    std::remove(path);
+}
+
+TEST(EmergencySituation_btree_save, Test_3) {
+    //saves of different trees racing for one path each leave a whole file behind
+    const char* path = "btree_save_test_3.bin";
+    void* trees[2];
+    bool isCreated = false;
+    for (int t = 0; t < 2; t++) {
+        trees[t] = btree_create(sizeof(int), sizeof(int), compare_int);
+        for (int i = 0; i < 1000 * (t + 1); i++) {
+            *(int*)btree_insert(trees[t], &i, &isCreated) = i;
+        }
+    }
+    std::atomic<int> failed_saves(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 2; t++) {
+        workers.emplace_back([&, t]() {
+            for (int i = 0; i < 20; i++) {
+                if (!btree_save(trees[t], path)) {
+                    failed_saves++;
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    EXPECT_EQ(failed_saves.load(), 0);
+    void* mapped = btree_open_mmap(path, compare_int);
+    ASSERT_TRUE(mapped != NULL);
+    const size_t count = btree_mapped_count(mapped);
+    EXPECT_TRUE((count == 1000) || (count == 2000));
+    const int key = static_cast<int>(count) - 1;
+    EXPECT_EQ(*(const int*)btree_mapped_item(mapped, &key), key);
+    btree_mapped_close(mapped);
+    btree_destroy(trees[0], NULL);
+    btree_destroy(trees[1], NULL);
+    std::remove(path);
+}
+
+TEST(EmergencySituation_btree_create_durable, Test_1) {
+    //reopening recovers the checkpoint and replays the log written after it
+    const char* path = "btree_durable_test_1";
+    const std::string checkpoint = std::string(path) + ".ckpt";
+    const std::string log = std::string(path) + ".wal";
+    std::remove(checkpoint.c_str());
+    std::remove(log.c_str());
+    EXPECT_TRUE(btree_create_durable(path, sizeof(int), sizeof(int), NULL, 1, 0) == NULL);
+
+    void* durable = btree_create_durable(path, sizeof(int), sizeof(int), compare_int, 16, 0);
+    ASSERT_TRUE(durable != NULL);
+    bool isCreated = false;
+    for (int key = 0; key < 1000; key++) {
+        const int value = key * 2;
+        ASSERT_TRUE(btree_durable_put(durable, &key, &value, &isCreated));
+        EXPECT_TRUE(isCreated);
+    }
+    ASSERT_TRUE(btree_durable_checkpoint(durable));
+    for (int key = 0; key < 1000; key += 2) {
+        ASSERT_TRUE(btree_durable_remove(durable, &key, NULL));
+    }
+    for (int key = 1; key < 2000; key += 2) {
+        const int value = -key;
+        ASSERT_TRUE(btree_durable_put(durable, &key, &value, &isCreated));
+    }
+    EXPECT_TRUE(btree_durable_close(durable, NULL));
+
+    durable = btree_create_durable(path, sizeof(int), sizeof(int), compare_int, 16, 0);
+    ASSERT_TRUE(durable != NULL);
+    const void* btree = btree_durable_tree(durable);
+    EXPECT_EQ(btree_count(btree), 1000);
+    int expected = 1;
+    for (size_t id = btree_first(btree); id != btree_stop(btree); id = btree_next(btree, id)) {
+        const BTreeItem* item = (const BTreeItem*)btree_current(btree, id);
+        ASSERT_EQ(*(const int*)item->key, expected);
+        EXPECT_EQ(*(const int*)item->value, -expected);
+        expected += 2;
+    }
+    EXPECT_TRUE(btree_durable_close(durable, NULL));
+
+    //other value sizes are refused rather than overwritten
+    EXPECT_TRUE(btree_create_durable(path, sizeof(int), sizeof(double), compare_int, 1, 0) == NULL);
+    std::remove(checkpoint.c_str());
+    std::remove(log.c_str());
+}
+
+TEST(EmergencySituation_btree_create_durable, Test_2) {
+    //a torn record at the end of the log is dropped, records before it kept
+    const char* path = "btree_durable_test_2";
+    const std::string checkpoint = std::string(path) + ".ckpt";
+    const std::string log = std::string(path) + ".wal";
+    std::remove(checkpoint.c_str());
+    std::remove(log.c_str());
+
+    //checkpoints are taken on their own once the log grows past 4 KiB
+    void* durable = btree_create_durable(path, sizeof(int), sizeof(int), compare_int, 1, 4096);
+    bool isCreated = false;
+    for (int key = 0; key < 3000; key++) {
+        ASSERT_TRUE(btree_durable_put(durable, &key, &key, &isCreated));
+    }
+    EXPECT_TRUE(btree_durable_close(durable, NULL));
+    std::ifstream written(log, std::ios::binary | std::ios::ate);
+    EXPECT_LT(static_cast<size_t>(written.tellg()), 4096);
+    written.close();
+    std::ofstream(log, std::ios::binary | std::ios::app) << "torn";
+
+    durable = btree_create_durable(path, sizeof(int), sizeof(int), compare_int, 1, 0);
+    ASSERT_TRUE(durable != NULL);
+    EXPECT_EQ(btree_count(btree_durable_tree(durable)), 3000);
+    const int key = 5000;
+    ASSERT_TRUE(btree_durable_put(durable, &key, &key, &isCreated));
+    EXPECT_TRUE(btree_durable_close(durable, NULL));
+
+    durable = btree_create_durable(path, sizeof(int), sizeof(int), compare_int, 1, 0);
+    ASSERT_TRUE(durable != NULL);
+    EXPECT_EQ(btree_count(btree_durable_tree(durable)), 3001);
+    EXPECT_EQ(*(const int*)btree_item(btree_durable_tree(durable), &key), key);
+    EXPECT_TRUE(btree_durable_close(durable, NULL));
+    std::remove(checkpoint.c_str());
+    std::remove(log.c_str());
+}
+
+TEST(EmergencySituation_btree_union, Test_1) {
+    //results match std::set_* on random trees, however many threads split them
+    std::mt19937 random(29);
+    for (size_t threads : { 1, 3, 8 }) {
+        void* lhs = btree_create(sizeof(int), sizeof(int), compare_int);
+        void* rhs = btree_create(sizeof(int), sizeof(int), compare_int);
+        std::map<int, int> lhs_items;
+        std::map<int, int> rhs_items;
+        bool isCreated = false;
+        for (int i = 0; i < 60000; i++) {
+            const int key = static_cast<int>(random() % 100000);
+            if (random() % 2 == 0) {
+                *(int*)btree_insert(lhs, &key, &isCreated) = key;
+                lhs_items[key] = key;
+            }
+            else {
+                *(int*)btree_insert(rhs, &key, &isCreated) = -key;
+                rhs_items[key] = -key;
+            }
+        }
+        std::map<int, int> expected_union = rhs_items;
+        std::map<int, int> expected_intersect;
+        std::map<int, int> expected_difference;
+        for (const auto& item : lhs_items) {
+            expected_union[item.first] = item.second;
+            (rhs_items.count(item.first) != 0 ? expected_intersect : expected_difference)[item.first] = item.second;
+        }
+        const std::pair<void*, const std::map<int, int>*> results[] = {
+            { btree_union(lhs, rhs, threads), &expected_union },
+            { btree_intersect(lhs, rhs, threads), &expected_intersect },
+            { btree_difference(lhs, rhs, threads), &expected_difference },
+        };
+        for (const auto& result : results) {
+            ASSERT_TRUE(result.first != NULL);
+            std::vector<std::pair<int, int>> items;
+            btree_range(result.first, NULL, NULL, collect_pair, &items);
+            const std::vector<std::pair<int, int>> expected(result.second->begin(), result.second->end());
+            EXPECT_EQ(items, expected);
+            EXPECT_TRUE(height_is_logarithmic(result.first));
+            btree_destroy(result.first, NULL);
+        }
+        btree_destroy(lhs, NULL);
+        btree_destroy(rhs, NULL);
+    }
+}
+
+TEST(EmergencySituation_btree_union, Test_2) {
+    //empty and mismatched inputs, built-in orders carry over to the result
+    void* lhs = btree_create_u64(sizeof(int));
+    void* rhs = btree_create_u64(sizeof(int));
+    void* other = btree_create(sizeof(int), sizeof(double), compare_int);
+    EXPECT_TRUE(btree_union(lhs, other, 1) == NULL);
+    EXPECT_TRUE(btree_union(NULL, rhs, 1) == NULL);
+    void* empty = btree_intersect(lhs, rhs, 0);
+    ASSERT_TRUE(empty != NULL);
+    EXPECT_EQ(btree_count(empty), 0);
+    btree_destroy(empty, NULL);
+
+    bool isCreated = false;
+    for (uint64_t key = 0; key < 100; key++) {
+        *(int*)btree_insert((key % 3 == 0) ? lhs : rhs, &key, &isCreated) = 1;
+    }
+    void* merged = btree_union(lhs, rhs, 0);
+    EXPECT_EQ(btree_count(merged), 100);
+    const uint64_t key = 42;
+    const uint64_t next = 43;
+    EXPECT_EQ(*(int*)btree_item(merged, &key), 1);
+    EXPECT_LT(btree_compare(merged, &key, &next), 0);
+    EXPECT_GT(btree_compare(merged, &next, &key), 0);
+    void* left = btree_difference(merged, rhs, 0);
+    EXPECT_EQ(btree_count(left), btree_count(lhs));
+    btree_destroy(left, NULL);
+    btree_destroy(merged, NULL);
+    btree_destroy(lhs, NULL);
+    btree_destroy(rhs, NULL);
+    btree_destroy(other, NULL);
+}
+
+static bool holds_exactly(const void* btree, const std::map<int, int>& expected) {
+    std::vector<std::pair<int, int>> items;
+    btree_range(btree, NULL, NULL, collect_pair, &items);
+    if ((btree_count(btree) != expected.size()) || (items != std::vector<std::pair<int, int>>(expected.begin(), expected.end()))) {
+        return false;
+    }
+    size_t index = expected.size();
+    for (size_t id = btree_last(btree); id != btree_stop(btree); id = btree_prev(btree, id)) {
+        index--;
+        if (*(int*)((BTreeItem*)btree_current(btree, id))->key != items[index].first) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < items.size(); i += 1 + items.size() / 50) {
+        if ((*(int*)((BTreeItem*)btree_current(btree, btree_select(btree, i)))->key != items[i].first) ||
+            (btree_rank(btree, &items[i].first) != i)) {
+            return false;
+        }
+    }
+    return (index == 0) && height_is_logarithmic(btree);
+}
+
+TEST(EmergencySituation_btree_split, Test_1) {
+    //random cuts and joins against std::map, values never move
+    std::mt19937 random(31);
+    for (int round = 0; round < 40; round++) {
+        const int count = (round < 10) ? round * 7 : static_cast<int>(random() % 30000);
+        void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+        std::map<int, int> items;
+        bool isCreated = false;
+        for (int i = 0; i < count; i++) {
+            const int key = static_cast<int>(random() % 100000);
+            *(int*)btree_insert(btree, &key, &isCreated) = key;
+            items[key] = key;
+        }
+        std::map<int, void*> addresses;
+        for (const auto& item : items) {
+            addresses[item.first] = btree_item(btree, &item.first);
+        }
+        const int cut = (items.empty() || (round % 4 == 0)) ? static_cast<int>(random() % 100000) - 5 : std::next(items.begin(), random() % items.size())->first;
+        void* left = NULL;
+        void* right = NULL;
+        ASSERT_TRUE(btree_split(btree, &cut, &left, &right));
+        EXPECT_EQ(btree_count(btree), 0);
+        std::map<int, int> lower(items.begin(), items.lower_bound(cut));
+        std::map<int, int> upper(items.lower_bound(cut), items.end());
+        EXPECT_TRUE(holds_exactly(left, lower));
+        EXPECT_TRUE(holds_exactly(right, upper));
+        for (const auto& item : items) {
+            EXPECT_EQ(btree_item((item.first < cut) ? left : right, &item.first), addresses[item.first]);
+        }
+
+        // Both halves stay fully usable before they are glued back.
+        for (int i = 0; i < 200; i++) {
+            const int key = static_cast<int>(random() % 100000);
+            std::map<int, int>& side = (key < cut) ? lower : upper;
+            void* tree = (key < cut) ? left : right;
+            if (random() % 2 == 0) {
+                btree_remove(tree, &key, NULL);
+                side.erase(key);
+            }
+            else {
+                *(int*)btree_insert(tree, &key, &isCreated) = key;
+                side[key] = key;
+            }
+        }
+        EXPECT_TRUE(holds_exactly(left, lower));
+        EXPECT_TRUE(holds_exactly(right, upper));
+        EXPECT_TRUE(btree_join(left, right));
+        EXPECT_EQ(btree_count(right), 0);
+        lower.insert(upper.begin(), upper.end());
+        EXPECT_TRUE(holds_exactly(left, lower));
+        for (const auto& item : lower) {
+            btree_remove(left, &item.first, NULL);
+        }
+        EXPECT_EQ(btree_count(left), 0);
+        btree_destroy(btree, NULL);
+        btree_destroy(left, NULL);
+        btree_destroy(right, NULL);
+    }
+}
+
+TEST(EmergencySituation_btree_split, Test_2) {
+    //joins of very different heights, overlapping ranges and ids that follow their items
+    std::map<int, int> items;
+    void* btree = btree_create(sizeof(int), sizeof(int), compare_int);
+    bool isCreated = false;
+    for (int i = 0; i < 50000; i++) {
+        *(int*)btree_insert(btree, &i, &isCreated) = i;
+        items[i] = i;
+    }
+    const size_t old_id = btree_first(btree);
+    void* small = btree_create(sizeof(int), sizeof(int), compare_int);
+    for (int i = 50000; i < 50003; i++) {
+        *(int*)btree_insert(small, &i, &isCreated) = i;
+        items[i] = i;
+    }
+    const int moved_key = 50001;
+    const size_t moved_id = btree_lower_bound(small, &moved_key);
+    EXPECT_TRUE(btree_join(btree, small));
+    EXPECT_EQ(*(const int*)((const BTreeItem*)btree_current(btree, old_id))->key, 0);
+    EXPECT_EQ(*(const int*)((const BTreeItem*)btree_current(btree, moved_id))->key, 50001);
+    EXPECT_EQ(btree_next(btree, moved_id), btree_lower_bound(btree, &items.rbegin()->first));
+    btree_erase(small, moved_id, NULL);
+    EXPECT_TRUE(holds_exactly(btree, items));
+    for (int i = -3; i < 0; i++) {
+        *(int*)btree_insert(small, &i, &isCreated) = i;
+        items[i] = i;
+    }
+    EXPECT_TRUE(btree_join(small, btree));
+    EXPECT_TRUE(holds_exactly(small, items));
+    EXPECT_EQ(btree_count(btree), 0);
+
+    *(int*)btree_insert(btree, &items.begin()->first, &isCreated) = 0;
+    EXPECT_FALSE(btree_join(small, btree));
+    EXPECT_FALSE(btree_join(btree, small));
+    EXPECT_EQ(btree_count(btree), 1);
+    EXPECT_TRUE(holds_exactly(small, items));
+    btree_clear(btree, NULL);
+
+    // Peel the tree apart from the top and put it back together.
+    std::vector<void*> pieces;
+    void* rest = small;
+    for (int cut = 45000; cut > 0; cut -= 9000) {
+        void* left = NULL;
+        void* right = NULL;
+        ASSERT_TRUE(btree_split(rest, &cut, &left, &right));
+        btree_destroy(rest, NULL);
+        pieces.push_back(right);
+        rest = left;
+    }
+    for (size_t i = pieces.size(); i-- > 0;) {
+        EXPECT_TRUE(btree_join(rest, pieces[i]));
+        btree_destroy(pieces[i], NULL);
+    }
+    EXPECT_TRUE(holds_exactly(rest, items));
+
+    void* other = btree_create(sizeof(int), sizeof(double), compare_int);
+    void* ordered = btree_create_u64(sizeof(int));
+    EXPECT_FALSE(btree_join(rest, other));
+    EXPECT_FALSE(btree_join(ordered, rest));
+    void* snapshot = btree_snapshot(rest);
+    void* left = NULL;
+    void* right = NULL;
+    const int key = 10;
+    const size_t id = btree_lower_bound(rest, &key);
+    EXPECT_FALSE(btree_split(rest, &key, &left, &right));
+    btree_snapshot_release(snapshot, NULL);
+    EXPECT_TRUE(btree_split(rest, &key, &left, &right));
+    EXPECT_EQ(btree_count(left), 13);
+    EXPECT_EQ(btree_select(right, 0), id);
+    btree_erase(right, id, NULL);
+    EXPECT_TRUE(btree_current(right, id) == NULL);
+    EXPECT_EQ(btree_count(right), items.size() - 14);
+    btree_destroy(left, NULL);
+    btree_destroy(right, NULL);
+    btree_destroy(rest, NULL);
+    btree_destroy(other, NULL);
+    btree_destroy(ordered, NULL);
+    btree_destroy(btree, NULL);
+}
+
+struct ThrowingCopy {
+    static int copies_left;
+    static int alive;
+    int value;
+    explicit ThrowingCopy(int value) : value(value) {
+        alive++;
+    }
+    ThrowingCopy(const ThrowingCopy& other) : value(other.value) {
+        if (copies_left-- == 0) {
+            throw std::runtime_error("copy failed");
+        }
+        alive++;
+    }
+    ~ThrowingCopy() {
+        alive--;
+    }
+};
+int ThrowingCopy::copies_left = 0;
+int ThrowingCopy::alive = 0;
+
+TEST(EmergencySituation_btree_map, Test_4) {
+    //a copy that throws half way frees everything it already copied
+    {
+        btree::map<int, ThrowingCopy> tree;
+        for (int i = 0; i < 3000; i++) {
+            tree.emplace(i, i);
+        }
+        ThrowingCopy::copies_left = 1500;
+        typedef btree::map<int, ThrowingCopy> Tree;
+        EXPECT_THROW(Tree copy(tree), std::runtime_error);
+        EXPECT_EQ(ThrowingCopy::alive, 3000);
+        ThrowingCopy::copies_left = 3000;
+        btree::map<int, ThrowingCopy> copy(tree);
+        EXPECT_EQ(ThrowingCopy::alive, 6000);
+    }
+    EXPECT_EQ(ThrowingCopy::alive, 0);
+}
+
+TEST(EmergencySituation_btree_union, Test_3) {
+    //snapshot inputs merge like live trees, and their ranges walk in order
+    void* lhs = btree_create(sizeof(int), sizeof(int), compare_int);
+    void* rhs = btree_create(sizeof(int), sizeof(int), compare_int);
+    std::map<int, int> expected;
+    bool isCreated = false;
+    for (int i = 0; i < 40000; i++) {
+        *(int*)btree_insert((i % 3 == 0) ? rhs : lhs, &i, &isCreated) = i;
+        expected[i] = i;
+    }
+    void* lhs_snapshot = btree_snapshot(lhs);
+    void* rhs_snapshot = btree_snapshot(rhs);
+    for (int i = 0; i < 40000; i += 2) {
+        btree_remove(lhs, &i, NULL);
+        btree_remove(rhs, &i, NULL);
+    }
+    void* merged = btree_union(lhs_snapshot, rhs_snapshot, 4);
+    ASSERT_TRUE(merged != NULL);
+    std::vector<std::pair<int, int>> items;
+    btree_range(merged, NULL, NULL, collect_pair, &items);
+    const std::vector<std::pair<int, int>> all(expected.begin(), expected.end());
+    EXPECT_EQ(items, all);
+
+    const int low = 1234;
+    const int high = 30001;
+    items.clear();
+    btree_range(lhs_snapshot, &low, &high, collect_pair, &items);
+    std::vector<std::pair<int, int>> bounded;
+    for (int i = low; i < high; i++) {
+        if (i % 3 != 0) {
+            bounded.push_back({ i, i });
+        }
+    }
+    EXPECT_EQ(items, bounded);
+    btree_destroy(merged, NULL);
+    btree_snapshot_release(lhs_snapshot, NULL);
+    btree_snapshot_release(rhs_snapshot, NULL);
+    btree_destroy(lhs, NULL);
+    btree_destroy(rhs, NULL);
+}
@@ -1,235 +1,1560 @@
+// Ahead of every system header, so strict -std=c11 still declares the
+// MAP_ANONYMOUS flag the handle table is mapped with.
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
 #include "btree.h"
+#include "btree_thread.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Target size of one node allocation. Keys are stored inline, so a node
+// covers a handful of cache lines and one level of the search costs a few
+// sequential misses instead of one dependent miss per binary level.
+#define BTREE_NODE_BYTES 512
+#define BTREE_MIN_ORDER 4
+#define BTREE_MAX_ALIGN 16
+#define BTREE_CACHE_LINE 64
+// Lookups btree_item_many keeps in flight at once.
+#define BTREE_LOOKUP_GROUP 16
+// Parallel destroy hands every thread at least this many entries.
+#define BTREE_DESTROY_MIN_SHARE 16384
+#define BTREE_DESTROY_MAX_THREADS 64
+// Deeper than any tree that fits in memory with at least 2 keys per node.
+#define BTREE_MAX_HEIGHT 64
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define BTREE_PREFETCH(address) _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#elif defined(__GNUC__) || defined(__clang__)
+#define BTREE_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define BTREE_PREFETCH(address) ((void)(address))
+#endif
+
+// Item handles pack a slot index of the handle table with the generation
+// of that slot; the generation never reaches 0, so no handle equals
+// btree_stop.
+#define BTREE_HANDLE_INDEX_BITS ((sizeof(size_t) >= 8) ? 32 : 22)
+#define BTREE_HANDLE_INDEX_MASK (((size_t)1 << BTREE_HANDLE_INDEX_BITS) - 1)
+#define BTREE_HANDLE_GENERATIONS (~(size_t)0 >> BTREE_HANDLE_INDEX_BITS)
+// Slots of all trees live in one table of buckets that never move, so an
+// item keeps its handle while btree_split/btree_join hand it to another
+// tree. Trees take fresh slots a batch at a time.
+#define BTREE_HANDLE_BUCKET_BITS 16
+#define BTREE_HANDLE_BUCKET_SIZE ((size_t)1 << BTREE_HANDLE_BUCKET_BITS)
+#define BTREE_HANDLE_BUCKETS (((size_t)1 << BTREE_HANDLE_INDEX_BITS) >> BTREE_HANDLE_BUCKET_BITS)
+#define BTREE_HANDLE_BATCH 64
+
 typedef struct BTreeNode BTreeNode;
+typedef struct BTreeEntry BTreeEntry;
+typedef struct BTreeHandleSlot BTreeHandleSlot;
 typedef struct BTree BTree;
 
+// Key kinds with a built-in comparator get their own search loops, so the
+// hot path compares inline instead of calling through BTree::comp.
+typedef enum {
+    BTREE_KEY_CUSTOM,
+    BTREE_KEY_U64,
+    BTREE_KEY_I32,
+    BTREE_KEY_BYTES,
+    BTREE_KEY_NORMALIZED
+} BTreeKeyKind;
+
+
+// One stored pair, allocated as a single block with the key and the value
+// following the header at BTree::entry_key_offset/entry_value_offset.
+// Entries never move, so value pointers handed out by btree_insert and
+// btree_item stay valid while leaves split and merge. sharers counts the
+// leaves besides the first that link to the entry (see BTreeNode).
+struct BTreeEntry {
+    BTreeItem item;
+    BTreeNode* leaf;
+    size_t slot;
+    size_t handle;
+    volatile size_t sharers;
+};
+
+// A handle is valid while its slot still points at an entry and carries
+// the generation baked into the handle; releasing the slot bumps it. Only
+// the tree holding the entry touches the slot.
+struct BTreeHandleSlot {
+    BTreeEntry* entry;
+    size_t generation;
+    size_t next_free;
+};
 
+static BTreeHandleSlot* volatile handle_buckets[BTREE_HANDLE_BUCKETS];
+// Slots below handle_fresh were handed to some tree; destroyed trees leave
+// their free slots chained from handle_pool for the next one.
+static volatile size_t handle_fresh;
+static volatile size_t handle_pool = ~(size_t)0;
+
+// Internal nodes keep count separators and count + 1 children in links,
+// leaves keep count entries in links and are chained through prev/next.
+// Keys are copied inline at BTree::keys_offset. Every node has room for one
+// extra key so an insert can overflow it before it is split. total is the
+// number of entries below the node, which order statistics descend by.
+// sharers counts the owners besides the first (trees or parent nodes) once
+// snapshots share the node. Shared nodes are never changed in place except
+// for parent_node, prev_node and next_node, which belong to the live tree:
+// snapshots only ever descend from their root.
 struct BTreeNode {
-    BTreeItem* item;
-    BTreeNode* right_node;
-    BTreeNode* left_node;
     BTreeNode* parent_node;
+    BTreeNode* prev_node;
+    BTreeNode* next_node;
+    size_t count;
+    size_t total;
+    volatile size_t sharers;
+    bool is_leaf;
+    void* links[];
 };
 
 struct BTree {
     size_t key_size;
     size_t value_size;
     size_t size;
+    size_t order;
+    size_t node_size;
+    size_t keys_offset;
+    size_t entry_key_offset;
+    size_t entry_value_offset;
+    size_t entry_size;
+    size_t spare_count;
+    BTreeNode* spare_nodes;
     BTreeNode* root;
     int(*comp)(const void*, const void*);
+    BTreeKeyKind key_kind;
+    uint64_t(*normalize)(const void*);
+    size_t key_stride;
+    size_t slot_key_offset;
+    BTreeAllocator allocator;
+    // Slots this tree released, then the rest of its last fresh batch.
+    size_t free_handle;
+    size_t fresh_handle;
+    size_t fresh_end;
+    size_t destroy_threads;
+    // Set in snapshots, which are read-only and number their items by rank
+    // instead of by handle; counted in the tree they were taken from.
+    BTree* origin;
+    volatile size_t snapshots;
 };
 
-static BTreeNode* build_node(const BTree* tree, const void* key) {
-    if ((tree == NULL) || (key == NULL)) {
-        return NULL;
+static void* heap_allocate(void* context, size_t size) {
+    (void)context;
+    return malloc(size);
+}
+
+static void heap_release(void* context, void* block, size_t size) {
+    (void)context;
+    (void)size;
+    free(block);
+}
+
+static void* allocate_block(const BTree* tree, size_t size) {
+    return tree->allocator.allocate(tree->allocator.context, size);
+}
+
+static void release_block(const BTree* tree, void* block, size_t size) {
+    tree->allocator.release(tree->allocator.context, block, size);
+}
+
+static void release_node(const BTree* tree, BTreeNode* node) {
+    release_block(tree, node, tree->node_size);
+}
+
+static size_t align_up(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Largest power of two (up to BTREE_MAX_ALIGN) dividing size: a type's
+// alignment always divides its size, so this is enough for any key/value.
+static size_t size_alignment(size_t size) {
+    size_t alignment = 1;
+    while ((alignment < BTREE_MAX_ALIGN) && (size % (alignment * 2) == 0)) {
+        alignment *= 2;
     }
-    BTreeNode* node = calloc(sizeof(BTreeNode), 1);
+    return alignment;
+}
+
+// A normalized tree stores every node key behind its 8-byte prefix, so
+// moving keys between nodes moves the prefixes along with them.
+static void setup_layout(BTree* tree) {
+    tree->slot_key_offset = 0;
+    tree->key_stride = tree->key_size;
+    if (tree->normalize != NULL) {
+        const size_t alignment = (size_alignment(tree->key_size) > sizeof(uint64_t)) ? size_alignment(tree->key_size) : sizeof(uint64_t);
+        tree->slot_key_offset = align_up(sizeof(uint64_t), alignment);
+        tree->key_stride = align_up(tree->slot_key_offset + tree->key_size, alignment);
+    }
+    const size_t header = sizeof(BTreeNode);
+    const size_t slot_size = tree->key_stride + sizeof(void*);
+    size_t order = BTREE_MIN_ORDER;
+    if (BTREE_NODE_BYTES > header + 2 * sizeof(void*) + BTREE_MAX_ALIGN) {
+        const size_t room = BTREE_NODE_BYTES - header - 2 * sizeof(void*) - BTREE_MAX_ALIGN;
+        if (room / slot_size > order) {
+            order = room / slot_size;
+        }
+    }
+    tree->order = order;
+    tree->keys_offset = align_up(header + (order + 2) * sizeof(void*), BTREE_MAX_ALIGN);
+    tree->node_size = tree->keys_offset + (order + 1) * tree->key_stride;
+
+    tree->entry_key_offset = align_up(sizeof(BTreeEntry), size_alignment(tree->key_size));
+    tree->entry_value_offset = align_up(tree->entry_key_offset + tree->key_size, size_alignment(tree->value_size));
+    tree->entry_size = tree->entry_value_offset + tree->value_size;
+}
+
+static unsigned char* node_slot(const BTree* tree, const BTreeNode* node, size_t index) {
+    return (unsigned char*)node + tree->keys_offset + index * tree->key_stride;
+}
+
+static unsigned char* node_key(const BTree* tree, const BTreeNode* node, size_t index) {
+    return node_slot(tree, node, index) + tree->slot_key_offset;
+}
+
+static uint64_t node_prefix(const BTree* tree, const BTreeNode* node, size_t index) {
+    return *(const uint64_t*)node_slot(tree, node, index);
+}
+
+// Writes a key coming from outside the nodes, with its prefix if any.
+static void store_key(const BTree* tree, BTreeNode* node, size_t index, const void* key) {
+    memcpy(node_key(tree, node, index), key, tree->key_size);
+    if (tree->normalize != NULL) {
+        *(uint64_t*)node_slot(tree, node, index) = tree->normalize(key);
+    }
+}
+
+static void copy_keys(const BTree* tree, BTreeNode* to, size_t to_index, const BTreeNode* from, size_t from_index, size_t amount) {
+    memmove(node_slot(tree, to, to_index), node_slot(tree, from, from_index), amount * tree->key_stride);
+}
+
+static BTreeNode* node_child(const BTreeNode* node, size_t index) {
+    return (BTreeNode*)node->links[index];
+}
+
+static BTreeEntry* node_entry(const BTreeNode* node, size_t index) {
+    return (BTreeEntry*)node->links[index];
+}
+
+static void set_child(BTreeNode* node, size_t index, BTreeNode* child) {
+    node->links[index] = child;
+    child->parent_node = node;
+}
+
+static void set_entry(BTreeNode* leaf, size_t index, BTreeEntry* entry) {
+    leaf->links[index] = entry;
+    entry->leaf = leaf;
+    entry->slot = index;
+}
+
+static size_t min_keys(const BTree* tree) {
+    return tree->order / 2;
+}
+
+static BTreeNode* build_node(const BTree* tree, bool is_leaf) {
+    BTreeNode* node = allocate_block(tree, tree->node_size);
     if (node == NULL) {
         return NULL;
     }
-    node->item = (BTreeItem*)malloc(sizeof(BTreeItem));
-    if (node->item == NULL) {
-        free(node);
+    memset(node, 0, tree->node_size);
+    node->is_leaf = is_leaf;
+    return node;
+}
+
+static bool reserve_spares(BTree* tree, size_t needed) {
+    while (tree->spare_count < needed) {
+        BTreeNode* spare = build_node(tree, false);
+        if (spare == NULL) {
+            return false;
+        }
+        spare->parent_node = tree->spare_nodes;
+        tree->spare_nodes = spare;
+        tree->spare_count++;
+    }
+    return true;
+}
+
+// Makes sure the split cascade of an insert into leaf cannot fail halfway:
+// every node it may need is allocated before the tree is touched.
+static bool reserve_nodes(BTree* tree, const BTreeNode* leaf) {
+    size_t needed = 0;
+    const BTreeNode* node = leaf;
+    while ((node != NULL) && (node->count == tree->order)) {
+        needed++;
+        node = node->parent_node;
+    }
+    if ((needed > 0) && (node == NULL)) {
+        needed++;
+    }
+    return reserve_spares(tree, needed);
+}
+
+static BTreeNode* take_node(BTree* tree, bool is_leaf) {
+    BTreeNode* node = tree->spare_nodes;
+    tree->spare_nodes = node->parent_node;
+    tree->spare_count--;
+    node->parent_node = NULL;
+    node->is_leaf = is_leaf;
+    return node;
+}
+
+static void delete_spare_nodes(BTree* tree) {
+    while (tree->spare_nodes != NULL) {
+        BTreeNode* spare = tree->spare_nodes;
+        tree->spare_nodes = spare->parent_node;
+        release_node(tree, spare);
+    }
+    tree->spare_count = 0;
+}
+
+static size_t next_generation(size_t generation) {
+    return (generation == BTREE_HANDLE_GENERATIONS) ? 1 : generation + 1;
+}
+
+// Slots of a handle this tree never handed out may sit in a bucket that
+// another thread is still publishing; their ids are garbage either way.
+static BTreeHandleSlot* handle_slot(size_t index) {
+    BTreeHandleSlot* bucket = handle_buckets[index >> BTREE_HANDLE_BUCKET_BITS];
+    return (bucket == NULL) ? NULL : &bucket[index & (BTREE_HANDLE_BUCKET_SIZE - 1)];
+}
+
+// Buckets stay mapped for the life of the process, outside the heap, so
+// that heap leak checks do not count them against whoever came first.
+static void* map_handle_bucket(void) {
+    const size_t size = BTREE_HANDLE_BUCKET_SIZE * sizeof(BTreeHandleSlot);
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* bucket = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (bucket == MAP_FAILED) ? NULL : bucket;
+#endif
+}
+
+static void unmap_handle_bucket(void* bucket) {
+#ifdef _WIN32
+    VirtualFree(bucket, 0, MEM_RELEASE);
+#else
+    munmap(bucket, BTREE_HANDLE_BUCKET_SIZE * sizeof(BTreeHandleSlot));
+#endif
+}
+
+static bool take_pooled_handles(BTree* tree) {
+    size_t head = btree_atomic_load(&handle_pool);
+    while ((head != INVALID) && !btree_atomic_compare_exchange(&handle_pool, head, INVALID)) {
+        head = btree_atomic_load(&handle_pool);
+    }
+    tree->free_handle = head;
+    return head != INVALID;
+}
+
+static bool take_fresh_handles(BTree* tree) {
+    const size_t end = btree_atomic_add(&handle_fresh, BTREE_HANDLE_BATCH);
+    if (end > BTREE_HANDLE_INDEX_MASK) {
+        return false;
+    }
+    void* volatile* bucket = (void* volatile*)&handle_buckets[(end - 1) >> BTREE_HANDLE_BUCKET_BITS];
+    if (btree_atomic_load_pointer((void* const volatile*)bucket) == NULL) {
+        void* slots = map_handle_bucket();
+        if (slots == NULL) {
+            return false;
+        }
+        if (!btree_atomic_compare_exchange_pointer(bucket, NULL, slots)) {
+            unmap_handle_bucket(slots);
+        }
+    }
+    tree->fresh_handle = end - BTREE_HANDLE_BATCH;
+    tree->fresh_end = end;
+    return true;
+}
+
+static bool acquire_handle(BTree* tree, BTreeEntry* entry) {
+    if ((tree->free_handle == INVALID) && (tree->fresh_handle == tree->fresh_end) &&
+        !take_pooled_handles(tree) && !take_fresh_handles(tree)) {
+        return false;
+    }
+    size_t index = tree->free_handle;
+    BTreeHandleSlot* slot = NULL;
+    if (index != INVALID) {
+        slot = handle_slot(index);
+        tree->free_handle = slot->next_free;
+    }
+    else {
+        index = tree->fresh_handle++;
+        slot = handle_slot(index);
+    }
+    if (slot->generation == 0) {
+        slot->generation = 1;
+    }
+    slot->entry = entry;
+    entry->handle = (slot->generation << BTREE_HANDLE_INDEX_BITS) | index;
+    return true;
+}
+
+static void release_handle(BTree* tree, const BTreeEntry* entry) {
+    const size_t index = entry->handle & BTREE_HANDLE_INDEX_MASK;
+    BTreeHandleSlot* slot = handle_slot(index);
+    slot->entry = NULL;
+    slot->generation = next_generation(slot->generation);
+    slot->next_free = tree->free_handle;
+    tree->free_handle = index;
+}
+
+// Chains the free slots of a tree about to go, fresh ones included, onto
+// handle_pool.
+static void give_back_handles(BTree* tree) {
+    while (tree->fresh_handle != tree->fresh_end) {
+        BTreeHandleSlot* slot = handle_slot(tree->fresh_handle);
+        slot->next_free = tree->free_handle;
+        tree->free_handle = tree->fresh_handle++;
+    }
+    if (tree->free_handle == INVALID) {
+        return;
+    }
+    BTreeHandleSlot* last = handle_slot(tree->free_handle);
+    while (last->next_free != INVALID) {
+        last = handle_slot(last->next_free);
+    }
+    do {
+        last->next_free = btree_atomic_load(&handle_pool);
+    } while (!btree_atomic_compare_exchange(&handle_pool, last->next_free, tree->free_handle));
+    tree->free_handle = INVALID;
+}
+
+static BTreeEntry* handle_entry(const BTree* tree, size_t item_id) {
+    if (tree == NULL) {
         return NULL;
     }
-    node->item->value = malloc(tree->value_size);
-    node->item->key = malloc(tree->key_size);
-    if ((node->item->value == NULL) || (node->item->key == NULL)) {
-        free(node->item->value);
-        free((void*)node->item->key);
-    	free(node->item);
-        free(node);
+    const BTreeHandleSlot* slot = handle_slot(item_id & BTREE_HANDLE_INDEX_MASK);
+    if ((slot == NULL) || (slot->entry == NULL) || (slot->generation != (item_id >> BTREE_HANDLE_INDEX_BITS))) {
         return NULL;
     }
-    memcpy((void*)node->item->key, key, tree->key_size);
-    return node;
+    return slot->entry;
+}
+
+// Handles of all trees share one table, so an id may name an item that
+// another tree holds.
+static bool holds_entry(const BTree* tree, const BTreeEntry* entry) {
+    const BTreeNode* node = entry->leaf;
+    while (node->parent_node != NULL) {
+        node = node->parent_node;
+    }
+    return node == tree->root;
+}
+
+static size_t entry_handle(const BTreeEntry* entry) {
+    return (entry == NULL) ? (size_t)NULL : entry->handle;
 }
 
-static BTreeNode* traversal_tree(BTreeNode* node, const void* key, int(*compare)(const void*, const void*), bool* flag) {
-    if ((node == NULL) || (key == NULL) || (flag == NULL) || (compare == NULL)) {
+static BTreeEntry* build_entry(BTree* tree, const void* key) {
+    if ((tree == NULL) || (key == NULL)) {
+        return NULL;
+    }
+    BTreeEntry* entry = allocate_block(tree, tree->entry_size);
+    if (entry == NULL) {
         return NULL;
     }
+    if (!acquire_handle(tree, entry)) {
+        release_block(tree, entry, tree->entry_size);
+        return NULL;
+    }
+    entry->item.key = (unsigned char*)entry + tree->entry_key_offset;
+    entry->item.value = (unsigned char*)entry + tree->entry_value_offset;
+    entry->leaf = NULL;
+    entry->slot = 0;
+    entry->sharers = 0;
+    memcpy((void*)entry->item.key, key, tree->key_size);
+    return entry;
+}
 
-    while (true)
-    {
-        const int route = compare(node->item->key, key);
-        if (route == 0) {
-            *flag = true;
-            return node;
+// Runs destroy and gives the block back; the handle is left to the caller.
+static void release_entry(const BTree* tree, BTreeEntry* entry, void(*destroy)(void*)) {
+    if (entry == NULL) {
+        return;
+    }
+    if (destroy != NULL) {
+        destroy(&entry->item);
+    }
+    release_block(tree, entry, tree->entry_size);
+}
+
+// Gives up one owner of a node or entry; true when it was the last one.
+// An unshared block can not gain owners behind the caller's back: only its
+// owner shares it further.
+static bool drop_owner(volatile size_t* sharers) {
+    if (btree_atomic_load(sharers) == 0) {
+        return true;
+    }
+    return btree_atomic_add(sharers, (size_t)-1) == (size_t)-1;
+}
+
+// An entry a snapshot still holds is destroyed when the snapshot lets go.
+static void delete_entry(BTree* tree, BTreeEntry* entry, void(*destroy)(void*)) {
+    if (entry == NULL) {
+        return;
+    }
+    release_handle(tree, entry);
+    if (drop_owner(&entry->sharers)) {
+        release_entry(tree, entry, destroy);
+    }
+}
+
+static int compare_u64(const void* lhsp, const void* rhsp) {
+    const uint64_t lhs = *(const uint64_t*)lhsp;
+    const uint64_t rhs = *(const uint64_t*)rhsp;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static int compare_i32(const void* lhsp, const void* rhsp) {
+    const int32_t lhs = *(const int32_t*)lhsp;
+    const int32_t rhs = *(const int32_t*)rhsp;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static int compare_keys(const BTree* tree, const void* lhs, const void* rhs) {
+    switch (tree->key_kind) {
+    case BTREE_KEY_U64:
+        return compare_u64(lhs, rhs);
+    case BTREE_KEY_I32:
+        return compare_i32(lhs, rhs);
+    case BTREE_KEY_BYTES:
+        return memcmp(lhs, rhs, tree->key_size);
+    default:
+        return tree->comp(lhs, rhs);
+    }
+}
+
+static size_t bound_u64(const BTree* tree, const BTreeNode* node, size_t low, size_t high, uint64_t key, bool* found) {
+    const uint64_t* keys = (const uint64_t*)node_key(tree, node, 0);
+    const size_t end = high;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (keys[middle] < key) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
         }
-        if (route > 0) {
-            if (node->left_node == NULL) return node;
-            node = node->left_node;
+    }
+    *found = (low < end) && (keys[low] == key);
+    return low;
+}
+
+static size_t bound_i32(const BTree* tree, const BTreeNode* node, size_t low, size_t high, int32_t key, bool* found) {
+    const int32_t* keys = (const int32_t*)node_key(tree, node, 0);
+    const size_t end = high;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (keys[middle] < key) {
+            low = middle + 1;
         }
+        else {
+            high = middle;
+        }
+    }
+    *found = (low < end) && (keys[low] == key);
+    return low;
+}
+
+static size_t bound_bytes(const BTree* tree, const BTreeNode* node, size_t low, size_t high, const void* key, bool* found) {
+    *found = false;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        const int route = memcmp(node_key(tree, node, middle), key, tree->key_size);
+        if (route < 0) {
+            low = middle + 1;
+        }
+        else {
+            if (route == 0) {
+                *found = true;
+            }
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static size_t bound_custom(const BTree* tree, const BTreeNode* node, size_t low, size_t high, const void* key, bool* found) {
+    *found = false;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        const int route = tree->comp(node_key(tree, node, middle), key);
         if (route < 0) {
-            if (node->right_node == NULL) return node;
-            node = node->right_node;
+            low = middle + 1;
+        }
+        else {
+            if (route == 0) {
+                *found = true;
+            }
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Integer comparison of the prefixes settles most steps; the comparator
+// only runs between keys whose prefixes are equal.
+static size_t bound_prefixed(const BTree* tree, const BTreeNode* node, size_t low, size_t high, const void* key, uint64_t prefix, bool* found) {
+    *found = false;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        const uint64_t probe = node_prefix(tree, node, middle);
+        const int route = (probe != prefix) ? ((probe < prefix) ? -1 : 1) : tree->comp(node_key(tree, node, middle), key);
+        if (route < 0) {
+            low = middle + 1;
+        }
+        else {
+            if (route == 0) {
+                *found = true;
+            }
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Index of the first key in node[low, high) that is not less than key.
+static size_t bound_in_range(const BTree* tree, const BTreeNode* node, size_t low, size_t high, const void* key, bool* found) {
+    switch (tree->key_kind) {
+    case BTREE_KEY_U64: {
+        uint64_t value;
+        memcpy(&value, key, sizeof(value));
+        return bound_u64(tree, node, low, high, value, found);
+    }
+    case BTREE_KEY_I32: {
+        int32_t value;
+        memcpy(&value, key, sizeof(value));
+        return bound_i32(tree, node, low, high, value, found);
+    }
+    case BTREE_KEY_BYTES:
+        return bound_bytes(tree, node, low, high, key, found);
+    case BTREE_KEY_NORMALIZED:
+        return bound_prefixed(tree, node, low, high, key, tree->normalize(key), found);
+    default:
+        return bound_custom(tree, node, low, high, key, found);
+    }
+}
+
+static size_t lower_bound(const BTree* tree, const BTreeNode* node, const void* key, bool* found) {
+    return bound_in_range(tree, node, 0, node->count, key, found);
+}
+
+// Same as lower_bound for a key known not to sort before index from:
+// probes from, from + 1, from + 3, ... and then bisects the last gap, so
+// keys landing close to the previous one cost a couple of comparisons.
+static size_t gallop_bound(const BTree* tree, const BTreeNode* node, size_t from, const void* key, bool* found) {
+    size_t low = from;
+    size_t step = 1;
+    while (low < node->count) {
+        const size_t probe = (low + step <= node->count) ? low + step - 1 : node->count - 1;
+        const int route = compare_keys(tree, node_key(tree, node, probe), key);
+        if (route >= 0) {
+            if (probe == low) {
+                *found = (route == 0);
+                return low;
+            }
+            return bound_in_range(tree, node, low, probe + 1, key, found);
         }
+        low = probe + 1;
+        step *= 2;
+    }
+    *found = false;
+    return node->count;
+}
+
+static size_t child_index(const BTree* tree, const BTreeNode* node, const void* key) {
+    bool found = false;
+    const size_t index = lower_bound(tree, node, key, &found);
+    return found ? index + 1 : index;
+}
+
+// Requests every cache line of node, so the binary search that follows
+// finds the keys and links already on their way.
+static void prefetch_node(const BTree* tree, const BTreeNode* node) {
+    for (size_t offset = 0; offset < tree->node_size; offset += BTREE_CACHE_LINE) {
+        BTREE_PREFETCH((const unsigned char*)node + offset);
+    }
+}
+
+static BTreeNode* traversal_u64(const BTree* tree, BTreeNode* node, uint64_t key) {
+    while (!node->is_leaf) {
+        bool found = false;
+        const size_t index = bound_u64(tree, node, 0, node->count, key, &found);
+        node = node_child(node, found ? index + 1 : index);
+    }
+    return node;
+}
+
+static BTreeNode* traversal_i32(const BTree* tree, BTreeNode* node, int32_t key) {
+    while (!node->is_leaf) {
+        bool found = false;
+        const size_t index = bound_i32(tree, node, 0, node->count, key, &found);
+        node = node_child(node, found ? index + 1 : index);
+    }
+    return node;
+}
+
+static BTreeNode* traversal_prefixed(const BTree* tree, BTreeNode* node, const void* key, uint64_t prefix) {
+    while (!node->is_leaf) {
+        bool found = false;
+        const size_t index = bound_prefixed(tree, node, 0, node->count, key, prefix, &found);
+        node = node_child(node, found ? index + 1 : index);
     }
+    return node;
 }
 
-static void delete_node(BTreeNode* node, void(*destroy)(void*)) {
+// Leaf that holds key, or the leaf key would be inserted into. Integer keys
+// are loaded once and normalized keys are normalized once, and both descend
+// through their own loops.
+static BTreeNode* traversal_tree(const BTree* tree, const void* key) {
+    BTreeNode* node = tree->root;
     if (node == NULL) {
-        return;
+        return NULL;
     }
-    if (destroy != NULL) {
-        destroy(node->item);
+    if (tree->key_kind == BTREE_KEY_U64) {
+        uint64_t value;
+        memcpy(&value, key, sizeof(value));
+        return traversal_u64(tree, node, value);
+    }
+    if (tree->key_kind == BTREE_KEY_I32) {
+        int32_t value;
+        memcpy(&value, key, sizeof(value));
+        return traversal_i32(tree, node, value);
+    }
+    if (tree->key_kind == BTREE_KEY_NORMALIZED) {
+        return traversal_prefixed(tree, node, key, tree->normalize(key));
+    }
+    while (!node->is_leaf) {
+        node = node_child(node, child_index(tree, node, key));
+    }
+    return node;
+}
+
+static BTreeEntry* find_entry(const BTree* tree, const void* key) {
+    const BTreeNode* leaf = traversal_tree(tree, key);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    bool found = false;
+    const size_t slot = lower_bound(tree, leaf, key, &found);
+    return found ? node_entry(leaf, slot) : NULL;
+}
+
+// Entry at slot of leaf, continuing into the next leaf when slot is past
+// the end; NULL past the last leaf.
+static BTreeEntry* entry_from(const BTreeNode* leaf, size_t slot) {
+    if (slot < leaf->count) {
+        return node_entry(leaf, slot);
     }
-    free((void*)node->item->key);
-    free(node->item->value);
-    free(node->item);
-    free(node);
+    return (leaf->next_node != NULL) ? node_entry(leaf->next_node, 0) : NULL;
 }
 
-static BTreeNode* leftmost_node(BTreeNode*  node) {
+// First entry whose key is not less than key (or greater than key when
+// strict is set), NULL when there is none.
+static BTreeEntry* bound_entry(const BTree* tree, const void* key, bool strict) {
+    const BTreeNode* leaf = traversal_tree(tree, key);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    bool found = false;
+    const size_t slot = lower_bound(tree, leaf, key, &found);
+    return entry_from(leaf, (found && strict) ? slot + 1 : slot);
+}
+
+static BTreeNode* leftmost_leaf(BTreeNode* node) {
     if (node == NULL) {
         return NULL;
     }
-    while (node->left_node != NULL) {
-        node = node->left_node;
+    while (!node->is_leaf) {
+        node = node_child(node, 0);
     }
     return node;
 }
 
-static BTreeNode* rightmost_node(BTreeNode* node) {
+static BTreeNode* rightmost_leaf(BTreeNode* node) {
     if (node == NULL) {
         return NULL;
     }
-    while(node->right_node != NULL) {
-        node = node->right_node;
+    while (!node->is_leaf) {
+        node = node_child(node, node->count);
     }
     return node;
 }
 
-static void decoupling_leaf(const BTreeNode* node, int(*compare)(const void*, const void*)) {
-    if (node->parent_node == NULL) {
+static size_t child_position(const BTreeNode* parent, const BTreeNode* child) {
+    size_t index = 0;
+    while (node_child(parent, index) != child) {
+        index++;
+    }
+    return index;
+}
+
+static void recount_node(BTreeNode* node) {
+    if (node->is_leaf) {
+        node->total = node->count;
         return;
     }
-    const int meaning = compare(node->parent_node->item->key, node->item->key);
-    if (meaning <= 0) {
-        node->parent_node->right_node = NULL;
+    node->total = 0;
+    for (size_t i = 0; i <= node->count; i++) {
+        node->total += node_child(node, i)->total;
     }
-    else {
-        node->parent_node->left_node = NULL;
+}
+
+// Carries one entry added to (grow) or removed from node up to the root.
+static void update_totals(BTreeNode* node, bool grow) {
+    for (; node != NULL; node = node->parent_node) {
+        if (grow) {
+            node->total++;
+        }
+        else {
+            node->total--;
+        }
     }
 }
 
-static void decoupling_node_path(BTreeNode* node, int(*compare)(const void*, const void*), BTree* tree) {
-    if (node->parent_node->parent_node == NULL) {
-        tree->root = node;
-        node->parent_node = NULL;
+static void shift_keys(const BTree* tree, BTreeNode* node, size_t from, size_t to, size_t amount) {
+    copy_keys(tree, node, to, node, from, amount);
+}
+
+static void shift_links(BTreeNode* node, size_t from, size_t to, size_t amount) {
+    memmove(&node->links[to], &node->links[from], amount * sizeof(void*));
+    if (node->is_leaf) {
+        for (size_t i = 0; i < amount; i++) {
+            node_entry(node, to + i)->slot = to + i;
+        }
+    }
+}
+
+static void split_node(BTree* tree, BTreeNode* node);
+
+static void insert_into_parent(BTree* tree, BTreeNode* left, const void* key, BTreeNode* right) {
+    BTreeNode* parent = left->parent_node;
+    if (parent == NULL) {
+        parent = take_node(tree, false);
+        store_key(tree, parent, 0, key);
+        set_child(parent, 0, left);
+        set_child(parent, 1, right);
+        parent->count = 1;
+        parent->total = left->total + right->total;
+        tree->root = parent;
+        return;
+    }
+    const size_t index = child_position(parent, left);
+    shift_keys(tree, parent, index, index + 1, parent->count - index);
+    shift_links(parent, index + 1, index + 2, parent->count - index);
+    store_key(tree, parent, index, key);
+    set_child(parent, index + 1, right);
+    parent->count++;
+    if (parent->count > tree->order) {
+        split_node(tree, parent);
+    }
+}
+
+// Moves the upper half of an overflowing node into a new right sibling and
+// posts the separator to the parent.
+static void split_node(BTree* tree, BTreeNode* node) {
+    BTreeNode* right = take_node(tree, node->is_leaf);
+    const size_t middle = node->count / 2;
+    if (node->is_leaf) {
+        right->count = node->count - middle;
+        copy_keys(tree, right, 0, node, middle, right->count);
+        for (size_t i = 0; i < right->count; i++) {
+            set_entry(right, i, node_entry(node, middle + i));
+        }
+        node->count = middle;
+        right->prev_node = node;
+        right->next_node = node->next_node;
+        if (node->next_node != NULL) {
+            node->next_node->prev_node = right;
+        }
+        node->next_node = right;
+        recount_node(node);
+        recount_node(right);
+        insert_into_parent(tree, node, node_key(tree, right, 0), right);
         return;
     }
-    const int meaning = compare(node->parent_node->parent_node->item->key, node->item->key);
-    if (meaning <= 0) {
-        node->parent_node->parent_node->right_node = node;
+    right->count = node->count - middle - 1;
+    copy_keys(tree, right, 0, node, middle + 1, right->count);
+    for (size_t i = 0; i <= right->count; i++) {
+        set_child(right, i, node_child(node, middle + 1 + i));
+    }
+    node->count = middle;
+    recount_node(node);
+    recount_node(right);
+    insert_into_parent(tree, node, node_key(tree, node, middle), right);
+}
+
+static void remove_from_node(const BTree* tree, BTreeNode* node, size_t key_index, size_t link_index) {
+    shift_keys(tree, node, key_index + 1, key_index, node->count - key_index - 1);
+    shift_links(node, link_index + 1, link_index, node->count + (node->is_leaf ? 0 : 1) - link_index - 1);
+    node->count--;
+}
+
+static void borrow_from_left(const BTree* tree, BTreeNode* node, BTreeNode* left, BTreeNode* parent, size_t index) {
+    shift_keys(tree, node, 0, 1, node->count);
+    if (node->is_leaf) {
+        shift_links(node, 0, 1, node->count);
+        copy_keys(tree, node, 0, left, left->count - 1, 1);
+        set_entry(node, 0, node_entry(left, left->count - 1));
+        copy_keys(tree, parent, index - 1, node, 0, 1);
     }
     else {
-        node->parent_node->parent_node->left_node = node;
+        shift_links(node, 0, 1, node->count + 1);
+        copy_keys(tree, node, 0, parent, index - 1, 1);
+        set_child(node, 0, node_child(left, left->count));
+        copy_keys(tree, parent, index - 1, left, left->count - 1, 1);
     }
-    node->parent_node = node->parent_node->parent_node;
+    const size_t moved = node->is_leaf ? 1 : node_child(node, 0)->total;
+    node->total += moved;
+    left->total -= moved;
+    node->count++;
+    left->count--;
 }
 
-static void node_remove(BTreeNode* node, int(*compare)(const void*, const void*), void(*destroy)(void*), BTree* tree) {
-    if ((node->left_node == NULL) && (node->right_node == NULL)) {
-        decoupling_leaf(node, compare);
-        delete_node(node, destroy);
+static void borrow_from_right(const BTree* tree, BTreeNode* node, BTreeNode* right, BTreeNode* parent, size_t index) {
+    if (node->is_leaf) {
+        copy_keys(tree, node, node->count, right, 0, 1);
+        set_entry(node, node->count, node_entry(right, 0));
+        node->count++;
+        remove_from_node(tree, right, 0, 0);
+        copy_keys(tree, parent, index, right, 0, 1);
+        node->total++;
+        right->total--;
     }
-    else if ((node->left_node == NULL) && (node->right_node != NULL)) {
-        decoupling_node_path(node->right_node, compare, tree);
-        delete_node(node, destroy);
+    else {
+        const size_t moved = node_child(right, 0)->total;
+        copy_keys(tree, node, node->count, parent, index, 1);
+        set_child(node, node->count + 1, node_child(right, 0));
+        node->count++;
+        copy_keys(tree, parent, index, right, 0, 1);
+        remove_from_node(tree, right, 0, 0);
+        node->total += moved;
+        right->total -= moved;
     }
-    else if ((node->left_node != NULL) && (node->right_node == NULL)) {
-        decoupling_node_path(node->left_node, compare, tree);
-        delete_node(node, destroy);
+}
+
+// Appends right to left, drops the separator between them from parent and
+// frees right.
+static void merge_nodes(const BTree* tree, BTreeNode* left, BTreeNode* right, BTreeNode* parent, size_t index) {
+    if (left->is_leaf) {
+        copy_keys(tree, left, left->count, right, 0, right->count);
+        for (size_t i = 0; i < right->count; i++) {
+            set_entry(left, left->count + i, node_entry(right, i));
+        }
+        left->count += right->count;
+        left->next_node = right->next_node;
+        if (right->next_node != NULL) {
+            right->next_node->prev_node = left;
+        }
     }
-    else if ((node->left_node != NULL) && (node->right_node != NULL)) {
-        BTreeNode* left_root = leftmost_node(node->right_node);
-        if (destroy != NULL) {
-            destroy(node->item);
+    else {
+        copy_keys(tree, left, left->count, parent, index, 1);
+        copy_keys(tree, left, left->count + 1, right, 0, right->count);
+        for (size_t i = 0; i <= right->count; i++) {
+            set_child(left, left->count + 1 + i, node_child(right, i));
         }
-        memcpy((void*)node->item->key, left_root->item->key, tree->key_size);
-        memcpy(node->item->value, left_root->item->value, tree->value_size);
-        node_remove(left_root, compare, NULL, tree);
+        left->count += right->count + 1;
     }
+    left->total += right->total;
+    remove_from_node(tree, parent, index, index + 1);
+    release_node(tree, right);
 }
 
-static void delete_all_nodes(BTreeNode* node, void(*destroy)(void*)) {
-    if (node == NULL) {
+// Restores the minimum fill of node after a removal, walking up while
+// merges leave parents underfull.
+static void rebalance_node(BTree* tree, BTreeNode* node) {
+    while (node != NULL) {
+        BTreeNode* parent = node->parent_node;
+        if (parent == NULL) {
+            if (node->count == 0) {
+                tree->root = node->is_leaf ? NULL : node_child(node, 0);
+                if (tree->root != NULL) {
+                    tree->root->parent_node = NULL;
+                }
+                release_node(tree, node);
+            }
+            return;
+        }
+        if (node->count >= min_keys(tree)) {
+            return;
+        }
+        const size_t index = child_position(parent, node);
+        BTreeNode* left = (index > 0) ? node_child(parent, index - 1) : NULL;
+        BTreeNode* right = (index < parent->count) ? node_child(parent, index + 1) : NULL;
+        if ((left != NULL) && (left->count > min_keys(tree))) {
+            borrow_from_left(tree, node, left, parent, index);
+            return;
+        }
+        if ((right != NULL) && (right->count > min_keys(tree))) {
+            borrow_from_right(tree, node, right, parent, index);
+            return;
+        }
+        if (left != NULL) {
+            merge_nodes(tree, left, node, parent, index - 1);
+        }
+        else {
+            merge_nodes(tree, node, right, parent, index);
+        }
+        node = parent;
+    }
+}
+
+// Unlinks entry through its own leaf/slot back-pointers: no search.
+static void erase_entry(BTree* tree, BTreeEntry* entry, void(*destroy)(void*)) {
+    BTreeNode* leaf = entry->leaf;
+    remove_from_node(tree, leaf, entry->slot, entry->slot);
+    update_totals(leaf, false);
+    delete_entry(tree, entry, destroy);
+    tree->size -= 1;
+    rebalance_node(tree, leaf);
+}
+
+static BTreeEntry* next_entry(const BTreeEntry* entry) {
+    return entry_from(entry->leaf, entry->slot + 1);
+}
+
+static BTreeEntry* prev_entry(const BTreeEntry* entry) {
+    if (entry->slot > 0) {
+        return node_entry(entry->leaf, entry->slot - 1);
+    }
+    const BTreeNode* leaf = entry->leaf->prev_node;
+    return (leaf != NULL) ? node_entry(leaf, leaf->count - 1) : NULL;
+}
+
+// Gives up one owner's hold on the subtree under node: blocks owned
+// elsewhere too just lose a sharer, the rest is freed, running destroy on
+// the entries. Descends with a stack, since parent_node of a node only a
+// snapshot holds may point anywhere.
+static void drop_subtree(const BTree* tree, BTreeNode* node, void(*destroy)(void*)) {
+    if ((node == NULL) || !drop_owner(&node->sharers)) {
         return;
     }
-    if (node->left_node != NULL) {
-        BTreeNode* left_node = node->left_node;
-        left_node->parent_node = NULL;
-        node->left_node = NULL;
-        delete_all_nodes(left_node, destroy);
+    BTreeNode* path[BTREE_MAX_HEIGHT];
+    size_t next[BTREE_MAX_HEIGHT];
+    size_t depth = 0;
+    path[depth] = node;
+    next[depth++] = 0;
+    while (depth > 0) {
+        node = path[depth - 1];
+        if (node->is_leaf) {
+            for (size_t i = 0; i < node->count; i++) {
+                BTreeEntry* entry = node_entry(node, i);
+                if (drop_owner(&entry->sharers)) {
+                    release_entry(tree, entry, (entry->leaf != NULL) ? destroy : NULL);
+                }
+            }
+        }
+        else if (next[depth - 1] <= node->count) {
+            BTreeNode* child = node_child(node, next[depth - 1]++);
+            if (drop_owner(&child->sharers)) {
+                path[depth] = child;
+                next[depth++] = 0;
+            }
+            continue;
+        }
+        release_node(tree, node);
+        depth--;
     }
-    if (node->right_node != NULL) {
-        BTreeNode* right_node = node->right_node;
-        right_node->parent_node = NULL;
-        node->right_node = NULL;
-        delete_all_nodes(right_node, destroy);
+}
+
+// Private copy of a shared node for the live tree to change. The copy takes
+// over the tree's share of node and adds one to everything node links to.
+// Only the parts of the header the live tree owns are read from node.
+static BTreeNode* copy_node(BTree* tree, BTreeNode* node) {
+    BTreeNode* copy = allocate_block(tree, tree->node_size);
+    if (copy == NULL) {
+        return NULL;
     }
-    delete_node(node, destroy);
+    const size_t header = offsetof(BTreeNode, links);
+    memcpy(copy->links, node->links, tree->node_size - header);
+    copy->parent_node = node->parent_node;
+    copy->prev_node = node->prev_node;
+    copy->next_node = node->next_node;
+    copy->count = node->count;
+    copy->total = node->total;
+    copy->sharers = 0;
+    copy->is_leaf = node->is_leaf;
+    if (copy->is_leaf) {
+        for (size_t i = 0; i < copy->count; i++) {
+            btree_atomic_add(&node_entry(copy, i)->sharers, 1);
+            node_entry(copy, i)->leaf = copy;
+        }
+        if (copy->prev_node != NULL) {
+            copy->prev_node->next_node = copy;
+        }
+        if (copy->next_node != NULL) {
+            copy->next_node->prev_node = copy;
+        }
+    }
+    else {
+        for (size_t i = 0; i <= copy->count; i++) {
+            btree_atomic_add(&node_child(copy, i)->sharers, 1);
+            node_child(copy, i)->parent_node = copy;
+        }
+    }
+    drop_subtree(tree, node, NULL);
+    return copy;
 }
 
-static bool functor_next(size_t* item_id) {
-    const BTreeNode* node = (const BTreeNode*)*item_id;
-    if (node->right_node != NULL) {
-        *item_id = (size_t)leftmost_node(node->right_node);
-        return true;
+// Child at index of an unshared parent, copied first if it is shared.
+static BTreeNode* own_child(BTree* tree, BTreeNode* parent, size_t index) {
+    BTreeNode* child = node_child(parent, index);
+    if (btree_atomic_load(&child->sharers) == 0) {
+        return child;
+    }
+    BTreeNode* copy = copy_node(tree, child);
+    if (copy != NULL) {
+        set_child(parent, index, copy);
     }
-    return false;
+    return copy;
 }
 
-static bool functor_prev(size_t* item_id) {
-    const BTreeNode* node = (const BTreeNode*)*item_id;
-    if (node->left_node != NULL) {
-        *item_id = (size_t)rightmost_node(node->left_node);
+// Unshares every node on the path to key before a write, and the siblings
+// beside it when a removal may borrow from or merge with them. A copy that
+// fails leaves the tree intact, only less shared.
+static bool own_path(BTree* tree, const void* key, bool siblings) {
+    BTreeNode* node = tree->root;
+    if (node == NULL) {
         return true;
     }
-    return false;
+    if (btree_atomic_load(&node->sharers) != 0) {
+        node = copy_node(tree, node);
+        if (node == NULL) {
+            return false;
+        }
+        node->parent_node = NULL;
+        tree->root = node;
+    }
+    while (!node->is_leaf) {
+        const size_t index = child_index(tree, node, key);
+        if (siblings && (((index > 0) && (own_child(tree, node, index - 1) == NULL)) ||
+            ((index < node->count) && (own_child(tree, node, index + 1) == NULL)))) {
+            return false;
+        }
+        node = own_child(tree, node, index);
+        if (node == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Gives an entry that snapshots share a block of its own under the same
+// handle before its value may be overwritten. The leaf must be unshared.
+static BTreeEntry* own_entry(BTree* tree, BTreeEntry* entry) {
+    if (btree_atomic_load(&entry->sharers) == 0) {
+        return entry;
+    }
+    BTreeEntry* copy = allocate_block(tree, tree->entry_size);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy((unsigned char*)copy + tree->entry_key_offset, entry->item.key, tree->entry_size - tree->entry_key_offset);
+    copy->item.key = (unsigned char*)copy + tree->entry_key_offset;
+    copy->item.value = (unsigned char*)copy + tree->entry_value_offset;
+    copy->handle = entry->handle;
+    copy->sharers = 0;
+    set_entry(entry->leaf, entry->slot, copy);
+    handle_slot(entry->handle & BTREE_HANDLE_INDEX_MASK)->entry = copy;
+    // The item lives on in the copy, so the old block must not be destroyed.
+    entry->leaf = NULL;
+    if (drop_owner(&entry->sharers)) {
+        release_entry(tree, entry, NULL);
+    }
+    return copy;
 }
 
-static bool key_less(const void* first_key, const void* second_key, int(*compare)(const void*, const void*)) {
-    return compare(first_key, second_key) < 0;
+// Writes only copy nodes while snapshots of the tree are alive.
+static bool has_snapshots(const BTree* tree) {
+    return btree_atomic_load(&tree->snapshots) != 0;
 }
 
-static bool key_more(const void* first_key, const void* second_key, int(*compare)(const void*, const void*)) {
-    return compare(first_key, second_key) > 0;
+// Nodes can only move between trees that allocate alike, and none of
+// them may be shared with a snapshot or released in bulk by a pool.
+static bool can_move_nodes(const BTree* tree) {
+    return (tree->origin == NULL) && !has_snapshots(tree) && (tree->allocator.release_all == NULL);
+}
+
+static bool same_layout(const BTree* lhs, const BTree* rhs) {
+    return (lhs->key_size == rhs->key_size) && (lhs->value_size == rhs->value_size) &&
+        (lhs->comp == rhs->comp) && (lhs->key_kind == rhs->key_kind) && (lhs->normalize == rhs->normalize) &&
+        (lhs->allocator.allocate == rhs->allocator.allocate) && (lhs->allocator.release == rhs->allocator.release) &&
+        (lhs->allocator.context == rhs->allocator.context);
+}
+
+// Levels of the subtree under node, 1 for a leaf.
+static size_t subtree_height(const BTreeNode* node) {
+    size_t height = 1;
+    for (; !node->is_leaf; node = node_child(node, 0)) {
+        height++;
+    }
+    return height;
+}
+
+// Fixes up neighbouring children index and index + 1 of parent, either of
+// which may be far below the minimum fill where trees were cut or glued:
+// merges them when everything fits into one node, otherwise moves keys
+// over one at a time until both hold at least the minimum.
+static void even_out(const BTree* tree, BTreeNode* parent, size_t index) {
+    BTreeNode* left = node_child(parent, index);
+    BTreeNode* right = node_child(parent, index + 1);
+    if (left->count + right->count + (left->is_leaf ? 0 : 1) <= tree->order) {
+        merge_nodes(tree, left, right, parent, index);
+        return;
+    }
+    while (left->count < min_keys(tree)) {
+        borrow_from_right(tree, left, right, parent, index);
+    }
+    while (right->count < min_keys(tree)) {
+        borrow_from_left(tree, right, left, parent, index + 1);
+    }
+}
+
+// Makes tree the subtree left (of left_height levels) followed by right,
+// either of which may be NULL, and returns its height. Every key of left
+// must sort before separator and no key of right before it; the leaves of
+// both must already be chained. The shorter subtree hangs off the spine
+// of the taller one at its own height, so this costs O(1 + difference of
+// the heights) plus the splits it causes, for which enough spare nodes
+// must be reserved.
+static size_t join_subtrees(BTree* tree, BTreeNode* left, size_t left_height, const void* separator, BTreeNode* right, size_t right_height) {
+    if ((left == NULL) || (right == NULL)) {
+        tree->root = (left != NULL) ? left : right;
+        return (left != NULL) ? left_height : right_height;
+    }
+    if (left_height == right_height) {
+        BTreeNode* parent = take_node(tree, false);
+        store_key(tree, parent, 0, separator);
+        set_child(parent, 0, left);
+        set_child(parent, 1, right);
+        parent->count = 1;
+        parent->total = left->total + right->total;
+        tree->root = parent;
+        even_out(tree, parent, 0);
+        if (parent->count > 0) {
+            return left_height + 1;
+        }
+        tree->root = node_child(parent, 0);
+        tree->root->parent_node = NULL;
+        release_node(tree, parent);
+        return left_height;
+    }
+    BTreeNode* node = NULL;
+    size_t index = 0;
+    size_t height = 0;
+    size_t added = 0;
+    if (left_height > right_height) {
+        node = left;
+        for (size_t level = left_height; level > right_height + 1; level--) {
+            node = node_child(node, node->count);
+        }
+        store_key(tree, node, node->count, separator);
+        set_child(node, node->count + 1, right);
+        index = node->count;
+        tree->root = left;
+        height = left_height;
+        added = right->total;
+    }
+    else {
+        node = right;
+        for (size_t level = right_height; level > left_height + 1; level--) {
+            node = node_child(node, 0);
+        }
+        shift_keys(tree, node, 0, 1, node->count);
+        shift_links(node, 0, 1, node->count + 1);
+        store_key(tree, node, 0, separator);
+        set_child(node, 0, left);
+        tree->root = right;
+        height = right_height;
+        added = left->total;
+    }
+    node->count++;
+    for (BTreeNode* above = node; above != NULL; above = above->parent_node) {
+        above->total += added;
+    }
+    even_out(tree, node, index);
+    if (node->count > tree->order) {
+        const BTreeNode* root = tree->root;
+        split_node(tree, node);
+        if (tree->root != root) {
+            height++;
+        }
+    }
+    return height;
+}
+
+// Hands the subtree under part over as a tree of its own, dropping roots
+// that a cut left with a single child.
+static BTreeNode* part_root(const BTree* tree, BTreeNode* part, size_t* height) {
+    while (!part->is_leaf && (part->count == 0)) {
+        BTreeNode* child = node_child(part, 0);
+        release_node(tree, part);
+        part = child;
+        (*height)--;
+    }
+    part->parent_node = NULL;
+    return part;
+}
+
+// Number of nodes needed to hold count items with at most per_node each.
+static size_t nodes_for(size_t count, size_t per_node) {
+    return (count + per_node - 1) / per_node;
+}
+
+// Spreads count items over nodes as evenly as possible: with more than one
+// node every share is at least half a node, so the minimum fill holds.
+static size_t share_of(size_t count, size_t nodes, size_t index) {
+    return count / nodes + ((index < count % nodes) ? 1 : 0);
+}
+
+// Post-order teardown without recursion or a stack: after a node is gone
+// the walk continues with the leftmost leaf of its next sibling, or with
+// its parent once the last child has been released.
+static void delete_all_nodes(const BTree* tree, BTreeNode* node, void(*destroy)(void*)) {
+    node = leftmost_leaf(node);
+    while (node != NULL) {
+        BTreeNode* parent = node->parent_node;
+        const size_t index = (parent != NULL) ? child_position(parent, node) : 0;
+        if (node->is_leaf) {
+            for (size_t i = 0; i < node->count; i++) {
+                release_entry(tree, node_entry(node, i), destroy);
+            }
+        }
+        release_node(tree, node);
+        if ((parent != NULL) && (index < parent->count)) {
+            node = leftmost_leaf(node_child(parent, index + 1));
+        }
+        else {
+            node = parent;
+        }
+    }
+}
+
+typedef struct {
+    BTreeNode* leaf;
+    size_t slot;
+    size_t count;
+    void(*destroy)(void*);
+} BTreeDestroyRange;
+
+static void destroy_range(void* argument) {
+    const BTreeDestroyRange* range = argument;
+    BTreeNode* leaf = range->leaf;
+    size_t slot = range->slot;
+    for (size_t i = 0; i < range->count; i++) {
+        if (slot == leaf->count) {
+            leaf = leaf->next_node;
+            slot = 0;
+        }
+        range->destroy(&node_entry(leaf, slot++)->item);
+    }
+}
+
+// Splits the leaf chain into equal runs of entries and runs destroy over
+// them on separate threads. Returns false when that was not possible and
+// nothing has been destroyed yet.
+static bool destroy_in_parallel(const BTree* tree, void(*destroy)(void*)) {
+    size_t threads = (tree->destroy_threads < BTREE_DESTROY_MAX_THREADS) ? tree->destroy_threads : BTREE_DESTROY_MAX_THREADS;
+    if (threads > tree->size / BTREE_DESTROY_MIN_SHARE) {
+        threads = tree->size / BTREE_DESTROY_MIN_SHARE;
+    }
+    if (threads < 2) {
+        return false;
+    }
+    BTreeDestroyRange ranges[BTREE_DESTROY_MAX_THREADS];
+
+    BTreeNode* leaf = leftmost_leaf(tree->root);
+    size_t slot = 0;
+    for (size_t i = 0; i < threads; i++) {
+        ranges[i].leaf = leaf;
+        ranges[i].slot = slot;
+        ranges[i].count = share_of(tree->size, threads, i);
+        ranges[i].destroy = destroy;
+        size_t skip = ranges[i].count;
+        while ((leaf != NULL) && (skip >= leaf->count - slot)) {
+            skip -= leaf->count - slot;
+            leaf = leaf->next_node;
+            slot = 0;
+        }
+        slot += skip;
+    }
+    btree_pool_run(destroy_range, ranges, sizeof(BTreeDestroyRange), threads);
+    return true;
+}
+
+// Hands every entry to destroy without releasing anything.
+static void destroy_all_entries(const BTree* tree, void(*destroy)(void*)) {
+    if (destroy_in_parallel(tree, destroy)) {
+        return;
+    }
+    for (BTreeNode* leaf = leftmost_leaf(tree->root); leaf != NULL; leaf = leaf->next_node) {
+        for (size_t i = 0; i < leaf->count; i++) {
+            destroy(&node_entry(leaf, i)->item);
+        }
+    }
+}
+
+static bool ensure_root(BTree* tree) {
+    if (tree->root == NULL) {
+        tree->root = build_node(tree, true);
+    }
+    return tree->root != NULL;
+}
+
+// Finds key in leaf or inserts it there; leaf must be the leaf the key
+// routes to and key must not sort before slot from. Returns NULL only when
+// allocation fails.
+static BTreeEntry* insert_into_leaf(BTree* tree, BTreeNode* leaf, size_t from, const void* key, bool* createFlag) {
+    bool node_found = false;
+    const size_t slot = (from == 0) ? lower_bound(tree, leaf, key, &node_found) : gallop_bound(tree, leaf, from, key, &node_found);
+
+    if (node_found) {
+        *createFlag = false;
+        return own_entry(tree, node_entry(leaf, slot));
+    }
+
+    BTreeEntry* entry = reserve_nodes(tree, leaf) ? build_entry(tree, key) : NULL;
+    if (entry == NULL) {
+        if (tree->size == 0) {
+            release_node(tree, tree->root);
+            tree->root = NULL;
+        }
+        return NULL;
+    }
+
+    shift_keys(tree, leaf, slot, slot + 1, leaf->count - slot);
+    shift_links(leaf, slot, slot + 1, leaf->count - slot);
+    store_key(tree, leaf, slot, key);
+    set_entry(leaf, slot, entry);
+    leaf->count++;
+    update_totals(leaf, true);
+    tree->size++;
+
+    if (leaf->count > tree->order) {
+        split_node(tree, leaf);
+    }
+    *createFlag = true;
+    return entry;
+}
+
+// Separator above which keys no longer route to leaf, NULL for the last leaf.
+static const void* upper_fence(const BTree* tree, const BTreeNode* leaf) {
+    const BTreeNode* node = leaf;
+    while (node->parent_node != NULL) {
+        const size_t index = child_position(node->parent_node, node);
+        if (index < node->parent_node->count) {
+            return node_key(tree, node->parent_node, index);
+        }
+        node = node->parent_node;
+    }
+    return NULL;
 }
 
-static size_t manager_neighbors(const BTree* tree, size_t item_id, bool(*functor)(size_t*), bool (*rule)(const void*, const void*, int(*)(const void*, const void*))) {
-    if ((tree == NULL) || (item_id == 0)) {
-        return btree_stop(tree);
+// Stable bottom-up merge sort of key indices, so that the first of several
+// equal keys in a batch is the one that creates the entry.
+static void sort_indices(const BTree* tree, const unsigned char* keys, size_t* order, size_t* buffer, size_t count) {
+    for (size_t width = 1; width < count; width *= 2) {
+        for (size_t low = 0; low < count; low += 2 * width) {
+            const size_t middle = (low + width < count) ? low + width : count;
+            const size_t high = (low + 2 * width < count) ? low + 2 * width : count;
+            size_t left = low;
+            size_t right = middle;
+            for (size_t out = low; out < high; out++) {
+                if ((left < middle) && ((right >= high) ||
+                    (compare_keys(tree, keys + order[left] * tree->key_size, keys + order[right] * tree->key_size) <= 0))) {
+                    buffer[out] = order[left++];
+                }
+                else {
+                    buffer[out] = order[right++];
+                }
+            }
+        }
+        memcpy(order, buffer, count * sizeof(size_t));
     }
+}
 
-    if (functor(&item_id)) {
-        return item_id;
+// Fills freshly taken leaves from the sorted arrays and chains them. On a
+// failed entry allocation everything built so far is handed back.
+static bool build_leaves(BTree* tree, BTreeNode** level, size_t leaves, const void* keys, const void* values, size_t count) {
+    const unsigned char* key = keys;
+    const unsigned char* value = values;
+    for (size_t i = 0; i < leaves; i++) {
+        BTreeNode* leaf = take_node(tree, true);
+        level[i] = leaf;
+        if (i > 0) {
+            leaf->prev_node = level[i - 1];
+            level[i - 1]->next_node = leaf;
+        }
+        const size_t share = share_of(count, leaves, i);
+        for (size_t slot = 0; slot < share; slot++) {
+            BTreeEntry* entry = build_entry(tree, key);
+            if (entry == NULL) {
+                for (size_t j = 0; j <= i; j++) {
+                    for (size_t k = 0; k < level[j]->count; k++) {
+                        delete_entry(tree, node_entry(level[j], k), NULL);
+                    }
+                    release_node(tree, level[j]);
+                }
+                return false;
+            }
+            if (value != NULL) {
+                memcpy(entry->item.value, value, tree->value_size);
+                value += tree->value_size;
+            }
+            else {
+                memset(entry->item.value, 0, tree->value_size);
+            }
+            store_key(tree, leaf, slot, key);
+            set_entry(leaf, slot, entry);
+            leaf->count++;
+            leaf->total++;
+            key += tree->key_size;
+        }
     }
+    return true;
+}
 
-    const BTreeNode* node = (const BTreeNode*)item_id;
-
-    if (node->parent_node != NULL) {
-        BTreeNode* parent_node = node->parent_node;
-        while (parent_node)
-        {
-            if (rule(node->item->key, parent_node->item->key, tree->comp)) {
-                return (size_t)parent_node;
+// Groups the nodes of one level under new parents, in place: parent i is
+// written to level[i] only after its children (all at index >= i) are read.
+static size_t build_parents(BTree* tree, BTreeNode** level, size_t nodes) {
+    const size_t parents = nodes_for(nodes, tree->order + 1);
+    size_t child = 0;
+    for (size_t i = 0; i < parents; i++) {
+        BTreeNode* parent = take_node(tree, false);
+        const size_t share = share_of(nodes, parents, i);
+        for (size_t j = 0; j < share; j++) {
+            if (j > 0) {
+                copy_keys(tree, parent, j - 1, leftmost_leaf(level[child]), 0, 1);
             }
-            parent_node = parent_node->parent_node;
+            set_child(parent, j, level[child]);
+            child++;
         }
+        parent->count = share - 1;
+        recount_node(parent);
+        level[i] = parent;
     }
-    return btree_stop(tree);
+    return parents;
 }
 
 
 void* btree_create(size_t keySize, size_t valueSize, int(*compare)(const void*, const void*)){
+    return btree_create_ex(keySize, valueSize, compare, NULL);
+}
+
+void* btree_create_ex(size_t keySize, size_t valueSize, int(*compare)(const void*, const void*), const BTreeAllocator* allocator) {
     if ((keySize == 0) || (valueSize == 0) || (compare == NULL)) {
         return NULL;
     }
+    if ((allocator != NULL) && ((allocator->allocate == NULL) || (allocator->release == NULL))) {
+        return NULL;
+    }
 
     BTree* tree = malloc(sizeof(BTree));
     if (tree == NULL) {
@@ -240,21 +1565,119 @@ void* btree_create(size_t keySize, size_t valueSize, int(*compare)(const void*,
     tree->key_size = keySize;
     tree->value_size = valueSize;
     tree->comp = compare;
+    tree->key_kind = BTREE_KEY_CUSTOM;
+    tree->normalize = NULL;
     tree->root = NULL;
+    tree->spare_nodes = NULL;
+    tree->spare_count = 0;
+    tree->free_handle = INVALID;
+    tree->fresh_handle = 0;
+    tree->fresh_end = 0;
+    tree->destroy_threads = 1;
+    tree->origin = NULL;
+    tree->snapshots = 0;
+    if (allocator != NULL) {
+        tree->allocator = *allocator;
+    }
+    else {
+        tree->allocator.allocate = heap_allocate;
+        tree->allocator.release = heap_release;
+        tree->allocator.release_all = NULL;
+        tree->allocator.context = NULL;
+    }
+    setup_layout(tree);
+
+    return tree;
+}
+
+// comp is left NULL for byte keys: a comparator can not see key_size, so
+// every comparison of such a tree goes through memcmp in compare_keys.
+static void* create_keyed(size_t keySize, size_t valueSize, int(*compare)(const void*, const void*), BTreeKeyKind kind) {
+    BTree* tree = btree_create_ex(keySize, valueSize, (compare != NULL) ? compare : compare_u64, NULL);
+    if (tree != NULL) {
+        tree->comp = compare;
+        tree->key_kind = kind;
+    }
+    return tree;
+}
+
+void* btree_create_u64(size_t valueSize) {
+    return create_keyed(sizeof(uint64_t), valueSize, compare_u64, BTREE_KEY_U64);
+}
+
+void* btree_create_i32(size_t valueSize) {
+    return create_keyed(sizeof(int32_t), valueSize, compare_i32, BTREE_KEY_I32);
+}
+
+void* btree_create_bytes(size_t keySize, size_t valueSize) {
+    return create_keyed(keySize, valueSize, NULL, BTREE_KEY_BYTES);
+}
+
+void* btree_create_normalized(size_t keySize, size_t valueSize, int(*compare)(const void*, const void*), uint64_t(*normalize)(const void*)) {
+    if (normalize == NULL) {
+        return NULL;
+    }
+    BTree* tree = btree_create_ex(keySize, valueSize, compare, NULL);
+    if (tree != NULL) {
+        tree->normalize = normalize;
+        tree->key_kind = BTREE_KEY_NORMALIZED;
+        setup_layout(tree);
+    }
+    return tree;
+}
 
+static BTree* create_from(const BTree* model, const BTreeAllocator* allocator) {
+    BTree* tree = btree_create_ex(model->key_size, model->value_size, (model->comp != NULL) ? model->comp : compare_u64, allocator);
+    if (tree != NULL) {
+        tree->comp = model->comp;
+        tree->key_kind = model->key_kind;
+        tree->normalize = model->normalize;
+        setup_layout(tree);
+    }
     return tree;
 }
 
+// Empty tree ordering keys exactly as btree does, built-in comparisons and
+// prefixes included, on the default allocator.
+void* btree_create_like(const void* btree) {
+    if (btree == NULL) {
+        return NULL;
+    }
+    return create_from(btree, NULL);
+}
+
+int btree_compare(const void* btree, const void* lhs, const void* rhs) {
+    return compare_keys(btree, lhs, rhs);
+}
+
+// strcmp compares unsigned bytes up to the first NUL, which is exactly the
+// order of the first 8 bytes read big-endian with zeros after the NUL.
+uint64_t btree_prefix_string(const void* key) {
+    const unsigned char* text = key;
+    uint64_t prefix = 0;
+    bool ended = false;
+    for (size_t i = 0; i < sizeof(prefix); i++) {
+        ended = ended || (text[i] == 0);
+        prefix = (prefix << 8) | (ended ? 0 : text[i]);
+    }
+    return prefix;
+}
+
 void btree_destroy(void* btree, void(*destroy)(void*)) {
     if (btree == NULL) {
         return;
     }
+    if (((BTree*)btree)->origin != NULL) {
+        btree_snapshot_release(btree, destroy);
+        return;
+    }
     btree_clear(btree, destroy);
+    give_back_handles(btree);
     free(btree);
 }
 
 void* btree_init(void* btree, size_t keySize, size_t valueSize, int(*compare)(const void*, const void*), void(*destroy)(void*)) {
-    if ((keySize == 0) || (valueSize == 0) || (compare == NULL) || (btree == NULL)) {
+    if ((keySize == 0) || (valueSize == 0) || (compare == NULL) || (btree == NULL) || (((BTree*)btree)->origin != NULL)) {
         return NULL;
     }
     BTree* tree = btree;
@@ -262,19 +1685,245 @@ void* btree_init(void* btree, size_t keySize, size_t valueSize, int(*compare)(co
     tree->key_size = keySize;
     tree->value_size = valueSize;
     tree->comp = compare;
+    tree->key_kind = BTREE_KEY_CUSTOM;
+    tree->normalize = NULL;
+    setup_layout(tree);
     return tree;
 }
 
+// Invalidates the handle of every item the tree holds.
+static void release_all_handles(BTree* tree) {
+    for (BTreeNode* leaf = leftmost_leaf(tree->root); leaf != NULL; leaf = leaf->next_node) {
+        for (size_t i = 0; i < leaf->count; i++) {
+            release_handle(tree, node_entry(leaf, i));
+        }
+    }
+}
+
 void btree_clear(void* btree, void(*destroy)(void*)) {
     if (btree == NULL) {
         return;
     }
     BTree* tree = btree;
+    if (tree->origin != NULL) {
+        return;
+    }
+    release_all_handles(tree);
+    // Callbacks run first, on their own, whenever the blocks are either
+    // released in bulk or the callbacks may fan out over threads.
+    if ((tree->root != NULL) && (destroy != NULL) && !has_snapshots(tree) &&
+        ((tree->allocator.release_all != NULL) || (tree->destroy_threads > 1))) {
+        destroy_all_entries(tree, destroy);
+        destroy = NULL;
+    }
+    if (has_snapshots(tree)) {
+        // Whatever a snapshot shares stays, so nothing goes in bulk.
+        drop_subtree(tree, tree->root, destroy);
+        delete_spare_nodes(tree);
+    }
+    else if (tree->allocator.release_all != NULL) {
+        tree->allocator.release_all(tree->allocator.context);
+        tree->spare_nodes = NULL;
+        tree->spare_count = 0;
+    }
+    else {
+        delete_all_nodes(tree, tree->root, destroy);
+        delete_spare_nodes(tree);
+    }
+    tree->root = NULL;
+    tree->size = 0;
+}
+
+void btree_set_destroy_threads(void* btree, size_t threads) {
+    if (btree == NULL) {
+        return;
+    }
+    BTree* tree = btree;
+    tree->destroy_threads = (threads == 0) ? btree_thread_hardware() : threads;
+}
+
+
+void* btree_snapshot(void* btree) {
+    BTree* tree = btree;
+    if ((tree == NULL) || (tree->origin != NULL)) {
+        return NULL;
+    }
+    BTree* snapshot = malloc(sizeof(BTree));
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    *snapshot = *tree;
+    snapshot->spare_nodes = NULL;
+    snapshot->spare_count = 0;
+    snapshot->free_handle = INVALID;
+    snapshot->fresh_handle = 0;
+    snapshot->fresh_end = 0;
+    snapshot->origin = tree;
+    snapshot->snapshots = 0;
     if (tree->root != NULL) {
-        delete_all_nodes(tree->root, destroy);
+        btree_atomic_add(&tree->root->sharers, 1);
+    }
+    btree_atomic_add(&tree->snapshots, 1);
+    return snapshot;
+}
+
+void btree_snapshot_release(void* snapshot, void(*destroy)(void*)) {
+    BTree* tree = snapshot;
+    if ((tree == NULL) || (tree->origin == NULL)) {
+        return;
+    }
+    drop_subtree(tree, tree->root, destroy);
+    btree_atomic_add(&tree->origin->snapshots, (size_t)-1);
+    free(tree);
+}
+
+bool btree_split(void* btree, const void* key, void** left, void** right) {
+    BTree* tree = btree;
+    if ((tree == NULL) || (key == NULL) || (left == NULL) || (right == NULL) || !can_move_nodes(tree)) {
+        return false;
+    }
+    const size_t height = (tree->root != NULL) ? subtree_height(tree->root) : 0;
+    BTree* lower = create_from(tree, &tree->allocator);
+    BTree* upper = create_from(tree, &tree->allocator);
+    unsigned char* separators = malloc(2 * height * tree->key_size + 1);
+    // Every join of the parts may split its way up to the root.
+    const size_t spares = height * (height + 2);
+    if ((lower == NULL) || (upper == NULL) || (separators == NULL) ||
+        !reserve_spares(lower, spares) || !reserve_spares(upper, spares + height)) {
+        btree_destroy(lower, NULL);
+        btree_destroy(upper, NULL);
+        free(separators);
+        return false;
+    }
+
+    // Cuts every node on the path of key into the children (or slots)
+    // before the path and those after it. The parts at each level are
+    // subtrees of their own; the separator that parted a part from the
+    // path is kept for gluing it back on.
+    BTreeNode* lower_parts[BTREE_MAX_HEIGHT];
+    BTreeNode* upper_parts[BTREE_MAX_HEIGHT];
+    size_t lower_heights[BTREE_MAX_HEIGHT];
+    size_t upper_heights[BTREE_MAX_HEIGHT];
+    unsigned char* lower_separators = separators;
+    unsigned char* upper_separators = separators + height * tree->key_size;
+    BTreeNode* node = tree->root;
+    for (size_t level = 0; level < height; level++) {
+        BTreeNode* next = NULL;
+        size_t index = 0;
+        BTreeNode* part = NULL;
+        if (node->is_leaf) {
+            bool found = false;
+            index = lower_bound(tree, node, key, &found);
+            if (index < node->count) {
+                part = take_node(upper, true);
+                part->count = node->count - index;
+                copy_keys(tree, part, 0, node, index, part->count);
+                for (size_t i = 0; i < part->count; i++) {
+                    set_entry(part, i, node_entry(node, index + i));
+                }
+                part->prev_node = NULL;
+                part->next_node = node->next_node;
+            }
+            if (node->next_node != NULL) {
+                node->next_node->prev_node = part;
+            }
+            if ((index == 0) && (node->prev_node != NULL)) {
+                node->prev_node->next_node = NULL;
+            }
+            node->next_node = NULL;
+        }
+        else {
+            index = child_index(tree, node, key);
+            next = node_child(node, index);
+            if (index > 0) {
+                memcpy(lower_separators + level * tree->key_size, node_key(tree, node, index - 1), tree->key_size);
+            }
+            if (index < node->count) {
+                memcpy(upper_separators + level * tree->key_size, node_key(tree, node, index), tree->key_size);
+                part = take_node(upper, false);
+                part->count = node->count - index - 1;
+                copy_keys(tree, part, 0, node, index + 1, part->count);
+                for (size_t i = 0; i <= part->count; i++) {
+                    set_child(part, i, node_child(node, index + 1 + i));
+                }
+            }
+        }
+        upper_heights[level] = height - level;
+        upper_parts[level] = NULL;
+        if (part != NULL) {
+            recount_node(part);
+            upper_parts[level] = part_root(tree, part, &upper_heights[level]);
+        }
+        lower_heights[level] = height - level;
+        lower_parts[level] = NULL;
+        if (index == 0) {
+            release_node(tree, node);
+        }
+        else {
+            node->count = node->is_leaf ? index : index - 1;
+            recount_node(node);
+            lower_parts[level] = part_root(tree, node, &lower_heights[level]);
+        }
+        node = next;
+    }
+
+    // Parts below the left side of the path are glued on top down, those
+    // right of it bottom up, so each join meets the part next to it.
+    size_t lower_height = 0;
+    const unsigned char* separator = NULL;
+    for (size_t level = 0; level < height; level++) {
+        if (lower_parts[level] != NULL) {
+            lower_height = join_subtrees(lower, lower->root, lower_height, separator, lower_parts[level], lower_heights[level]);
+            separator = lower_separators + level * tree->key_size;
+        }
     }
+    size_t upper_height = 0;
+    for (size_t level = height; level-- > 0;) {
+        if (upper_parts[level] != NULL) {
+            upper_height = join_subtrees(upper, upper->root, upper_height, upper_separators + level * tree->key_size, upper_parts[level], upper_heights[level]);
+        }
+    }
+    free(separators);
+    delete_spare_nodes(lower);
+    delete_spare_nodes(upper);
+    lower->size = (lower->root != NULL) ? lower->root->total : 0;
+    upper->size = (upper->root != NULL) ? upper->root->total : 0;
     tree->root = NULL;
     tree->size = 0;
+    *left = lower;
+    *right = upper;
+    return true;
+}
+
+bool btree_join(void* left, void* right) {
+    BTree* lower = left;
+    BTree* upper = right;
+    if ((lower == NULL) || (upper == NULL) || (lower == upper) ||
+        !can_move_nodes(lower) || !can_move_nodes(upper) || !same_layout(lower, upper)) {
+        return false;
+    }
+    if (upper->root == NULL) {
+        return true;
+    }
+    BTreeNode* last = rightmost_leaf(lower->root);
+    BTreeNode* first = leftmost_leaf(upper->root);
+    if ((last != NULL) && (compare_keys(lower, node_key(lower, last, last->count - 1), node_key(upper, first, 0)) >= 0)) {
+        return false;
+    }
+    const size_t lower_height = (lower->root != NULL) ? subtree_height(lower->root) : 0;
+    const size_t upper_height = subtree_height(upper->root);
+    if (!reserve_spares(lower, ((lower_height > upper_height) ? lower_height : upper_height) + 1)) {
+        return false;
+    }
+    if (last != NULL) {
+        last->next_node = first;
+        first->prev_node = last;
+    }
+    join_subtrees(lower, lower->root, lower_height, node_key(upper, first, 0), upper->root, upper_height);
+    lower->size += upper->size;
+    upper->root = NULL;
+    upper->size = 0;
+    return true;
 }
 
 
@@ -286,66 +1935,165 @@ size_t btree_count(const void* btree){
     return tree->size;
 }
 
+size_t btree_key_size(const void* btree) {
+    return (btree == NULL) ? 0 : ((const BTree*)btree)->key_size;
+}
+
+size_t btree_value_size(const void* btree) {
+    return (btree == NULL) ? 0 : ((const BTree*)btree)->value_size;
+}
+
+size_t btree_height(const void* btree) {
+    if (btree == NULL) {
+        return INVALID;
+    }
+    const BTree* tree = btree;
+    size_t height = 0;
+    for (const BTreeNode* node = tree->root; node != NULL; node = node->is_leaf ? NULL : node_child(node, 0)) {
+        height++;
+    }
+    return height;
+}
+
 void* btree_item(const void* btree, const void* key) {
     const BTree* tree = btree;
     if ((tree == NULL) || (key == NULL)) {
         return NULL;
     }
-    bool node_found = false;
-    const BTreeNode* node = traversal_tree(tree->root, key, tree->comp, &node_found);
-    if (!node_found) {
+    const BTreeEntry* entry = find_entry(tree, key);
+    if (entry == NULL) {
         return NULL;
     }
-    return node->item->value;
+    return entry->item.value;
 }
 
-void* btree_insert(void* btree, const void* key, bool* createFlag){
-    BTree* tree = btree;
-    if ((tree == NULL) || (key == NULL) || (createFlag == NULL)) {
-        return NULL;
+size_t btree_item_many(const void* btree, const void* keys, size_t count, void** values) {
+    const BTree* tree = btree;
+    if ((tree == NULL) || (keys == NULL) || (values == NULL)) {
+        return 0;
     }
-
     if (tree->root == NULL) {
-        tree->root = build_node(tree, key);
-        if (tree->root == NULL) {
-            return NULL;
+        for (size_t i = 0; i < count; i++) {
+            values[i] = NULL;
         }
-        *createFlag = true;
-        tree->size++;
-        return tree->root->item->value;
+        return 0;
     }
 
-    bool node_found = false;
-    BTreeNode* node = traversal_tree(tree->root, key, tree->comp, &node_found);
+    // All leaves sit at the same depth, so a group of searches can descend
+    // in lock-step: each level issues the prefetches for every search before
+    // the next level needs them, overlapping their cache misses.
+    const unsigned char* key_data = keys;
+    const BTreeNode* cursors[BTREE_LOOKUP_GROUP];
+    size_t found_count = 0;
+    for (size_t first = 0; first < count; first += BTREE_LOOKUP_GROUP) {
+        const size_t group = (count - first < BTREE_LOOKUP_GROUP) ? count - first : BTREE_LOOKUP_GROUP;
+        for (size_t i = 0; i < group; i++) {
+            cursors[i] = tree->root;
+        }
+        while (!cursors[0]->is_leaf) {
+            for (size_t i = 0; i < group; i++) {
+                const void* key = key_data + (first + i) * tree->key_size;
+                cursors[i] = node_child(cursors[i], child_index(tree, cursors[i], key));
+                prefetch_node(tree, cursors[i]);
+            }
+        }
+        for (size_t i = 0; i < group; i++) {
+            const void* key = key_data + (first + i) * tree->key_size;
+            bool found = false;
+            const size_t slot = lower_bound(tree, cursors[i], key, &found);
+            if (found) {
+                // The value sits at a fixed offset in the entry: no need to
+                // wait for the entry line, just start loading it.
+                unsigned char* value = (unsigned char*)node_entry(cursors[i], slot) + tree->entry_value_offset;
+                BTREE_PREFETCH(value);
+                values[first + i] = value;
+                found_count++;
+            }
+            else {
+                values[first + i] = NULL;
+            }
+        }
+    }
+    return found_count;
+}
 
-    if (node == NULL) {
+void* btree_insert(void* btree, const void* key, bool* createFlag){
+    BTree* tree = btree;
+    if ((tree == NULL) || (key == NULL) || (createFlag == NULL) || (tree->origin != NULL)) {
         return NULL;
     }
-
-    if (node_found) {
-        *createFlag = false;
-        return node->item->value;
+    if (!ensure_root(tree) || (has_snapshots(tree) && !own_path(tree, key, false))) {
+        return NULL;
     }
+    const BTreeEntry* entry = insert_into_leaf(tree, traversal_tree(tree, key), 0, key, createFlag);
+    return (entry == NULL) ? NULL : entry->item.value;
+}
 
-    BTreeNode* leaf = NULL;
-    const int route = tree->comp(node->item->key, key);
-
-    if (route > 0) {
-        node->left_node = build_node(tree, key);
-        leaf = node->left_node;
+size_t btree_insert_many(void* btree, const void* keys, size_t count, void** values, bool* createFlags) {
+    BTree* tree = btree;
+    if ((tree == NULL) || (keys == NULL) || (tree->origin != NULL)) {
+        return 0;
     }
-    else if (route < 0) {
-        node->right_node = build_node(tree, key);
-        leaf = node->right_node;
+    const bool shared = has_snapshots(tree);
+    const unsigned char* key_data = keys;
+    bool sorted = true;
+    for (size_t i = 1; (i < count) && sorted; i++) {
+        sorted = compare_keys(tree, key_data + (i - 1) * tree->key_size, key_data + i * tree->key_size) <= 0;
     }
-    if (leaf == NULL) {
-        return NULL;
+
+    size_t* order = NULL;
+    if (!sorted) {
+        order = malloc(2 * count * sizeof(size_t));
+        if (order != NULL) {
+            for (size_t i = 0; i < count; i++) {
+                order[i] = i;
+            }
+            sort_indices(tree, key_data, order, order + count, count);
+        }
     }
-    tree->size++;
-    leaf->parent_node = node;
-    *createFlag = true;
-    return leaf->item->value;
 
+    // The previous insertion point is reused as long as the next key still
+    // routes to the same leaf: ascending keys only need the upper fence.
+    size_t done = 0;
+    BTreeNode* leaf = NULL;
+    size_t from = 0;
+    const void* fence = NULL;
+    for (size_t i = 0; i < count; i++) {
+        const size_t index = (order != NULL) ? order[i] : i;
+        const void* key = key_data + index * tree->key_size;
+        bool created = false;
+        BTreeEntry* entry = NULL;
+        const BTreeNode* next_leaf = NULL;
+        if (ensure_root(tree) && (!shared || own_path(tree, key, false))) {
+            if ((leaf == NULL) || shared || ((order == NULL) && !sorted) || ((fence != NULL) && (compare_keys(tree, fence, key) <= 0))) {
+                leaf = traversal_tree(tree, key);
+                fence = upper_fence(tree, leaf);
+                from = 0;
+            }
+            next_leaf = leaf->next_node;
+            entry = insert_into_leaf(tree, leaf, (order != NULL) || sorted ? from : 0, key, &created);
+        }
+        if (entry != NULL) {
+            done++;
+            from = entry->slot;
+            // A split moves the fence (and may move the separators it lives in).
+            if ((entry->leaf != leaf) || (leaf->next_node != next_leaf)) {
+                leaf = entry->leaf;
+                fence = upper_fence(tree, leaf);
+            }
+        }
+        else {
+            leaf = NULL;
+        }
+        if (values != NULL) {
+            values[index] = (entry != NULL) ? entry->item.value : NULL;
+        }
+        if (createFlags != NULL) {
+            createFlags[index] = created;
+        }
+    }
+    free(order);
+    return done;
 }
 
 void btree_remove(void* btree, const void* key, void(*destroy)(void*)) {
@@ -353,28 +2101,167 @@ void btree_remove(void* btree, const void* key, void(*destroy)(void*)) {
         return;
     }
     BTree* tree = btree;
-    if (tree->root == NULL) {
+    if ((tree->root == NULL) || (tree->origin != NULL)) {
+        return;
+    }
+    if (has_snapshots(tree) && !own_path(tree, key, true)) {
+        return;
+    }
+    BTreeEntry* entry = find_entry(tree, key);
+    if (entry == NULL) {
         return;
     }
-    bool flag = false;
-    BTreeNode* node = traversal_tree(tree->root, key, tree->comp, &flag);
-    if (flag && (node != NULL)) {
-        node_remove(node, tree->comp, destroy, tree);
-        tree->size -= 1;
-        if (tree->size == 0) tree->root = NULL;
+    erase_entry(tree, entry, destroy);
+}
+
+bool btree_build_sorted(void* btree, const void* keys, const void* values, size_t count, bool checkOrder) {
+    BTree* tree = btree;
+    if ((tree == NULL) || (keys == NULL) || (tree->size != 0) || (tree->origin != NULL)) {
+        return false;
+    }
+    if (count == 0) {
+        return true;
+    }
+    if (checkOrder) {
+        const unsigned char* key = keys;
+        for (size_t i = 1; i < count; i++) {
+            if (compare_keys(tree, key, key + tree->key_size) >= 0) {
+                return false;
+            }
+            key += tree->key_size;
+        }
+    }
+
+    size_t total = 0;
+    for (size_t nodes = nodes_for(count, tree->order); ; nodes = nodes_for(nodes, tree->order + 1)) {
+        total += nodes;
+        if (nodes == 1) {
+            break;
+        }
+    }
+    const size_t leaves = nodes_for(count, tree->order);
+    BTreeNode** level = malloc(leaves * sizeof(BTreeNode*));
+    if ((level == NULL) || !reserve_spares(tree, total)) {
+        free(level);
+        return false;
+    }
+    if (tree->root != NULL) {
+        drop_subtree(tree, tree->root, NULL);
+        tree->root = NULL;
+    }
+    if (!build_leaves(tree, level, leaves, keys, values, count)) {
+        free(level);
+        return false;
+    }
+
+    size_t nodes = leaves;
+    while (nodes > 1) {
+        nodes = build_parents(tree, level, nodes);
+    }
+    tree->root = level[0];
+    tree->size = count;
+    free(level);
+    return true;
+}
+
+
+// Entries that sort before key: whole subtrees left of the descent path
+// count by their totals, the leaf by its slot.
+static size_t rank_of(const BTree* tree, const void* key) {
+    const BTreeNode* node = tree->root;
+    if (node == NULL) {
+        return 0;
+    }
+    size_t rank = 0;
+    while (!node->is_leaf) {
+        const size_t index = child_index(tree, node, key);
+        for (size_t i = 0; i < index; i++) {
+            rank += node_child(node, i)->total;
+        }
+        node = node_child(node, index);
+    }
+    bool found = false;
+    return rank + lower_bound(tree, node, key, &found);
+}
+
+// Entry at index in key order, found by the subtree totals.
+static BTreeEntry* entry_at(const BTree* tree, size_t index) {
+    const BTreeNode* node = tree->root;
+    while (!node->is_leaf) {
+        size_t child = 0;
+        while (index >= node_child(node, child)->total) {
+            index -= node_child(node, child)->total;
+            child++;
+        }
+        node = node_child(node, child);
     }
+    return node_entry(node, index);
 }
 
+// Snapshots can not use handles or the leaf chain, both of which belong to
+// the live tree: their item ids are ranks plus one, and every step of an
+// iteration descends from the root, without calling the comparator.
+static size_t rank_id(const BTree* tree, size_t index) {
+    return (index < tree->size) ? index + 1 : btree_stop(tree);
+}
+
+// Descends to the first entry once and then moves on through the path
+// above the leaf, which costs O(1) per entry on average.
+static size_t range_by_rank(const BTree* tree, const void* low, const void* high, bool(*visit)(void* item, void* context), void* context) {
+    const size_t first = (low != NULL) ? rank_of(tree, low) : 0;
+    const size_t end = (high != NULL) ? rank_of(tree, high) : tree->size;
+    if (first >= end) {
+        return 0;
+    }
+    const BTreeNode* path[BTREE_MAX_HEIGHT];
+    size_t next_child[BTREE_MAX_HEIGHT];
+    size_t depth = 0;
+    const BTreeNode* node = tree->root;
+    size_t slot = first;
+    while (!node->is_leaf) {
+        size_t child = 0;
+        while (slot >= node_child(node, child)->total) {
+            slot -= node_child(node, child)->total;
+            child++;
+        }
+        path[depth] = node;
+        next_child[depth] = child + 1;
+        depth++;
+        node = node_child(node, child);
+    }
+    size_t visited = 0;
+    for (size_t index = first; index < end; index++) {
+        if (slot == node->count) {
+            while (next_child[depth - 1] > path[depth - 1]->count) {
+                depth--;
+            }
+            node = node_child(path[depth - 1], next_child[depth - 1]++);
+            while (!node->is_leaf) {
+                path[depth] = node;
+                next_child[depth] = 1;
+                depth++;
+                node = node_child(node, 0);
+            }
+            slot = 0;
+        }
+        visited++;
+        if (!visit(&node_entry(node, slot)->item, context)) {
+            break;
+        }
+        slot++;
+    }
+    return visited;
+}
 
 size_t btree_first(const void* btree) {
     if (btree == NULL) {
         return btree_stop(btree);
     }
     const BTree* tree = btree;
-    if (tree->root == NULL) {
-        return btree_stop(btree);
+    if ((tree->root == NULL) || (tree->origin != NULL)) {
+        return rank_id(tree, 0);
     }
-    return (size_t)leftmost_node(tree->root);
+    return entry_handle(node_entry(leftmost_leaf(tree->root), 0));
 }
 
 size_t btree_last(const void* btree) {
@@ -382,18 +2269,106 @@ size_t btree_last(const void* btree) {
         return btree_stop(btree);
     }
     const BTree* tree = btree;
-    if (tree->root == NULL) {
-        return btree_stop(btree);
+    if ((tree->root == NULL) || (tree->origin != NULL)) {
+        return rank_id(tree, tree->size - 1);
     }
-    return (size_t)rightmost_node(tree->root);
+    const BTreeNode* leaf = rightmost_leaf(tree->root);
+    return entry_handle(node_entry(leaf, leaf->count - 1));
 }
 
 size_t btree_next(const void* btree, size_t item_id) {
-    return manager_neighbors(btree, item_id, functor_next, key_less);
+    if ((btree != NULL) && (((const BTree*)btree)->origin != NULL)) {
+        return (item_id == btree_stop(btree)) ? btree_stop(btree) : rank_id(btree, item_id);
+    }
+    const BTreeEntry* entry = handle_entry(btree, item_id);
+    if (entry == NULL) {
+        return btree_stop(btree);
+    }
+    return entry_handle(next_entry(entry));
 }
 
 size_t btree_prev(const void* btree, size_t item_id) {
-    return manager_neighbors(btree, item_id, functor_prev, key_more);
+    if ((btree != NULL) && (((const BTree*)btree)->origin != NULL)) {
+        return ((item_id < 2) || (item_id > ((const BTree*)btree)->size)) ? btree_stop(btree) : item_id - 1;
+    }
+    const BTreeEntry* entry = handle_entry(btree, item_id);
+    if (entry == NULL) {
+        return btree_stop(btree);
+    }
+    return entry_handle(prev_entry(entry));
+}
+
+size_t btree_lower_bound(const void* btree, const void* key) {
+    if ((btree == NULL) || (key == NULL)) {
+        return btree_stop(btree);
+    }
+    if (((const BTree*)btree)->origin != NULL) {
+        return rank_id(btree, rank_of(btree, key));
+    }
+    return entry_handle(bound_entry(btree, key, false));
+}
+
+size_t btree_upper_bound(const void* btree, const void* key) {
+    if ((btree == NULL) || (key == NULL)) {
+        return btree_stop(btree);
+    }
+    if (((const BTree*)btree)->origin != NULL) {
+        return rank_id(btree, rank_of(btree, key) + ((find_entry(btree, key) != NULL) ? 1 : 0));
+    }
+    return entry_handle(bound_entry(btree, key, true));
+}
+
+size_t btree_range(const void* btree, const void* low, const void* high, bool(*visit)(void* item, void* context), void* context) {
+    const BTree* tree = btree;
+    if ((tree == NULL) || (visit == NULL) || (tree->root == NULL)) {
+        return 0;
+    }
+    if ((low != NULL) && (high != NULL) && (compare_keys(tree, low, high) >= 0)) {
+        return 0;
+    }
+    if (tree->origin != NULL) {
+        return range_by_rank(tree, low, high, visit, context);
+    }
+    // Both ends are located up front, so the scan itself only follows
+    // leaf links and never calls the comparator.
+    const BTreeEntry* end = (high != NULL) ? bound_entry(tree, high, false) : NULL;
+    BTreeEntry* entry = (low != NULL) ? bound_entry(tree, low, false) : node_entry(leftmost_leaf(tree->root), 0);
+    size_t visited = 0;
+    for (; entry != end; entry = next_entry(entry)) {
+        visited++;
+        if (!visit(&entry->item, context)) {
+            break;
+        }
+    }
+    return visited;
+}
+
+size_t btree_rank(const void* btree, const void* key) {
+    if ((btree == NULL) || (key == NULL)) {
+        return 0;
+    }
+    return rank_of(btree, key);
+}
+
+size_t btree_select(const void* btree, size_t index) {
+    const BTree* tree = btree;
+    if ((tree == NULL) || (index >= tree->size)) {
+        return btree_stop(btree);
+    }
+    if (tree->origin != NULL) {
+        return rank_id(tree, index);
+    }
+    return entry_handle(entry_at(tree, index));
+}
+
+size_t btree_count_range(const void* btree, const void* low, const void* high) {
+    const BTree* tree = btree;
+    if (tree == NULL) {
+        return 0;
+    }
+    const size_t below_low = (low != NULL) ? rank_of(tree, low) : 0;
+    const size_t below_high = (high != NULL) ? rank_of(tree, high) : tree->size;
+    return (below_high > below_low) ? below_high - below_low : 0;
 }
 
 size_t btree_stop(const void* btree) {
@@ -405,17 +2380,23 @@ void* btree_current(const void* btree, size_t item_id)
     if ((item_id == 0) || (btree == NULL)) {
         return NULL;
     }
-    const BTreeNode* node = (const BTreeNode*)item_id;
-    if (btree_item(btree, node->item->key) != NULL) {
-        return node->item;
+    const BTree* tree = btree;
+    if (tree->origin != NULL) {
+        return (item_id <= tree->size) ? &entry_at(tree, item_id - 1)->item : NULL;
+    }
+    BTreeEntry* entry = handle_entry(btree, item_id);
+    if (entry != NULL) {
+        return &entry->item;
     }
     return NULL;
 }
 
 void btree_erase(void* btree, size_t item_id, void(*destroy)(void*)) {
-    if ((btree == NULL) || (item_id == 0)) {
+    if ((btree == NULL) || (item_id == 0) || (((BTree*)btree)->origin != NULL)) {
         return;
     }
-    const BTreeNode* node = (const BTreeNode*)item_id;
-    btree_remove(btree, node->item->key, destroy);
-}
\ No newline at end of file
+    BTreeEntry* entry = handle_entry(btree, item_id);
+    if ((entry != NULL) && holds_entry(btree, entry) && (!has_snapshots(btree) || own_path(btree, entry->item.key, true))) {
+        erase_entry(btree, entry, destroy);
+    }
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <stdbool.h> // bool
 #include <stddef.h>  // size_t
+#include <stdint.h>  // uint64_t
 
 static const size_t INVALID = ~((size_t)0);
 
@@ -12,8 +13,45 @@ struct BTreeItem
 }
 BTreeItem;
 
+// Source of node and entry memory. release_all may be NULL; when it is set
+// it must free every block handed out so far, and btree_clear/btree_destroy
+// use it instead of releasing blocks one at a time.
+typedef
+struct BTreeAllocator
+{
+    void* (*allocate)(void* context, size_t size);
+    void (*release)(void* context, void* block, size_t size);
+    void (*release_all)(void* context);
+    void* context;
+}
+BTreeAllocator;
+
 
 void* btree_create(size_t keySize, size_t valueSize, int(*compare)(const void*, const void*));
+void* btree_create_ex(
+    size_t keySize,
+    size_t valueSize,
+    int(*compare)(const void*, const void*),
+    const BTreeAllocator* allocator);
+// Trees keyed by uint64_t, int32_t or raw bytes (ordered as by memcmp) with
+// built-in comparisons that are inlined into the search loops.
+void* btree_create_u64(size_t valueSize);
+void* btree_create_i32(size_t valueSize);
+void* btree_create_bytes(size_t keySize, size_t valueSize);
+// Tree whose nodes also keep normalize(key), an 8-byte prefix ordered like
+// the keys (compare(a, b) < 0 implies normalize(a) <= normalize(b)).
+// Searches compare prefixes and call compare only when they are equal.
+void* btree_create_normalized(
+    size_t keySize,
+    size_t valueSize,
+    int(*compare)(const void*, const void*),
+    uint64_t(*normalize)(const void*));
+// Prefix for NUL-terminated strings ordered by strcmp.
+uint64_t btree_prefix_string(const void* key);
+// Empty tree with the key and value sizes and the ordering of btree.
+void* btree_create_like(const void* btree);
+// Compares two keys as btree orders them.
+int btree_compare(const void* btree, const void* lhs, const void* rhs);
 void btree_destroy(void* btree, void(*destroy)(void*));
 
 void* btree_init(
@@ -23,16 +61,209 @@ void* btree_init(
     int(*compare)(const void*, const void*),
     void(*destroy)(void*));
 void btree_clear(void* btree, void(*destroy)(void*));
+// Lets btree_clear/btree_destroy run the destroy callbacks of a large tree
+// on up to threads threads (0 = one per core, 1 = off, the default). The
+// threads come from a pool the library keeps for the life of the process.
+// The callback must then be safe to call concurrently for different items.
+void btree_set_destroy_threads(void* btree, size_t threads);
 
 size_t btree_count(const void* btree);
+size_t btree_height(const void* btree);
+size_t btree_key_size(const void* btree);
+size_t btree_value_size(const void* btree);
 void* btree_item(const void* btree, const void* key);
+// Looks up count keys at once, overlapping their cache misses. values[i]
+// receives what btree_item would return for key i. Returns the hit count.
+size_t btree_item_many(const void* btree, const void* keys, size_t count, void** values);
 void* btree_insert(void* btree, const void* key, bool* createFlag);
+// Inserts count keys, reusing the previous insertion leaf while the keys
+// stay inside it; unsorted batches are sorted first. values/createFlags
+// (either may be NULL) are filled in input order. Returns how many keys got
+// a value, which is less than count only when allocation failed.
+size_t btree_insert_many(void* btree, const void* keys, size_t count, void** values, bool* createFlags);
 void btree_remove(void* btree, const void* key, void(*destroy)(void*));
 
+// Fills an empty tree from count strictly ascending keys (and values, which
+// may be NULL to zero them) in O(count). checkOrder verifies the order first.
+bool btree_build_sorted(void* btree, const void* keys, const void* values, size_t count, bool checkOrder);
+
 size_t btree_first(const void* btree);
 size_t btree_last(const void* btree);
 size_t btree_next(const void* btree, size_t item_id);
 size_t btree_prev(const void* btree, size_t item_id);
 size_t btree_stop(const void* btree);
+size_t btree_lower_bound(const void* btree, const void* key);
+size_t btree_upper_bound(const void* btree, const void* key);
+// Calls visit with the BTreeItem of every key in [low, high) in order until
+// it returns false; a NULL bound is open. Returns the number of visits.
+size_t btree_range(const void* btree, const void* low, const void* high, bool(*visit)(void* item, void* context), void* context);
+// Order statistics in O(log n): the number of keys less than key, the item
+// at index (0-based, btree_stop() past the end) and the number of keys in
+// [low, high), where a NULL bound is open.
+size_t btree_rank(const void* btree, const void* key);
+size_t btree_select(const void* btree, size_t index);
+size_t btree_count_range(const void* btree, const void* low, const void* high);
 void* btree_current(const void* btree, size_t item_id);
-void btree_erase(void* btree, size_t item_id, void(*destroy)(void*));
\ No newline at end of file
+void btree_erase(void* btree, size_t item_id, void(*destroy)(void*));
+
+// Copy-on-write snapshot in O(1): a read-only tree frozen at the moment of
+// the call, sharing every node with btree. Writes to btree then copy only
+// the nodes on their path while snapshots are alive. A snapshot serves
+// btree_item, the order statistics and ordered iteration (item ids are
+// ranks there, each step O(log n); btree_range costs O(1) per item) and
+// may be read by other threads while btree changes. Taking a snapshot must
+// not overlap writes to btree, and all snapshots must be released before
+// btree is destroyed. Values written in place through pointers btree hands
+// out are seen by the snapshots too.
+// A removed key that a snapshot still holds is destroyed when the last
+// snapshot holding it is released, with that release's destroy callback.
+// Writes may fail on allocation failure where they otherwise would not;
+// btree_remove and btree_erase then leave the key in place.
+void* btree_snapshot(void* btree);
+void btree_snapshot_release(void* snapshot, void(*destroy)(void*));
+
+// Moves the items of btree with keys below key into a new tree *left and
+// the rest into a new tree *right, leaving btree empty; join puts right
+// behind left, whose keys must all sort before those of right, and leaves
+// right empty. Both cut and glue O(log n) nodes along a path and move
+// every other node as it is, so keys and values keep their addresses.
+// The trees must be ordered alike (see btree_create_like), allocate alike
+// from an allocator without release_all and have no snapshots. Item ids
+// stay valid and follow their items into the tree that now holds them.
+// Returns false and changes nothing when memory runs out, the key ranges
+// overlap or the trees do not match.
+bool btree_split(void* btree, const void* key, void** left, void** right);
+bool btree_join(void* left, void* right);
+
+// Versioned, pointer-free file of the items of btree (or of a snapshot) in
+// key order, with a static index above them. Keys and values are copied
+// bytewise, so they must not hold pointers; the file is read back only on
+// machines of the writer's byte order. path is replaced once the new file
+// is complete, and the replacement is on disk when btree_save returns.
+// Saves to one path may overlap: each writes a temporary file of its own
+// and the last to finish wins. The save must not overlap writes to btree.
+bool btree_save(const void* btree, const char* path);
+// Read-only view of a saved file served from its mapped pages without
+// deserializing: opening costs a page fault, lookups touch one index page
+// per level and processes share the pages through the OS cache. compare
+// must order keys as the saved tree did. Iteration runs from
+// btree_mapped_first through btree_mapped_next until btree_stop(). Returns
+// NULL for a missing, truncated or foreign file.
+void* btree_open_mmap(const char* path, int(*compare)(const void*, const void*));
+void btree_mapped_close(void* mapped);
+size_t btree_mapped_count(const void* mapped);
+size_t btree_mapped_key_size(const void* mapped);
+size_t btree_mapped_value_size(const void* mapped);
+const void* btree_mapped_item(const void* mapped, const void* key);
+size_t btree_mapped_first(const void* mapped);
+size_t btree_mapped_next(const void* mapped, size_t item_id);
+size_t btree_mapped_lower_bound(const void* mapped, const void* key);
+const void* btree_mapped_key(const void* mapped, size_t item_id);
+const void* btree_mapped_value(const void* mapped, size_t item_id);
+
+// Crash-durable tree kept in path.ckpt, a checkpoint in the btree_save
+// format, and path.wal, a write-ahead log of the puts and removes since.
+// Opening recovers the checkpoint and replays only the log after it, up to
+// the first record a crash left incomplete. groupOps operations share one
+// fsync (1 = each call is durable on return, 0 = only on commit), and a
+// checkpoint is taken whenever the log outgrows checkpointBytes (0 = only
+// on request). Keys and values are logged bytewise. Not thread-safe. Reads
+// go through btree_durable_tree; after a false return the store accepts no
+// more changes. Opening fails, leaving the files alone, when they can not
+// be read.
+void* btree_create_durable(
+    const char* path,
+    size_t keySize,
+    size_t valueSize,
+    int(*compare)(const void*, const void*),
+    size_t groupOps,
+    size_t checkpointBytes);
+bool btree_durable_close(void* durable, void(*destroy)(void*));
+const void* btree_durable_tree(const void* durable);
+bool btree_durable_put(void* durable, const void* key, const void* value, bool* createFlag);
+bool btree_durable_remove(void* durable, const void* key, void(*destroy)(void*));
+bool btree_durable_commit(void* durable);
+bool btree_durable_checkpoint(void* durable);
+
+// Set algebra of two trees of the same key and value sizes that order keys
+// alike, into a new tree (see btree_create_like) built in linear time.
+// threads (0 = one per core) each merge a slice of the key range. Values
+// come from lhs wherever a key is in both. Keys and values are copied
+// bytewise, so destroy callbacks must run over either the result or the
+// inputs, not both. The inputs must not change meanwhile; they may be
+// snapshots, which merge in linear time too. Returns NULL when the sizes differ or memory runs out.
+void* btree_union(const void* lhs, const void* rhs, size_t threads);
+void* btree_intersect(const void* lhs, const void* rhs, size_t threads);
+void* btree_difference(const void* lhs, const void* rhs, size_t threads);
+
+// Slab pool: carves blocks out of chunkSize chunks (0 picks 2 MiB) and
+// reuses released blocks of the same size. One pool serves one tree.
+void* btree_slab_create(size_t chunkSize, bool hugePages);
+void btree_slab_destroy(void* slab);
+BTreeAllocator btree_slab_allocator(void* slab);
+
+// Thread-safe variant: every call may run concurrently with any other but
+// destroy. Values are copied in and out, since a pointer into the tree could
+// be invalidated by another thread at any time. put overwrites the value of
+// an existing key; remove copies the removed value out when value is set.
+// Nodes that fall below half full are merged or refilled, so memory and
+// height follow the count rather than the number of keys ever inserted.
+void* btree_create_concurrent(size_t keySize, size_t valueSize, int(*compare)(const void*, const void*));
+void btree_concurrent_destroy(void* btree, void(*destroy)(void*));
+size_t btree_concurrent_count(const void* btree);
+size_t btree_concurrent_height(const void* btree);
+bool btree_concurrent_get(const void* btree, const void* key, void* value);
+bool btree_concurrent_put(void* btree, const void* key, const void* value, bool* createFlag);
+bool btree_concurrent_remove(void* btree, const void* key, void* value);
+size_t btree_concurrent_scan(const void* btree, const void* low, const void* high, bool(*visit)(void* item, void* context), void* context);
+
+// Read-mostly variant: readers take no lock and write nothing shared, and
+// writers, serialized among themselves, publish a path-copied tree with one
+// atomic pointer swap. Every reading thread reads through its own reader,
+// which must be freed before the tree is destroyed. Nodes and items a write
+// replaces are freed, and the destroy of a removed or overwritten item
+// runs, only once no reader can still see them.
+void* btree_create_rcu(size_t keySize, size_t valueSize, int(*compare)(const void*, const void*));
+void btree_rcu_destroy(void* btree, void(*destroy)(void*));
+void* btree_rcu_reader(void* btree);
+void btree_rcu_reader_free(void* reader);
+size_t btree_rcu_count(const void* btree);
+bool btree_rcu_get(void* reader, const void* key, void* value);
+size_t btree_rcu_scan(void* reader, const void* low, const void* high, bool(*visit)(void* item, void* context), void* context);
+bool btree_rcu_put(void* btree, const void* key, const void* value, bool* createFlag, void(*destroy)(void*));
+bool btree_rcu_remove(void* btree, const void* key, void(*destroy)(void*));
+
+// Range-partitioned container over shards independent trees (0 = one per
+// core), each behind its own latch, so threads inserting into different
+// key ranges do not contend. Split points are the quantiles of sample
+// (sampleCount keys, may be NULL) and can be recomputed from the stored
+// keys with btree_sharded_rebalance, which is not thread-safe and moves
+// values. insert, item and remove may run concurrently with each other;
+// the values they return are not guarded against concurrent access to the
+// same key, and iteration must not overlap writes.
+typedef
+struct BTreeShardedCursor
+{
+    size_t shard;
+    size_t item_id;
+}
+BTreeShardedCursor;
+
+void* btree_create_sharded(
+    size_t keySize,
+    size_t valueSize,
+    int(*compare)(const void*, const void*),
+    size_t shards,
+    const void* sample,
+    size_t sampleCount);
+void btree_sharded_destroy(void* sharded, void(*destroy)(void*));
+bool btree_sharded_rebalance(void* sharded);
+size_t btree_sharded_count(const void* sharded);
+size_t btree_sharded_shards(const void* sharded);
+void* btree_sharded_insert(void* sharded, const void* key, bool* createFlag);
+void* btree_sharded_item(const void* sharded, const void* key);
+void btree_sharded_remove(void* sharded, const void* key, void(*destroy)(void*));
+// item_id is btree_stop() past the last item.
+BTreeShardedCursor btree_sharded_first(const void* sharded);
+BTreeShardedCursor btree_sharded_next(const void* sharded, BTreeShardedCursor cursor);
+void* btree_sharded_current(const void* sharded, BTreeShardedCursor cursor);
\ No newline at end of file
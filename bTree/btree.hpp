@@ -0,0 +1,811 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// C++ counterpart of btree.c: the same B+tree (keys inline in ~512-byte
+// nodes, every element in its own block, leaves chained), with Compare as a
+// template parameter so searches compare inline instead of through a
+// function pointer. Element addresses stay stable until the element is
+// erased, as with std::map.
+//
+// Every allocation and key copy an insert needs is made before the tree is
+// touched, so a throwing insert leaves the map unchanged. Keys must be
+// nothrow move constructible.
+
+namespace btree {
+
+template <class K, class V, class Compare = std::less<K>>
+class map {
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<const K, V>;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using key_compare = Compare;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+
+private:
+    static_assert(std::is_nothrow_move_constructible<K>::value, "btree::map moves keys between nodes");
+
+    static constexpr size_type node_bytes = 512;
+    static constexpr size_type min_order = 4;
+    static constexpr size_type header_bytes = 4 * sizeof(void*) + sizeof(size_type);
+    static constexpr size_type fitting_keys = (node_bytes - header_bytes) / (sizeof(K) + sizeof(void*));
+    static constexpr size_type order = (fitting_keys > min_order) ? fitting_keys : min_order;
+    static constexpr size_type min_keys = order / 2;
+
+    // Internal nodes keep count separators and count + 1 children in links,
+    // leaves keep count elements. Both have room for one extra key so an
+    // insert can overflow a node before it is split.
+    struct node {
+        node* parent;
+        node* prev;
+        node* next;
+        size_type count;
+        bool is_leaf;
+        void* links[order + 2];
+        alignas(K) unsigned char key_bytes[(order + 1) * sizeof(K)];
+
+        K& key(size_type index) {
+            return reinterpret_cast<K*>(key_bytes)[index];
+        }
+        const K& key(size_type index) const {
+            return reinterpret_cast<const K*>(key_bytes)[index];
+        }
+        node* child(size_type index) const {
+            return static_cast<node*>(links[index]);
+        }
+        value_type* entry(size_type index) const {
+            return static_cast<value_type*>(links[index]);
+        }
+    };
+
+    template <bool Const>
+    class basic_iterator {
+        friend class map;
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = typename map::value_type;
+        using difference_type = typename map::difference_type;
+        using pointer = typename std::conditional<Const, const value_type*, value_type*>::type;
+        using reference = typename std::conditional<Const, const value_type&, value_type&>::type;
+
+        basic_iterator() = default;
+        template <bool OtherConst, class = typename std::enable_if<Const && !OtherConst>::type>
+        basic_iterator(const basic_iterator<OtherConst>& other) : owner(other.owner), leaf(other.leaf), slot(other.slot) {}
+
+        reference operator*() const {
+            return *leaf->entry(slot);
+        }
+        pointer operator->() const {
+            return leaf->entry(slot);
+        }
+
+        basic_iterator& operator++() {
+            if (++slot == leaf->count) {
+                leaf = leaf->next;
+                slot = 0;
+            }
+            return *this;
+        }
+        basic_iterator operator++(int) {
+            basic_iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+        // end() steps back to the last element, so reverse iteration works.
+        basic_iterator& operator--() {
+            if (leaf == nullptr) {
+                leaf = rightmost_leaf(owner->root_);
+                slot = leaf->count - 1;
+            }
+            else if (slot == 0) {
+                leaf = leaf->prev;
+                slot = leaf->count - 1;
+            }
+            else {
+                slot--;
+            }
+            return *this;
+        }
+        basic_iterator operator--(int) {
+            basic_iterator previous = *this;
+            --*this;
+            return previous;
+        }
+
+        friend bool operator==(const basic_iterator& lhs, const basic_iterator& rhs) {
+            return (lhs.leaf == rhs.leaf) && (lhs.slot == rhs.slot);
+        }
+        friend bool operator!=(const basic_iterator& lhs, const basic_iterator& rhs) {
+            return !(lhs == rhs);
+        }
+
+    private:
+        basic_iterator(const map* owner, node* leaf, size_type slot) : owner(owner), leaf(leaf), slot(slot) {}
+
+        const map* owner = nullptr;
+        node* leaf = nullptr;
+        size_type slot = 0;
+
+        friend class basic_iterator<!Const>;
+    };
+
+public:
+    using iterator = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    map() = default;
+    explicit map(const Compare& compare) : comp_(compare) {}
+    map(std::initializer_list<value_type> values, const Compare& compare = Compare()) : comp_(compare) {
+        for (const value_type& value : values) {
+            emplace(value);
+        }
+    }
+    // Delegates first, so the destructor frees what was copied when a copy
+    // throws part-way.
+    map(const map& other) : map(other.comp_) {
+        for (const value_type& value : other) {
+            emplace_hint(end(), value);
+        }
+    }
+    map(map&& other) noexcept : comp_(other.comp_) {
+        swap(other);
+    }
+    ~map() {
+        clear();
+        release_spares();
+    }
+
+    map& operator=(map other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    void swap(map& other) noexcept {
+        using std::swap;
+        swap(root_, other.root_);
+        swap(size_, other.size_);
+        swap(spares_, other.spares_);
+        swap(spare_count_, other.spare_count_);
+        swap(comp_, other.comp_);
+    }
+
+    iterator begin() noexcept {
+        return make_iterator(leftmost_leaf(root_), 0);
+    }
+    const_iterator begin() const noexcept {
+        return make_iterator(leftmost_leaf(root_), 0);
+    }
+    const_iterator cbegin() const noexcept {
+        return begin();
+    }
+    iterator end() noexcept {
+        return iterator(this, nullptr, 0);
+    }
+    const_iterator end() const noexcept {
+        return const_iterator(this, nullptr, 0);
+    }
+    const_iterator cend() const noexcept {
+        return end();
+    }
+    reverse_iterator rbegin() noexcept {
+        return reverse_iterator(end());
+    }
+    const_reverse_iterator rbegin() const noexcept {
+        return const_reverse_iterator(end());
+    }
+    reverse_iterator rend() noexcept {
+        return reverse_iterator(begin());
+    }
+    const_reverse_iterator rend() const noexcept {
+        return const_reverse_iterator(begin());
+    }
+
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+    size_type size() const noexcept {
+        return size_;
+    }
+    key_compare key_comp() const {
+        return comp_;
+    }
+
+    // Post-order teardown without recursion, like delete_all_nodes.
+    void clear() noexcept {
+        node* current = leftmost_leaf(root_);
+        while (current != nullptr) {
+            node* parent = current->parent;
+            const size_type index = (parent != nullptr) ? child_position(parent, current) : 0;
+            for (size_type i = 0; i < current->count; i++) {
+                if (current->is_leaf) {
+                    delete current->entry(i);
+                }
+                current->key(i).~K();
+            }
+            delete current;
+            current = ((parent != nullptr) && (index < parent->count)) ? leftmost_leaf(parent->child(index + 1)) : parent;
+        }
+        root_ = nullptr;
+        size_ = 0;
+    }
+
+    iterator find(const K& key) {
+        const position at = locate(key);
+        return at.found ? make_iterator(at.leaf, at.slot) : end();
+    }
+    const_iterator find(const K& key) const {
+        const position at = locate(key);
+        return at.found ? make_iterator(at.leaf, at.slot) : end();
+    }
+    size_type count(const K& key) const {
+        return locate(key).found ? 1 : 0;
+    }
+    bool contains(const K& key) const {
+        return locate(key).found;
+    }
+    iterator lower_bound(const K& key) {
+        const position at = locate(key);
+        return make_iterator(at.leaf, at.slot);
+    }
+    const_iterator lower_bound(const K& key) const {
+        const position at = locate(key);
+        return make_iterator(at.leaf, at.slot);
+    }
+    iterator upper_bound(const K& key) {
+        const position at = locate(key);
+        return make_iterator(at.leaf, at.found ? at.slot + 1 : at.slot);
+    }
+    const_iterator upper_bound(const K& key) const {
+        const position at = locate(key);
+        return make_iterator(at.leaf, at.found ? at.slot + 1 : at.slot);
+    }
+
+    V& at(const K& key) {
+        const position found = locate(key);
+        if (!found.found) {
+            throw std::out_of_range("btree::map::at");
+        }
+        return found.leaf->entry(found.slot)->second;
+    }
+    const V& at(const K& key) const {
+        const position found = locate(key);
+        if (!found.found) {
+            throw std::out_of_range("btree::map::at");
+        }
+        return found.leaf->entry(found.slot)->second;
+    }
+    V& operator[](const K& key) {
+        return try_emplace(key).first->second;
+    }
+    V& operator[](K&& key) {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    std::pair<iterator, bool> insert(const value_type& value) {
+        return try_emplace(value.first, value.second);
+    }
+    std::pair<iterator, bool> insert(value_type&& value) {
+        return try_emplace(value.first, std::move(value.second));
+    }
+
+    // Like std::map::emplace the element is built before its key is known,
+    // and dropped again when the key is already present.
+    template <class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        std::unique_ptr<value_type> entry(new value_type(std::forward<Args>(args)...));
+        const position at = locate(entry->first);
+        if (at.found) {
+            return std::make_pair(make_iterator(at.leaf, at.slot), false);
+        }
+        const iterator inserted = insert_entry(at, entry.get());
+        entry.release();
+        return std::make_pair(inserted, true);
+    }
+
+    // A hint at end() skips the search while values arrive in ascending
+    // order, which is how copies are built.
+    template <class... Args>
+    iterator emplace_hint(const_iterator hint, Args&&... args) {
+        std::unique_ptr<value_type> entry(new value_type(std::forward<Args>(args)...));
+        position at;
+        if ((hint == cend()) && (root_ != nullptr) && comp_(back_key(), entry->first)) {
+            at.leaf = rightmost_leaf(root_);
+            at.slot = at.leaf->count;
+            at.found = false;
+        }
+        else {
+            at = locate(entry->first);
+            if (at.found) {
+                return make_iterator(at.leaf, at.slot);
+            }
+        }
+        const iterator inserted = insert_entry(at, entry.get());
+        entry.release();
+        return inserted;
+    }
+
+    // Builds the element only when key is missing; args are untouched otherwise.
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(const K& key, Args&&... args) {
+        const position at = locate(key);
+        if (at.found) {
+            return std::make_pair(make_iterator(at.leaf, at.slot), false);
+        }
+        std::unique_ptr<value_type> entry(new value_type(std::piecewise_construct,
+            std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...)));
+        const iterator inserted = insert_entry(at, entry.get());
+        entry.release();
+        return std::make_pair(inserted, true);
+    }
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+        const position at = locate(key);
+        if (at.found) {
+            return std::make_pair(make_iterator(at.leaf, at.slot), false);
+        }
+        std::unique_ptr<value_type> entry(new value_type(std::piecewise_construct,
+            std::forward_as_tuple(std::move(key)), std::forward_as_tuple(std::forward<Args>(args)...)));
+        const iterator inserted = insert_entry(at, entry.get());
+        entry.release();
+        return std::make_pair(inserted, true);
+    }
+
+    // Unlinks through the iterator's leaf and slot without a search; only
+    // when the leaf had to be rebalanced is the next element looked up again.
+    iterator erase(const_iterator where) {
+        node* leaf = where.leaf;
+        const size_type slot = where.slot;
+        const value_type* next = (slot + 1 < leaf->count) ? leaf->entry(slot + 1) :
+            ((leaf->next != nullptr) ? leaf->next->entry(0) : nullptr);
+        if (next == nullptr) {
+            erase_at(leaf, slot);
+            return end();
+        }
+        // Something follows, so leaf is not a root about to be emptied.
+        if (!unlink_at(leaf, slot)) {
+            return make_iterator(leaf, slot);
+        }
+        rebalance(leaf);
+        const position at = locate(next->first);
+        return make_iterator(at.leaf, at.slot);
+    }
+    iterator erase(iterator where) {
+        return erase(const_iterator(where));
+    }
+    size_type erase(const K& key) {
+        const position at = locate(key);
+        if (!at.found) {
+            return 0;
+        }
+        erase_at(at.leaf, at.slot);
+        return 1;
+    }
+
+private:
+    struct position {
+        node* leaf;
+        size_type slot;
+        bool found;
+    };
+
+    node* root_ = nullptr;
+    size_type size_ = 0;
+    node* spares_ = nullptr;
+    size_type spare_count_ = 0;
+    Compare comp_ = Compare();
+
+    iterator make_iterator(node* leaf, size_type slot) {
+        if ((leaf != nullptr) && (slot == leaf->count)) {
+            leaf = leaf->next;
+            slot = 0;
+        }
+        return iterator(this, leaf, slot);
+    }
+    const_iterator make_iterator(node* leaf, size_type slot) const {
+        if ((leaf != nullptr) && (slot == leaf->count)) {
+            leaf = leaf->next;
+            slot = 0;
+        }
+        return const_iterator(this, leaf, slot);
+    }
+
+    static node* leftmost_leaf(node* current) {
+        while ((current != nullptr) && !current->is_leaf) {
+            current = current->child(0);
+        }
+        return current;
+    }
+    static node* rightmost_leaf(node* current) {
+        while ((current != nullptr) && !current->is_leaf) {
+            current = current->child(current->count);
+        }
+        return current;
+    }
+    static size_type child_position(const node* parent, const node* child) {
+        size_type index = 0;
+        while (parent->links[index] != child) {
+            index++;
+        }
+        return index;
+    }
+
+    const K& back_key() const {
+        const node* leaf = rightmost_leaf(root_);
+        return leaf->key(leaf->count - 1);
+    }
+
+    // First key in current that is not less than key.
+    size_type lower_index(const node* current, const K& key) const {
+        size_type low = 0;
+        size_type high = current->count;
+        while (low < high) {
+            const size_type middle = low + (high - low) / 2;
+            if (comp_(current->key(middle), key)) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+
+    // Child to descend into: separators equal to key send it right.
+    size_type child_index(const node* current, const K& key) const {
+        size_type low = 0;
+        size_type high = current->count;
+        while (low < high) {
+            const size_type middle = low + (high - low) / 2;
+            if (comp_(key, current->key(middle))) {
+                high = middle;
+            }
+            else {
+                low = middle + 1;
+            }
+        }
+        return low;
+    }
+
+    position locate(const K& key) const {
+        position at = { root_, 0, false };
+        if (at.leaf == nullptr) {
+            return at;
+        }
+        while (!at.leaf->is_leaf) {
+            at.leaf = at.leaf->child(child_index(at.leaf, key));
+        }
+        at.slot = lower_index(at.leaf, key);
+        at.found = (at.slot < at.leaf->count) && !comp_(key, at.leaf->key(at.slot));
+        return at;
+    }
+
+    // Spare nodes are chained through parent, as in btree.c.
+    void reserve_nodes(size_type needed) {
+        while (spare_count_ < needed) {
+            node* spare = new node;
+            spare->parent = spares_;
+            spares_ = spare;
+            spare_count_++;
+        }
+    }
+    node* take_node(bool is_leaf) noexcept {
+        node* taken = spares_;
+        spares_ = taken->parent;
+        spare_count_--;
+        taken->parent = nullptr;
+        taken->prev = nullptr;
+        taken->next = nullptr;
+        taken->count = 0;
+        taken->is_leaf = is_leaf;
+        return taken;
+    }
+    void release_spares() noexcept {
+        while (spares_ != nullptr) {
+            node* spare = spares_;
+            spares_ = spare->parent;
+            delete spare;
+        }
+        spare_count_ = 0;
+    }
+
+    static void move_key(node* to, size_type to_index, node* from, size_type from_index) noexcept {
+        ::new (static_cast<void*>(&to->key(to_index))) K(std::move(from->key(from_index)));
+        from->key(from_index).~K();
+    }
+    // Opens slot index; links are shifted by the caller.
+    static void shift_keys_right(node* current, size_type index) noexcept {
+        for (size_type i = current->count; i > index; i--) {
+            move_key(current, i, current, i - 1);
+        }
+    }
+    // Closes the already vacated slot index.
+    static void shift_keys_left(node* current, size_type index) noexcept {
+        for (size_type i = index; i + 1 < current->count; i++) {
+            move_key(current, i, current, i + 1);
+        }
+    }
+    static void shift_links(node* current, size_type from, size_type to, size_type total) noexcept {
+        if (from < to) {
+            for (size_type i = total; i > from; i--) {
+                current->links[i - 1 + (to - from)] = current->links[i - 1];
+            }
+        }
+        else {
+            for (size_type i = from; i < total; i++) {
+                current->links[i - (from - to)] = current->links[i];
+            }
+        }
+    }
+    static size_type link_count(const node* current) {
+        return current->is_leaf ? current->count : current->count + 1;
+    }
+
+    // The key that ends up first in the right half when the full leaf
+    // splits after key is inserted at slot.
+    static const K& split_key(const node* leaf, size_type slot, const K& key) {
+        const size_type middle = (leaf->count + 1) / 2;
+        if (slot == middle) {
+            return key;
+        }
+        return leaf->key((slot < middle) ? middle - 1 : middle);
+    }
+
+    // at must be the missing key's insertion point. Everything that can
+    // throw happens before the first node is modified.
+    iterator insert_entry(position at, value_type* entry) {
+        size_type needed = 0;
+        if (root_ == nullptr) {
+            needed = 1;
+        }
+        else {
+            const node* full = at.leaf;
+            while ((full != nullptr) && (full->count == order)) {
+                needed++;
+                full = full->parent;
+            }
+            if ((full == nullptr) && (needed > 0)) {
+                needed++;
+            }
+        }
+        reserve_nodes(needed);
+        K key(entry->first);
+        if (root_ == nullptr) {
+            root_ = take_node(true);
+            at.leaf = root_;
+            at.slot = 0;
+        }
+        node* leaf = at.leaf;
+        const size_type slot = at.slot;
+        if (leaf->count < order) {
+            insert_into_leaf(leaf, slot, std::move(key), entry);
+            return iterator(this, leaf, slot);
+        }
+        K separator(split_key(leaf, slot, key));
+        insert_into_leaf(leaf, slot, std::move(key), entry);
+        split_leaf(leaf, std::move(separator));
+        if (slot >= leaf->count) {
+            return iterator(this, leaf->next, slot - leaf->count);
+        }
+        return iterator(this, leaf, slot);
+    }
+
+    void insert_into_leaf(node* leaf, size_type slot, K&& key, value_type* entry) noexcept {
+        shift_keys_right(leaf, slot);
+        shift_links(leaf, slot, slot + 1, leaf->count);
+        ::new (static_cast<void*>(&leaf->key(slot))) K(std::move(key));
+        leaf->links[slot] = entry;
+        leaf->count++;
+        size_++;
+    }
+
+    void split_leaf(node* leaf, K&& separator) noexcept {
+        node* right = take_node(true);
+        const size_type middle = leaf->count / 2;
+        for (size_type i = middle; i < leaf->count; i++) {
+            move_key(right, i - middle, leaf, i);
+            right->links[i - middle] = leaf->links[i];
+        }
+        right->count = leaf->count - middle;
+        leaf->count = middle;
+        right->next = leaf->next;
+        if (right->next != nullptr) {
+            right->next->prev = right;
+        }
+        right->prev = leaf;
+        leaf->next = right;
+        insert_into_parent(leaf, std::move(separator), right);
+    }
+
+    void insert_into_parent(node* left, K&& separator, node* right) noexcept {
+        node* parent = left->parent;
+        if (parent == nullptr) {
+            root_ = take_node(false);
+            ::new (static_cast<void*>(&root_->key(0))) K(std::move(separator));
+            root_->links[0] = left;
+            root_->links[1] = right;
+            root_->count = 1;
+            left->parent = root_;
+            right->parent = root_;
+            return;
+        }
+        const size_type index = child_position(parent, left);
+        shift_keys_right(parent, index);
+        shift_links(parent, index + 1, index + 2, parent->count + 1);
+        ::new (static_cast<void*>(&parent->key(index))) K(std::move(separator));
+        parent->links[index + 1] = right;
+        right->parent = parent;
+        parent->count++;
+        if (parent->count <= order) {
+            return;
+        }
+
+        node* sibling = take_node(false);
+        const size_type middle = parent->count / 2;
+        K raised(std::move(parent->key(middle)));
+        parent->key(middle).~K();
+        for (size_type i = middle + 1; i < parent->count; i++) {
+            move_key(sibling, i - middle - 1, parent, i);
+        }
+        for (size_type i = middle + 1; i <= parent->count; i++) {
+            sibling->links[i - middle - 1] = parent->links[i];
+            sibling->child(i - middle - 1)->parent = sibling;
+        }
+        sibling->count = parent->count - middle - 1;
+        parent->count = middle;
+        insert_into_parent(parent, std::move(raised), sibling);
+    }
+
+    // Takes slot out of leaf; true when leaf is not the root and fell below
+    // the minimum fill. An emptied root is left to the caller.
+    bool unlink_at(node* leaf, size_type slot) {
+        delete leaf->entry(slot);
+        leaf->key(slot).~K();
+        shift_keys_left(leaf, slot);
+        shift_links(leaf, slot + 1, slot, leaf->count);
+        leaf->count--;
+        size_--;
+        return (leaf != root_) && (leaf->count < min_keys);
+    }
+
+    void erase_at(node* leaf, size_type slot) {
+        if (unlink_at(leaf, slot)) {
+            rebalance(leaf);
+        }
+        else if ((leaf == root_) && (leaf->count == 0)) {
+            delete leaf;
+            root_ = nullptr;
+        }
+    }
+
+    // Borrows from a sibling with keys to spare, else merges and walks up.
+    // A separator copied up from a leaf is made before anything moves, so
+    // a throwing copy leaves an underfull but valid tree.
+    void rebalance(node* current) {
+        while ((current != root_) && (current->count < min_keys)) {
+            node* parent = current->parent;
+            const size_type index = child_position(parent, current);
+            node* left = (index > 0) ? parent->child(index - 1) : nullptr;
+            node* right = (index < parent->count) ? parent->child(index + 1) : nullptr;
+            if ((left != nullptr) && (left->count > min_keys)) {
+                borrow_from_left(current, left, parent, index);
+                return;
+            }
+            if ((right != nullptr) && (right->count > min_keys)) {
+                borrow_from_right(current, right, parent, index);
+                return;
+            }
+            if (left != nullptr) {
+                merge_nodes(left, current, parent, index - 1);
+            }
+            else {
+                merge_nodes(current, right, parent, index);
+            }
+            if ((parent == root_) && (parent->count == 0)) {
+                root_ = parent->child(0);
+                root_->parent = nullptr;
+                delete parent;
+                return;
+            }
+            current = parent;
+        }
+    }
+
+    void replace_key(node* current, size_type index, K&& key) noexcept {
+        current->key(index).~K();
+        ::new (static_cast<void*>(&current->key(index))) K(std::move(key));
+    }
+
+    void borrow_from_left(node* current, node* left, node* parent, size_type index) {
+        if (current->is_leaf) {
+            K separator(left->key(left->count - 1));
+            shift_keys_right(current, 0);
+            shift_links(current, 0, 1, current->count);
+            move_key(current, 0, left, left->count - 1);
+            current->links[0] = left->links[left->count - 1];
+            replace_key(parent, index - 1, std::move(separator));
+        }
+        else {
+            shift_keys_right(current, 0);
+            shift_links(current, 0, 1, current->count + 1);
+            move_key(current, 0, parent, index - 1);
+            current->links[0] = left->links[left->count];
+            current->child(0)->parent = current;
+            move_key(parent, index - 1, left, left->count - 1);
+        }
+        left->count--;
+        current->count++;
+    }
+
+    void borrow_from_right(node* current, node* right, node* parent, size_type index) {
+        if (current->is_leaf) {
+            K separator(right->key(1));
+            move_key(current, current->count, right, 0);
+            current->links[current->count] = right->links[0];
+            shift_keys_left(right, 0);
+            shift_links(right, 1, 0, right->count);
+            replace_key(parent, index, std::move(separator));
+        }
+        else {
+            move_key(current, current->count, parent, index);
+            current->links[current->count + 1] = right->links[0];
+            current->child(current->count + 1)->parent = current;
+            move_key(parent, index, right, 0);
+            shift_keys_left(right, 0);
+            shift_links(right, 1, 0, right->count + 1);
+        }
+        right->count--;
+        current->count++;
+    }
+
+    // Moves right into left and drops separator index from parent.
+    void merge_nodes(node* left, node* right, node* parent, size_type index) noexcept {
+        if (left->is_leaf) {
+            parent->key(index).~K();
+            left->next = right->next;
+            if (left->next != nullptr) {
+                left->next->prev = left;
+            }
+        }
+        else {
+            move_key(left, left->count, parent, index);
+            left->count++;
+        }
+        const size_type links = link_count(right);
+        for (size_type i = 0; i < right->count; i++) {
+            move_key(left, left->count + i, right, i);
+        }
+        for (size_type i = 0; i < links; i++) {
+            left->links[left->count + i] = right->links[i];
+            if (!left->is_leaf) {
+                left->child(left->count + i)->parent = left;
+            }
+        }
+        left->count += right->count;
+        delete right;
+
+        shift_keys_left(parent, index);
+        shift_links(parent, index + 2, index + 1, parent->count + 1);
+        parent->count--;
+    }
+};
+
+template <class K, class V, class Compare>
+void swap(map<K, V, Compare>& lhs, map<K, V, Compare>& rhs) noexcept {
+    lhs.swap(rhs);
+}
+
+}
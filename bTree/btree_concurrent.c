@@ -0,0 +1,763 @@
+// Ahead of every system header, so <pthread.h> declares the rwlock API
+// even under strict -std=c11.
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "btree.h"
+#include "btree_thread.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BTREE_CONCURRENT_NODE_BYTES 512
+#define BTREE_CONCURRENT_MIN_ORDER 4
+#define BTREE_CONCURRENT_MAX_ALIGN 16
+// Deeper than any tree that fits in memory with at least 2 keys per node.
+#define BTREE_CONCURRENT_MAX_HEIGHT 64
+
+typedef struct BTreeConcurrentNode BTreeConcurrentNode;
+typedef struct BTreeConcurrent BTreeConcurrent;
+
+// Leaves keep count keys and values inline, internal nodes count keys and
+// count + 1 children. Every level is chained through next_node. A node is
+// only ever merged into its left neighbour under the same parent, and
+// is_leaf is fixed when a node is built, so it may be read without holding
+// the latch. Retired nodes reuse next_node to chain the garbage and count
+// for the epoch they were retired in.
+struct BTreeConcurrentNode {
+    BTreeLatch latch;
+    BTreeConcurrentNode* next_node;
+    size_t count;
+    bool is_leaf;
+};
+
+// Readers couple shared latches from root_latch down to the leaf. Writers
+// do the same but take the leaf exclusively, and only when the leaf would
+// split or fall below half full do they start over from the root with
+// exclusive latches, releasing everything above each node that can take
+// one more key or lose one. A node is unlinked only while its parent is
+// latched exclusively, which keeps every descent off it; only scans step
+// sideways without a latch, so they count themselves in active[epoch % 2]
+// meanwhile and unlinked nodes wait in the garbage list until two epochs
+// have passed. shifts grows whenever keys move between leaves, and tells a
+// scan that the next leaf may have lost keys to the one it just copied.
+struct BTreeConcurrent {
+    size_t key_size;
+    size_t value_size;
+    size_t leaf_order;
+    size_t inner_order;
+    size_t keys_offset;
+    size_t values_offset;
+    size_t children_offset;
+    size_t leaf_size;
+    size_t inner_size;
+    int(*comp)(const void*, const void*);
+    BTreeLatch root_latch;
+    BTreeConcurrentNode* root;
+    volatile size_t size;
+    volatile size_t shifts;
+    volatile size_t epoch;
+    volatile size_t active[2];
+    BTreeLatch garbage_latch;
+    BTreeConcurrentNode* garbage_head;
+    BTreeConcurrentNode* garbage_tail;
+};
+
+static size_t align_up(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+static size_t size_alignment(size_t size) {
+    size_t alignment = 1;
+    while ((alignment < BTREE_CONCURRENT_MAX_ALIGN) && (size % (alignment * 2) == 0)) {
+        alignment *= 2;
+    }
+    return alignment;
+}
+
+static size_t order_for(size_t header, size_t slot_size) {
+    size_t order = BTREE_CONCURRENT_MIN_ORDER;
+    if (BTREE_CONCURRENT_NODE_BYTES > header + 2 * slot_size) {
+        const size_t room = BTREE_CONCURRENT_NODE_BYTES - header - 2 * slot_size;
+        if (room / slot_size > order) {
+            order = room / slot_size;
+        }
+    }
+    return order;
+}
+
+// Every node has room for one key over its order, as in btree.c.
+static void setup_layout(BTreeConcurrent* tree) {
+    const size_t header = sizeof(BTreeConcurrentNode);
+    tree->keys_offset = align_up(header, BTREE_CONCURRENT_MAX_ALIGN);
+    tree->leaf_order = order_for(tree->keys_offset, tree->key_size + tree->value_size);
+    tree->inner_order = order_for(tree->keys_offset, tree->key_size + sizeof(void*));
+    tree->values_offset = align_up(tree->keys_offset + (tree->leaf_order + 1) * tree->key_size, size_alignment(tree->value_size));
+    tree->leaf_size = tree->values_offset + (tree->leaf_order + 1) * tree->value_size;
+    tree->children_offset = align_up(tree->keys_offset + (tree->inner_order + 1) * tree->key_size, sizeof(void*));
+    tree->inner_size = tree->children_offset + (tree->inner_order + 2) * sizeof(void*);
+}
+
+static unsigned char* node_key(const BTreeConcurrent* tree, const BTreeConcurrentNode* node, size_t index) {
+    return (unsigned char*)node + tree->keys_offset + index * tree->key_size;
+}
+
+static unsigned char* node_value(const BTreeConcurrent* tree, const BTreeConcurrentNode* node, size_t index) {
+    return (unsigned char*)node + tree->values_offset + index * tree->value_size;
+}
+
+static BTreeConcurrentNode** node_children(const BTreeConcurrent* tree, const BTreeConcurrentNode* node) {
+    return (BTreeConcurrentNode**)((unsigned char*)node + tree->children_offset);
+}
+
+static size_t node_order(const BTreeConcurrent* tree, const BTreeConcurrentNode* node) {
+    return node->is_leaf ? tree->leaf_order : tree->inner_order;
+}
+
+// A node that can take one more key without splitting.
+static bool node_safe(const BTreeConcurrent* tree, const BTreeConcurrentNode* node) {
+    return node->count < node_order(tree, node);
+}
+
+static size_t node_min(const BTreeConcurrent* tree, const BTreeConcurrentNode* node) {
+    return node_order(tree, node) / 2;
+}
+
+// A node that can lose one key without falling below half full; the root
+// only has to keep two children.
+static bool node_spare(const BTreeConcurrent* tree, const BTreeConcurrentNode* node, bool is_root) {
+    if (is_root) {
+        return node->is_leaf || (node->count > 1);
+    }
+    return node->count > node_min(tree, node);
+}
+
+static BTreeConcurrentNode* build_node(const BTreeConcurrent* tree, bool is_leaf) {
+    BTreeConcurrentNode* node = malloc(is_leaf ? tree->leaf_size : tree->inner_size);
+    if (node == NULL) {
+        return NULL;
+    }
+    btree_latch_init(&node->latch);
+    node->next_node = NULL;
+    node->count = 0;
+    node->is_leaf = is_leaf;
+    return node;
+}
+
+static void delete_node(BTreeConcurrentNode* node) {
+    btree_latch_free(&node->latch);
+    free(node);
+}
+
+static size_t lower_bound(const BTreeConcurrent* tree, const BTreeConcurrentNode* node, const void* key, bool* found) {
+    size_t low = 0;
+    size_t high = node->count;
+    *found = false;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        const int route = tree->comp(node_key(tree, node, middle), key);
+        if (route < 0) {
+            low = middle + 1;
+        }
+        else {
+            if (route == 0) {
+                *found = true;
+            }
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Index of the child key routes to; a NULL key routes to the leftmost.
+static size_t route_index(const BTreeConcurrent* tree, const BTreeConcurrentNode* node, const void* key) {
+    if (key == NULL) {
+        return 0;
+    }
+    bool found = false;
+    const size_t index = lower_bound(tree, node, key, &found);
+    return found ? index + 1 : index;
+}
+
+static BTreeConcurrentNode* route_child(const BTreeConcurrent* tree, const BTreeConcurrentNode* node, const void* key) {
+    return node_children(tree, node)[route_index(tree, node, key)];
+}
+
+// Registers a scan about to step onto a leaf it holds no latch on. The
+// epoch is read again after the count went up, so a reclaim that missed
+// the count has not moved the epoch past it yet.
+static size_t enter_epoch(BTreeConcurrent* tree) {
+    for (;;) {
+        const size_t epoch = btree_atomic_load(&tree->epoch);
+        btree_atomic_add(&tree->active[epoch % 2], 1);
+        if (btree_atomic_load(&tree->epoch) == epoch) {
+            return epoch;
+        }
+        btree_atomic_add(&tree->active[epoch % 2], (size_t)-1);
+    }
+}
+
+static void leave_epoch(BTreeConcurrent* tree, size_t epoch) {
+    btree_atomic_add(&tree->active[epoch % 2], (size_t)-1);
+}
+
+// Queues a node no descent can reach any more. The epoch moves on once no
+// scan is left from the one before it, and nodes retired two or more epochs
+// ago are freed: every scan that could still step onto them has finished.
+static void retire_node(BTreeConcurrent* tree, BTreeConcurrentNode* node) {
+    btree_latch_write_lock(&tree->garbage_latch);
+    const size_t epoch = btree_atomic_load(&tree->epoch);
+    node->next_node = NULL;
+    node->count = epoch;
+    if (tree->garbage_tail != NULL) {
+        tree->garbage_tail->next_node = node;
+    }
+    else {
+        tree->garbage_head = node;
+    }
+    tree->garbage_tail = node;
+    if (btree_atomic_load(&tree->active[(epoch + 1) % 2]) == 0) {
+        btree_atomic_store(&tree->epoch, epoch + 1);
+    }
+    const size_t current = btree_atomic_load(&tree->epoch);
+    while ((tree->garbage_head != NULL) && (tree->garbage_head->count + 2 <= current)) {
+        BTreeConcurrentNode* garbage = tree->garbage_head;
+        tree->garbage_head = garbage->next_node;
+        if (tree->garbage_head == NULL) {
+            tree->garbage_tail = NULL;
+        }
+        delete_node(garbage);
+    }
+    btree_latch_write_unlock(&tree->garbage_latch);
+}
+
+static void lock_node(BTreeConcurrentNode* node, bool exclusive) {
+    if (exclusive) {
+        btree_latch_write_lock(&node->latch);
+    }
+    else {
+        btree_latch_read_lock(&node->latch);
+    }
+}
+
+// Shared latch coupling down to the leaf key routes to, which is returned
+// latched (exclusively when exclusive is set).
+static BTreeConcurrentNode* latch_leaf(BTreeConcurrent* tree, const void* key, bool exclusive) {
+    btree_latch_read_lock(&tree->root_latch);
+    BTreeConcurrentNode* node = tree->root;
+    lock_node(node, exclusive && node->is_leaf);
+    btree_latch_read_unlock(&tree->root_latch);
+    while (!node->is_leaf) {
+        BTreeConcurrentNode* child = route_child(tree, node, key);
+        lock_node(child, exclusive && child->is_leaf);
+        btree_latch_read_unlock(&node->latch);
+        node = child;
+    }
+    return node;
+}
+
+static void insert_into_leaf(BTreeConcurrent* tree, BTreeConcurrentNode* leaf, size_t slot, const void* key, const void* value) {
+    const size_t moved = leaf->count - slot;
+    memmove(node_key(tree, leaf, slot + 1), node_key(tree, leaf, slot), moved * tree->key_size);
+    memmove(node_value(tree, leaf, slot + 1), node_value(tree, leaf, slot), moved * tree->value_size);
+    memcpy(node_key(tree, leaf, slot), key, tree->key_size);
+    memcpy(node_value(tree, leaf, slot), value, tree->value_size);
+    leaf->count++;
+    btree_atomic_add(&tree->size, 1);
+}
+
+// Moves the upper half of an overflowing node into right and returns the
+// separator for the parent. It stays valid until the parent copies it.
+static const void* split_node(const BTreeConcurrent* tree, BTreeConcurrentNode* node, BTreeConcurrentNode* right) {
+    const size_t middle = node->count / 2;
+    right->next_node = node->next_node;
+    node->next_node = right;
+    if (node->is_leaf) {
+        right->count = node->count - middle;
+        memcpy(node_key(tree, right, 0), node_key(tree, node, middle), right->count * tree->key_size);
+        memcpy(node_value(tree, right, 0), node_value(tree, node, middle), right->count * tree->value_size);
+        node->count = middle;
+        return node_key(tree, right, 0);
+    }
+    right->count = node->count - middle - 1;
+    memcpy(node_key(tree, right, 0), node_key(tree, node, middle + 1), right->count * tree->key_size);
+    memcpy(node_children(tree, right), node_children(tree, node) + middle + 1, (right->count + 1) * sizeof(void*));
+    node->count = middle;
+    return node_key(tree, node, middle);
+}
+
+static void insert_into_parent(const BTreeConcurrent* tree, BTreeConcurrentNode* parent, const BTreeConcurrentNode* left, const void* key, BTreeConcurrentNode* right) {
+    BTreeConcurrentNode** children = node_children(tree, parent);
+    size_t index = 0;
+    while (children[index] != left) {
+        index++;
+    }
+    memmove(node_key(tree, parent, index + 1), node_key(tree, parent, index), (parent->count - index) * tree->key_size);
+    memmove(children + index + 2, children + index + 1, (parent->count - index) * sizeof(void*));
+    memcpy(node_key(tree, parent, index), key, tree->key_size);
+    children[index + 1] = right;
+    parent->count++;
+}
+
+static void release_path(BTreeConcurrent* tree, BTreeConcurrentNode** path, size_t depth, bool root_held) {
+    for (size_t i = 0; i < depth; i++) {
+        btree_latch_write_unlock(&path[i]->latch);
+    }
+    if (root_held) {
+        btree_latch_write_unlock(&tree->root_latch);
+    }
+}
+
+// Exclusive latch coupling for an insert that may split. Every node the
+// split cascade needs is allocated while the latches are held but before
+// anything is modified, so a failed allocation leaves the tree untouched.
+static bool put_splitting(BTreeConcurrent* tree, const void* key, const void* value, bool* createFlag) {
+    BTreeConcurrentNode* path[BTREE_CONCURRENT_MAX_HEIGHT];
+    BTreeConcurrentNode* spares[BTREE_CONCURRENT_MAX_HEIGHT + 1];
+    size_t depth = 0;
+    bool root_held = true;
+    btree_latch_write_lock(&tree->root_latch);
+    BTreeConcurrentNode* node = tree->root;
+    btree_latch_write_lock(&node->latch);
+    if (node_safe(tree, node)) {
+        btree_latch_write_unlock(&tree->root_latch);
+        root_held = false;
+    }
+    path[depth++] = node;
+    while (!node->is_leaf) {
+        node = route_child(tree, node, key);
+        btree_latch_write_lock(&node->latch);
+        if (node_safe(tree, node)) {
+            release_path(tree, path, depth, root_held);
+            depth = 0;
+            root_held = false;
+        }
+        path[depth++] = node;
+    }
+
+    bool found = false;
+    const size_t slot = lower_bound(tree, node, key, &found);
+    *createFlag = !found;
+    if (found) {
+        memcpy(node_value(tree, node, slot), value, tree->value_size);
+        release_path(tree, path, depth, root_held);
+        return true;
+    }
+
+    // Every node on the path but a safe first one splits, starting with the
+    // leaf; a root split also needs the new root.
+    const size_t needed = node_safe(tree, path[0]) ? depth - 1 : depth + 1;
+    for (size_t i = 0; i < needed; i++) {
+        spares[i] = build_node(tree, i == 0);
+        if (spares[i] == NULL) {
+            for (size_t j = 0; j < i; j++) {
+                delete_node(spares[j]);
+            }
+            release_path(tree, path, depth, root_held);
+            return false;
+        }
+    }
+
+    insert_into_leaf(tree, node, slot, key, value);
+    size_t spare = 0;
+    for (size_t i = depth; (i > 0) && (path[i - 1]->count > node_order(tree, path[i - 1])); i--) {
+        BTreeConcurrentNode* right = spares[spare++];
+        const void* separator = split_node(tree, path[i - 1], right);
+        if (i > 1) {
+            insert_into_parent(tree, path[i - 2], path[i - 1], separator, right);
+            continue;
+        }
+        BTreeConcurrentNode* root = spares[spare++];
+        memcpy(node_key(tree, root, 0), separator, tree->key_size);
+        node_children(tree, root)[0] = path[0];
+        node_children(tree, root)[1] = right;
+        root->count = 1;
+        tree->root = root;
+    }
+    release_path(tree, path, depth, root_held);
+    return true;
+}
+
+
+static void remove_from_leaf(BTreeConcurrent* tree, BTreeConcurrentNode* leaf, size_t slot, void* value) {
+    if (value != NULL) {
+        memcpy(value, node_value(tree, leaf, slot), tree->value_size);
+    }
+    const size_t moved = leaf->count - slot - 1;
+    memmove(node_key(tree, leaf, slot), node_key(tree, leaf, slot + 1), moved * tree->key_size);
+    memmove(node_value(tree, leaf, slot), node_value(tree, leaf, slot + 1), moved * tree->value_size);
+    leaf->count--;
+    btree_atomic_add(&tree->size, (size_t)-1);
+}
+
+// Appends right and the separator between them to left. right is left for
+// the caller to unlatch and retire.
+static void merge_nodes(const BTreeConcurrent* tree, BTreeConcurrentNode* left, const void* separator, BTreeConcurrentNode* right) {
+    if (left->is_leaf) {
+        memcpy(node_key(tree, left, left->count), node_key(tree, right, 0), right->count * tree->key_size);
+        memcpy(node_value(tree, left, left->count), node_value(tree, right, 0), right->count * tree->value_size);
+        left->count += right->count;
+    }
+    else {
+        memcpy(node_key(tree, left, left->count), separator, tree->key_size);
+        memcpy(node_key(tree, left, left->count + 1), node_key(tree, right, 0), right->count * tree->key_size);
+        memcpy(node_children(tree, left) + left->count + 1, node_children(tree, right), (right->count + 1) * sizeof(void*));
+        left->count += right->count + 1;
+    }
+    left->next_node = right->next_node;
+}
+
+// Moves the first key of right to the end of left through the separator.
+static void shift_left(const BTreeConcurrent* tree, BTreeConcurrentNode* left, unsigned char* separator, BTreeConcurrentNode* right) {
+    if (left->is_leaf) {
+        memcpy(node_key(tree, left, left->count), node_key(tree, right, 0), tree->key_size);
+        memcpy(node_value(tree, left, left->count), node_value(tree, right, 0), tree->value_size);
+        memmove(node_value(tree, right, 0), node_value(tree, right, 1), (right->count - 1) * tree->value_size);
+        memmove(node_key(tree, right, 0), node_key(tree, right, 1), (right->count - 1) * tree->key_size);
+        memcpy(separator, node_key(tree, right, 0), tree->key_size);
+    }
+    else {
+        BTreeConcurrentNode** children = node_children(tree, right);
+        memcpy(node_key(tree, left, left->count), separator, tree->key_size);
+        node_children(tree, left)[left->count + 1] = children[0];
+        memcpy(separator, node_key(tree, right, 0), tree->key_size);
+        memmove(node_key(tree, right, 0), node_key(tree, right, 1), (right->count - 1) * tree->key_size);
+        memmove(children, children + 1, right->count * sizeof(void*));
+    }
+    left->count++;
+    right->count--;
+}
+
+// Moves the last key of left to the front of right through the separator.
+static void shift_right(const BTreeConcurrent* tree, BTreeConcurrentNode* left, unsigned char* separator, BTreeConcurrentNode* right) {
+    memmove(node_key(tree, right, 1), node_key(tree, right, 0), right->count * tree->key_size);
+    if (right->is_leaf) {
+        memmove(node_value(tree, right, 1), node_value(tree, right, 0), right->count * tree->value_size);
+        memcpy(node_key(tree, right, 0), node_key(tree, left, left->count - 1), tree->key_size);
+        memcpy(node_value(tree, right, 0), node_value(tree, left, left->count - 1), tree->value_size);
+        memcpy(separator, node_key(tree, right, 0), tree->key_size);
+    }
+    else {
+        BTreeConcurrentNode** children = node_children(tree, right);
+        memmove(children + 1, children, (right->count + 1) * sizeof(void*));
+        memcpy(node_key(tree, right, 0), separator, tree->key_size);
+        children[0] = node_children(tree, left)[left->count];
+        memcpy(separator, node_key(tree, left, left->count - 1), tree->key_size);
+    }
+    left->count--;
+    right->count++;
+}
+
+// Refills child index of parent, which is latched along with it and fell
+// one key below half full, from a neighbour under the same parent: merges
+// the two when they fit in one node, else borrows a key. Both latches stay
+// held by the caller; the neighbour is latched and released here, left or
+// right of the child alike, as nobody else can hold two children of a
+// parent whose latch is held. Returns
+// the node a merge unlinked, which the caller retires once it let go of
+// every latch, or NULL.
+static BTreeConcurrentNode* refill_child(BTreeConcurrent* tree, BTreeConcurrentNode* parent, size_t index) {
+    BTreeConcurrentNode** children = node_children(tree, parent);
+    const size_t left_index = (index < parent->count) ? index : index - 1;
+    BTreeConcurrentNode* left = children[left_index];
+    BTreeConcurrentNode* right = children[left_index + 1];
+    BTreeConcurrentNode* neighbour = (left_index == index) ? right : left;
+    unsigned char* separator = node_key(tree, parent, left_index);
+    btree_latch_write_lock(&neighbour->latch);
+    btree_atomic_add(&tree->shifts, 1);
+    const size_t merged = left->count + right->count + (left->is_leaf ? 0 : 1);
+    if (merged <= node_order(tree, left)) {
+        merge_nodes(tree, left, separator, right);
+        memmove(separator, separator + tree->key_size, (parent->count - left_index - 1) * tree->key_size);
+        memmove(children + left_index + 1, children + left_index + 2, (parent->count - left_index - 1) * sizeof(void*));
+        parent->count--;
+        btree_latch_write_unlock(&neighbour->latch);
+        return right;
+    }
+    if (neighbour == right) {
+        shift_left(tree, left, separator, right);
+    }
+    else {
+        shift_right(tree, left, separator, right);
+    }
+    btree_latch_write_unlock(&neighbour->latch);
+    return NULL;
+}
+
+// Exclusive latch coupling for a removal that may leave its leaf less than
+// half full, mirroring put_splitting. Merges never allocate, so a removal
+// can not fail.
+static bool remove_merging(BTreeConcurrent* tree, const void* key, void* value) {
+    BTreeConcurrentNode* path[BTREE_CONCURRENT_MAX_HEIGHT];
+    size_t indices[BTREE_CONCURRENT_MAX_HEIGHT];
+    BTreeConcurrentNode* unlinked[BTREE_CONCURRENT_MAX_HEIGHT];
+    size_t unlinked_count = 0;
+    size_t depth = 0;
+    bool root_held = true;
+    btree_latch_write_lock(&tree->root_latch);
+    BTreeConcurrentNode* node = tree->root;
+    btree_latch_write_lock(&node->latch);
+    if (node_spare(tree, node, true)) {
+        btree_latch_write_unlock(&tree->root_latch);
+        root_held = false;
+    }
+    path[depth++] = node;
+    while (!node->is_leaf) {
+        const size_t index = route_index(tree, node, key);
+        node = node_children(tree, node)[index];
+        btree_latch_write_lock(&node->latch);
+        if (node_spare(tree, node, false)) {
+            release_path(tree, path, depth, root_held);
+            depth = 0;
+            root_held = false;
+        }
+        indices[depth] = index;
+        path[depth++] = node;
+    }
+
+    bool found = false;
+    const size_t slot = lower_bound(tree, node, key, &found);
+    if (found) {
+        remove_from_leaf(tree, node, slot, value);
+        for (size_t i = depth; (i > 1) && (path[i - 1]->count < node_min(tree, path[i - 1])); i--) {
+            BTreeConcurrentNode* right = refill_child(tree, path[i - 2], indices[i - 1]);
+            if (right != NULL) {
+                unlinked[unlinked_count++] = right;
+            }
+        }
+        if (root_held && !path[0]->is_leaf && (path[0]->count == 0)) {
+            tree->root = node_children(tree, path[0])[0];
+            unlinked[unlinked_count++] = path[0];
+        }
+    }
+    release_path(tree, path, depth, root_held);
+    for (size_t i = 0; i < unlinked_count; i++) {
+        retire_node(tree, unlinked[i]);
+    }
+    return found;
+}
+
+
+void* btree_create_concurrent(size_t keySize, size_t valueSize, int(*compare)(const void*, const void*)) {
+    if ((keySize == 0) || (valueSize == 0) || (compare == NULL)) {
+        return NULL;
+    }
+    BTreeConcurrent* tree = malloc(sizeof(BTreeConcurrent));
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->key_size = keySize;
+    tree->value_size = valueSize;
+    tree->comp = compare;
+    tree->size = 0;
+    tree->shifts = 0;
+    tree->epoch = 1;
+    tree->active[0] = 0;
+    tree->active[1] = 0;
+    tree->garbage_head = NULL;
+    tree->garbage_tail = NULL;
+    setup_layout(tree);
+    tree->root = build_node(tree, true);
+    if (tree->root == NULL) {
+        free(tree);
+        return NULL;
+    }
+    btree_latch_init(&tree->root_latch);
+    btree_latch_init(&tree->garbage_latch);
+    return tree;
+}
+
+// Not thread-safe: nothing may use the tree any more. Frees level by level
+// along the next_node chains.
+void btree_concurrent_destroy(void* btree, void(*destroy)(void*)) {
+    if (btree == NULL) {
+        return;
+    }
+    BTreeConcurrent* tree = btree;
+    BTreeConcurrentNode* level = tree->root;
+    while (level != NULL) {
+        BTreeConcurrentNode* below = level->is_leaf ? NULL : node_children(tree, level)[0];
+        while (level != NULL) {
+            BTreeConcurrentNode* next = level->next_node;
+            if (level->is_leaf && (destroy != NULL)) {
+                for (size_t i = 0; i < level->count; i++) {
+                    BTreeItem item;
+                    item.key = node_key(tree, level, i);
+                    item.value = node_value(tree, level, i);
+                    destroy(&item);
+                }
+            }
+            delete_node(level);
+            level = next;
+        }
+        level = below;
+    }
+    while (tree->garbage_head != NULL) {
+        BTreeConcurrentNode* garbage = tree->garbage_head;
+        tree->garbage_head = garbage->next_node;
+        delete_node(garbage);
+    }
+    btree_latch_free(&tree->root_latch);
+    btree_latch_free(&tree->garbage_latch);
+    free(tree);
+}
+
+size_t btree_concurrent_height(const void* btree) {
+    if (btree == NULL) {
+        return INVALID;
+    }
+    BTreeConcurrent* tree = (BTreeConcurrent*)btree;
+    btree_latch_read_lock(&tree->root_latch);
+    BTreeConcurrentNode* node = tree->root;
+    btree_latch_read_lock(&node->latch);
+    btree_latch_read_unlock(&tree->root_latch);
+    size_t height = 1;
+    while (!node->is_leaf) {
+        BTreeConcurrentNode* child = node_children(tree, node)[0];
+        btree_latch_read_lock(&child->latch);
+        btree_latch_read_unlock(&node->latch);
+        node = child;
+        height++;
+    }
+    btree_latch_read_unlock(&node->latch);
+    return height;
+}
+
+size_t btree_concurrent_count(const void* btree) {
+    if (btree == NULL) {
+        return 0;
+    }
+    return btree_atomic_load(&((const BTreeConcurrent*)btree)->size);
+}
+
+bool btree_concurrent_get(const void* btree, const void* key, void* value) {
+    if ((btree == NULL) || (key == NULL)) {
+        return false;
+    }
+    BTreeConcurrent* tree = (BTreeConcurrent*)btree;
+    BTreeConcurrentNode* leaf = latch_leaf(tree, key, false);
+    bool found = false;
+    const size_t slot = lower_bound(tree, leaf, key, &found);
+    if (found && (value != NULL)) {
+        memcpy(value, node_value(tree, leaf, slot), tree->value_size);
+    }
+    btree_latch_read_unlock(&leaf->latch);
+    return found;
+}
+
+bool btree_concurrent_put(void* btree, const void* key, const void* value, bool* createFlag) {
+    if ((btree == NULL) || (key == NULL) || (value == NULL)) {
+        return false;
+    }
+    BTreeConcurrent* tree = btree;
+    bool created = false;
+    createFlag = (createFlag != NULL) ? createFlag : &created;
+    BTreeConcurrentNode* leaf = latch_leaf(tree, key, true);
+    bool found = false;
+    const size_t slot = lower_bound(tree, leaf, key, &found);
+    if (found || node_safe(tree, leaf)) {
+        if (found) {
+            memcpy(node_value(tree, leaf, slot), value, tree->value_size);
+        }
+        else {
+            insert_into_leaf(tree, leaf, slot, key, value);
+        }
+        btree_latch_write_unlock(&leaf->latch);
+        *createFlag = !found;
+        return true;
+    }
+    btree_latch_write_unlock(&leaf->latch);
+    return put_splitting(tree, key, value, createFlag);
+}
+
+// A removal that keeps its leaf at least half full only touches the leaf;
+// the root leaf is never known as such here, so it always goes the long
+// way once it is that small.
+bool btree_concurrent_remove(void* btree, const void* key, void* value) {
+    if ((btree == NULL) || (key == NULL)) {
+        return false;
+    }
+    BTreeConcurrent* tree = btree;
+    BTreeConcurrentNode* leaf = latch_leaf(tree, key, true);
+    bool found = false;
+    const size_t slot = lower_bound(tree, leaf, key, &found);
+    if (!found || node_spare(tree, leaf, false)) {
+        if (found) {
+            remove_from_leaf(tree, leaf, slot, value);
+        }
+        btree_latch_write_unlock(&leaf->latch);
+        return found;
+    }
+    btree_latch_write_unlock(&leaf->latch);
+    return remove_merging(tree, key, value);
+}
+
+// Each leaf is copied out under its latch and visited after the latch is
+// released, so visit may call back into the tree.
+size_t btree_concurrent_scan(const void* btree, const void* low, const void* high, bool(*visit)(void* item, void* context), void* context) {
+    if ((btree == NULL) || (visit == NULL)) {
+        return 0;
+    }
+    BTreeConcurrent* tree = (BTreeConcurrent*)btree;
+    unsigned char* copy = malloc(tree->leaf_size);
+    if (copy == NULL) {
+        return 0;
+    }
+    BTreeConcurrentNode* buffer = (BTreeConcurrentNode*)copy;
+    BTreeConcurrentNode* leaf = latch_leaf(tree, low, false);
+    bool found = false;
+    size_t slot = (low != NULL) ? lower_bound(tree, leaf, low, &found) : 0;
+    // Where to find the leaf again after keys moved: past the last key
+    // copied so far, or at low before anything was.
+    const void* resume = low;
+    bool resume_copied = false;
+    size_t visited = 0;
+    bool running = true;
+    while (running) {
+        const size_t count = leaf->count - slot;
+        memcpy(node_key(tree, buffer, 0), node_key(tree, leaf, slot), count * tree->key_size);
+        memcpy(node_value(tree, buffer, 0), node_value(tree, leaf, slot), count * tree->value_size);
+        if (count > 0) {
+            resume = node_key(tree, buffer, count - 1);
+            resume_copied = true;
+        }
+        BTreeConcurrentNode* next = leaf->next_node;
+        const size_t shifts = btree_atomic_load(&tree->shifts);
+        // The next leaf can only be unlinked by a merge into this one, which
+        // waits for the latch, so it is still there when the epoch is entered.
+        const size_t epoch = (next != NULL) ? enter_epoch(tree) : 0;
+        btree_latch_read_unlock(&leaf->latch);
+
+        for (size_t i = 0; running && (i < count); i++) {
+            BTreeItem item;
+            item.key = node_key(tree, buffer, i);
+            item.value = node_value(tree, buffer, i);
+            if ((high != NULL) && (tree->comp(item.key, high) >= 0)) {
+                running = false;
+                break;
+            }
+            visited++;
+            running = visit(&item, context);
+        }
+        if (next == NULL) {
+            break;
+        }
+        if (!running) {
+            leave_epoch(tree, epoch);
+            break;
+        }
+        btree_latch_read_lock(&next->latch);
+        if (btree_atomic_load(&tree->shifts) == shifts) {
+            leave_epoch(tree, epoch);
+            leaf = next;
+            slot = 0;
+            continue;
+        }
+        btree_latch_read_unlock(&next->latch);
+        leave_epoch(tree, epoch);
+        leaf = latch_leaf(tree, resume, false);
+        slot = (resume != NULL) ? lower_bound(tree, leaf, resume, &found) : 0;
+        slot += (found && resume_copied) ? 1 : 0;
+    }
+    free(copy);
+    return visited;
+}
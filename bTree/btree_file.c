@@ -0,0 +1,595 @@
+// Ahead of every system header, so strict -std=c11 still declares the POSIX
+// file calls used below (fsync, getpid, mmap).
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "btree.h"
+#include "btree_thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// File layout, all offsets from the start of the file:
+//   header      BTreeFileHeader, alone in the first page
+//   records     count records in key order at data_offset, each the key
+//               followed by the value at value_offset, record_size apart
+//   index       levels of separator keys from index_offset on. Key j of
+//               level 0 is the key of record j * fanout, key j of level
+//               l + 1 is key j * fanout of level l; the last level has at
+//               most fanout keys. Levels start on BTREE_FILE_ALIGN.
+// Keys and values are stored bytewise in the byte order of the writer.
+#define BTREE_FILE_MAGIC "BTREEMAP"
+#define BTREE_FILE_VERSION 1
+#define BTREE_FILE_BYTE_ORDER 0x01020304u
+#define BTREE_FILE_PAGE 4096
+#define BTREE_FILE_ALIGN 16
+#define BTREE_FILE_MAX_LEVELS 32
+#define BTREE_FILE_MIN_FANOUT 16
+#define BTREE_FILE_BUFFER_BYTES ((size_t)64 * 1024)
+// Room for ".<pid>-<counter>.tmp" behind the path, and how many names a
+// save tries before it gives up.
+#define BTREE_FILE_SUFFIX_BYTES 48
+#define BTREE_FILE_TEMPORARY_ATTEMPTS 16
+
+typedef struct BTreeFileHeader BTreeFileHeader;
+typedef struct BTreeFileWriter BTreeFileWriter;
+typedef struct BTreeMapped BTreeMapped;
+
+struct BTreeFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t key_size;
+    uint64_t value_size;
+    uint64_t count;
+    uint64_t fanout;
+    uint64_t record_size;
+    uint64_t value_offset;
+    uint64_t data_offset;
+    uint64_t index_offset;
+    uint64_t file_size;
+};
+
+struct BTreeFileWriter {
+#ifdef _WIN32
+    HANDLE file;
+#else
+    int file;
+#endif
+    uint64_t offset;
+    size_t used;
+    bool failed;
+    unsigned char buffer[BTREE_FILE_BUFFER_BYTES];
+};
+
+struct BTreeMapped {
+    const unsigned char* base;
+    size_t length;
+    int(*comp)(const void*, const void*);
+    size_t count;
+    size_t key_size;
+    size_t value_size;
+    size_t record_size;
+    size_t value_offset;
+    size_t fanout;
+    const unsigned char* records;
+    size_t levels;
+    size_t level_count[BTREE_FILE_MAX_LEVELS];
+    const unsigned char* level_keys[BTREE_FILE_MAX_LEVELS];
+};
+
+static uint64_t align_up(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Same rule as in btree.c: the largest power of two dividing size.
+static uint64_t size_alignment(uint64_t size) {
+    uint64_t alignment = 1;
+    while ((alignment < BTREE_FILE_ALIGN) && (size % (alignment * 2) == 0)) {
+        alignment *= 2;
+    }
+    return alignment;
+}
+
+// Key counts of the index levels, lowest first. Returns the level count.
+static size_t level_sizes(uint64_t count, uint64_t fanout, uint64_t* sizes) {
+    size_t levels = 0;
+    while ((count > fanout) && (levels < BTREE_FILE_MAX_LEVELS)) {
+        count = (count + fanout - 1) / fanout;
+        sizes[levels++] = count;
+    }
+    return levels;
+}
+
+// Fills in everything but the magic from key_size, value_size, count and
+// fanout, which a reader takes from the file and a writer chooses.
+static void plan_layout(BTreeFileHeader* header) {
+    const uint64_t key_alignment = size_alignment(header->key_size);
+    const uint64_t value_alignment = size_alignment(header->value_size);
+    header->version = BTREE_FILE_VERSION;
+    header->byte_order = BTREE_FILE_BYTE_ORDER;
+    header->value_offset = align_up(header->key_size, value_alignment);
+    header->record_size = align_up(header->value_offset + header->value_size,
+        (key_alignment > value_alignment) ? key_alignment : value_alignment);
+    header->data_offset = BTREE_FILE_PAGE;
+    header->index_offset = align_up(header->data_offset + header->count * header->record_size, BTREE_FILE_ALIGN);
+    uint64_t sizes[BTREE_FILE_MAX_LEVELS];
+    const size_t levels = level_sizes(header->count, header->fanout, sizes);
+    header->file_size = header->index_offset;
+    for (size_t level = 0; level < levels; level++) {
+        header->file_size = align_up(header->file_size + sizes[level] * header->key_size, BTREE_FILE_ALIGN);
+    }
+}
+
+static void flush_writer(BTreeFileWriter* writer) {
+    const unsigned char* data = writer->buffer;
+    while ((writer->used > 0) && !writer->failed) {
+#ifdef _WIN32
+        DWORD written = 0;
+        if (!WriteFile(writer->file, data, (DWORD)writer->used, &written, NULL) || (written == 0)) {
+            writer->failed = true;
+        }
+#else
+        const ssize_t written = write(writer->file, data, writer->used);
+        if (written <= 0) {
+            writer->failed = true;
+            break;
+        }
+#endif
+        data += written;
+        writer->used -= (size_t)written;
+    }
+    writer->used = 0;
+}
+
+static void write_bytes(BTreeFileWriter* writer, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    while (size > 0) {
+        if (writer->used == BTREE_FILE_BUFFER_BYTES) {
+            flush_writer(writer);
+        }
+        size_t part = BTREE_FILE_BUFFER_BYTES - writer->used;
+        if (part > size) {
+            part = size;
+        }
+        if (bytes != NULL) {
+            memcpy(writer->buffer + writer->used, bytes, part);
+            bytes += part;
+        }
+        else {
+            memset(writer->buffer + writer->used, 0, part);
+        }
+        writer->used += part;
+        writer->offset += part;
+        size -= part;
+    }
+}
+
+// Zeros up to offset, so that no stale memory ends up in the file.
+static void pad_to(BTreeFileWriter* writer, uint64_t offset) {
+    write_bytes(writer, NULL, (size_t)(offset - writer->offset));
+}
+
+// Creates path, which must not exist yet.
+static bool open_writer(BTreeFileWriter* writer, const char* path) {
+    writer->offset = 0;
+    writer->used = 0;
+    writer->failed = false;
+#ifdef _WIN32
+    writer->file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    return writer->file != INVALID_HANDLE_VALUE;
+#else
+    writer->file = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    return writer->file >= 0;
+#endif
+}
+
+static volatile size_t temporary_count;
+
+// Opens a new file next to path for a save to write into. The name carries
+// the process id and a counter, and the file is only ever created, so two
+// saves, here or in another process, never share one; a name left behind
+// by a crashed save is skipped.
+static bool open_temporary(BTreeFileWriter* writer, const char* path, char* temporary, size_t size) {
+    for (size_t attempt = 0; attempt < BTREE_FILE_TEMPORARY_ATTEMPTS; attempt++) {
+#ifdef _WIN32
+        const unsigned long process = GetCurrentProcessId();
+#else
+        const unsigned long process = (unsigned long)getpid();
+#endif
+        snprintf(temporary, size, "%s.%lu-%lu.tmp", path, process, (unsigned long)btree_atomic_add(&temporary_count, 1));
+        if (open_writer(writer, temporary)) {
+            return true;
+        }
+#ifdef _WIN32
+        if (GetLastError() != ERROR_FILE_EXISTS) {
+            return false;
+        }
+#else
+        if (errno != EEXIST) {
+            return false;
+        }
+#endif
+    }
+    return false;
+}
+
+// Flushes everything to the disk; false if anything failed on the way.
+static bool close_writer(BTreeFileWriter* writer) {
+    flush_writer(writer);
+#ifdef _WIN32
+    if (!FlushFileBuffers(writer->file)) {
+        writer->failed = true;
+    }
+    CloseHandle(writer->file);
+#else
+    if (fsync(writer->file) != 0) {
+        writer->failed = true;
+    }
+    close(writer->file);
+#endif
+    return !writer->failed;
+}
+
+#ifndef _WIN32
+// Makes the entries of the directory holding path durable: a rename or a
+// new file is lost in a crash until its directory is synced as well.
+static bool sync_directory(const char* path) {
+    const char* slash = strrchr(path, '/');
+    const size_t length = ((slash == NULL) || (slash == path)) ? 1 : (size_t)(slash - path);
+    char* directory = malloc(length + 1);
+    if (directory == NULL) {
+        return false;
+    }
+    memcpy(directory, (slash == NULL) ? "." : path, length);
+    directory[length] = 0;
+    const int file = open(directory, O_RDONLY);
+    free(directory);
+    if (file < 0) {
+        return false;
+    }
+    const bool synced = fsync(file) == 0;
+    close(file);
+    return synced;
+}
+#endif
+
+// Returns once the new name is on disk, not just in the directory cache.
+static bool replace_file(const char* from, const char* to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return (rename(from, to) == 0) && sync_directory(to);
+#endif
+}
+
+static void remove_file(const char* path) {
+#ifdef _WIN32
+    DeleteFileA(path);
+#else
+    unlink(path);
+#endif
+}
+
+typedef struct {
+    BTreeFileWriter* writer;
+    const BTreeFileHeader* header;
+    unsigned char* separators;
+    size_t index;
+} BTreeFileRecords;
+
+static bool write_record(void* item, void* context) {
+    const BTreeItem* record = item;
+    BTreeFileRecords* records = context;
+    const BTreeFileHeader* header = records->header;
+    const size_t key_size = (size_t)header->key_size;
+    const size_t value_size = (size_t)header->value_size;
+    BTreeFileWriter* writer = records->writer;
+    if (records->index % header->fanout == 0) {
+        memcpy(records->separators + records->index / header->fanout * key_size, record->key, key_size);
+    }
+    write_bytes(writer, record->key, key_size);
+    pad_to(writer, writer->offset + header->value_offset - key_size);
+    write_bytes(writer, record->value, value_size);
+    pad_to(writer, writer->offset + header->record_size - header->value_offset - value_size);
+    records->index++;
+    return records->index < header->count;
+}
+
+// The records are streamed through btree_range, which costs O(1) per item
+// on trees and snapshots alike; stepping through the item ids of a snapshot
+// would descend from the root for every item.
+static bool write_tree(const void* btree, BTreeFileWriter* writer, const BTreeFileHeader* header, unsigned char* separators) {
+    const size_t key_size = (size_t)header->key_size;
+    write_bytes(writer, header, sizeof(BTreeFileHeader));
+    pad_to(writer, header->data_offset);
+    BTreeFileRecords records;
+    records.writer = writer;
+    records.header = header;
+    records.separators = separators;
+    records.index = 0;
+    btree_range(btree, NULL, NULL, write_record, &records);
+    pad_to(writer, header->index_offset);
+
+    // Level l takes every fanout^l-th key of level 0.
+    uint64_t sizes[BTREE_FILE_MAX_LEVELS];
+    const size_t levels = level_sizes(header->count, header->fanout, sizes);
+    size_t stride = 1;
+    for (size_t level = 0; level < levels; level++) {
+        for (size_t key = 0; key < sizes[level]; key++) {
+            write_bytes(writer, separators + key * stride * key_size, key_size);
+        }
+        pad_to(writer, align_up(writer->offset, BTREE_FILE_ALIGN));
+        stride *= (size_t)header->fanout;
+    }
+    return (records.index == header->count) && (writer->offset == header->file_size);
+}
+
+
+// Writes the items of btree (a tree or a snapshot) in key order to a new
+// file that replaces path only once it is complete. Nothing but keys and
+// values goes into the file, copied bytewise, so they must not hold
+// pointers. Must not overlap writes to btree.
+bool btree_save(const void* btree, const char* path) {
+    if ((btree == NULL) || (path == NULL)) {
+        return false;
+    }
+    BTreeFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BTREE_FILE_MAGIC, sizeof(header.magic));
+    header.key_size = btree_key_size(btree);
+    header.value_size = btree_value_size(btree);
+    header.count = btree_count(btree);
+    // A page of separators per index block, so that a lookup touches one
+    // page per level.
+    header.fanout = BTREE_FILE_PAGE / header.key_size;
+    if (header.fanout < BTREE_FILE_MIN_FANOUT) {
+        header.fanout = BTREE_FILE_MIN_FANOUT;
+    }
+    plan_layout(&header);
+
+    const size_t temporary_size = strlen(path) + BTREE_FILE_SUFFIX_BYTES;
+    char* temporary = malloc(temporary_size);
+    unsigned char* separators = malloc((size_t)((header.count + header.fanout - 1) / header.fanout * header.key_size) + 1);
+    BTreeFileWriter* writer = malloc(sizeof(BTreeFileWriter));
+    bool saved = false;
+    if ((temporary != NULL) && (separators != NULL) && (writer != NULL)) {
+        if (open_temporary(writer, path, temporary, temporary_size)) {
+            const bool written = write_tree(btree, writer, &header, separators);
+            saved = close_writer(writer) && written && replace_file(temporary, path);
+            if (!saved) {
+                remove_file(temporary);
+            }
+        }
+    }
+    free(writer);
+    free(separators);
+    free(temporary);
+    return saved;
+}
+
+static bool map_file(const char* path, const unsigned char** base, size_t* length) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && (size.QuadPart >= (LONGLONG)sizeof(BTreeFileHeader)) && ((uint64_t)size.QuadPart <= (SIZE_T)-1)) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return false;
+    }
+    // The view keeps the mapping alive.
+    *base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    *length = (size_t)size.QuadPart;
+    CloseHandle(mapping);
+    return *base != NULL;
+#else
+    const int file = open(path, O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+    struct stat status;
+    void* view = MAP_FAILED;
+    if ((fstat(file, &status) == 0) && (status.st_size >= (off_t)sizeof(BTreeFileHeader)) && ((uint64_t)status.st_size <= (size_t)-1)) {
+        view = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, file, 0);
+    }
+    close(file);
+    if (view == MAP_FAILED) {
+        return false;
+    }
+    *base = view;
+    *length = (size_t)status.st_size;
+    return true;
+#endif
+}
+
+static void unmap_file(const unsigned char* base, size_t length) {
+#ifdef _WIN32
+    (void)length;
+    UnmapViewOfFile(base);
+#else
+    munmap((void*)base, length);
+#endif
+}
+
+// A header is accepted only when it describes exactly the layout this
+// version would write for its sizes, and the file holds all of it.
+static bool header_is_valid(const BTreeFileHeader* header, size_t length) {
+    if ((memcmp(header->magic, BTREE_FILE_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != BTREE_FILE_VERSION) || (header->byte_order != BTREE_FILE_BYTE_ORDER) ||
+        (header->key_size == 0) || (header->value_size == 0) || (header->fanout < BTREE_FILE_MIN_FANOUT) ||
+        (header->key_size > length) || (header->value_size > length) ||
+        (header->count > length / (header->key_size + header->value_size))) {
+        return false;
+    }
+    BTreeFileHeader expected = *header;
+    plan_layout(&expected);
+    return (expected.record_size == header->record_size) && (expected.value_offset == header->value_offset) &&
+        (expected.data_offset == header->data_offset) && (expected.index_offset == header->index_offset) &&
+        (expected.file_size == header->file_size) && (header->file_size <= length);
+}
+
+// Serves a file written by btree_save straight from its mapped pages:
+// nothing is read or copied up front, and processes opening the same file
+// share one copy in the page cache. compare must order keys as the saved
+// tree did. The file must not change while it is open.
+void* btree_open_mmap(const char* path, int(*compare)(const void*, const void*)) {
+    if ((path == NULL) || (compare == NULL)) {
+        return NULL;
+    }
+    const unsigned char* base = NULL;
+    size_t length = 0;
+    if (!map_file(path, &base, &length)) {
+        return NULL;
+    }
+    BTreeFileHeader header;
+    memcpy(&header, base, sizeof(header));
+    BTreeMapped* mapped = (header_is_valid(&header, length)) ? malloc(sizeof(BTreeMapped)) : NULL;
+    if (mapped == NULL) {
+        unmap_file(base, length);
+        return NULL;
+    }
+    mapped->base = base;
+    mapped->length = length;
+    mapped->comp = compare;
+    mapped->count = (size_t)header.count;
+    mapped->key_size = (size_t)header.key_size;
+    mapped->value_size = (size_t)header.value_size;
+    mapped->record_size = (size_t)header.record_size;
+    mapped->value_offset = (size_t)header.value_offset;
+    mapped->fanout = (size_t)header.fanout;
+    mapped->records = base + header.data_offset;
+    uint64_t sizes[BTREE_FILE_MAX_LEVELS];
+    mapped->levels = level_sizes(header.count, header.fanout, sizes);
+    uint64_t offset = header.index_offset;
+    for (size_t level = 0; level < mapped->levels; level++) {
+        mapped->level_count[level] = (size_t)sizes[level];
+        mapped->level_keys[level] = base + offset;
+        offset = align_up(offset + sizes[level] * header.key_size, BTREE_FILE_ALIGN);
+    }
+    return mapped;
+}
+
+void btree_mapped_close(void* mapped) {
+    if (mapped == NULL) {
+        return;
+    }
+    BTreeMapped* file = mapped;
+    unmap_file(file->base, file->length);
+    free(file);
+}
+
+size_t btree_mapped_count(const void* mapped) {
+    if (mapped == NULL) {
+        return INVALID;
+    }
+    return ((const BTreeMapped*)mapped)->count;
+}
+
+size_t btree_mapped_key_size(const void* mapped) {
+    return (mapped == NULL) ? 0 : ((const BTreeMapped*)mapped)->key_size;
+}
+
+size_t btree_mapped_value_size(const void* mapped) {
+    return (mapped == NULL) ? 0 : ((const BTreeMapped*)mapped)->value_size;
+}
+
+static const unsigned char* record_at(const BTreeMapped* mapped, size_t index) {
+    return mapped->records + index * mapped->record_size;
+}
+
+// Index of the first record not less than key. Each level narrows the
+// search to one block of fanout keys, the last block of records included.
+static size_t lower_bound_index(const BTreeMapped* mapped, const void* key) {
+    size_t block = 0;
+    for (size_t level = mapped->levels; level-- > 0;) {
+        const size_t begin = block * mapped->fanout;
+        size_t low = begin;
+        size_t high = (begin + mapped->fanout < mapped->level_count[level]) ? begin + mapped->fanout : mapped->level_count[level];
+        while (low < high) {
+            const size_t middle = low + (high - low) / 2;
+            if (mapped->comp(mapped->level_keys[level] + middle * mapped->key_size, key) <= 0) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        block = (low > begin) ? low - 1 : begin;
+    }
+    size_t low = block * mapped->fanout;
+    size_t high = (low + mapped->fanout < mapped->count) ? low + mapped->fanout : mapped->count;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (mapped->comp(record_at(mapped, middle), key) < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Values point into read-only pages and must not be written.
+const void* btree_mapped_item(const void* mapped, const void* key) {
+    if ((mapped == NULL) || (key == NULL)) {
+        return NULL;
+    }
+    const BTreeMapped* file = mapped;
+    const size_t index = lower_bound_index(file, key);
+    if ((index == file->count) || (file->comp(record_at(file, index), key) != 0)) {
+        return NULL;
+    }
+    return record_at(file, index) + file->value_offset;
+}
+
+// Item ids of a mapped file are record indexes plus one, btree_stop() ends.
+size_t btree_mapped_first(const void* mapped) {
+    if ((mapped == NULL) || (((const BTreeMapped*)mapped)->count == 0)) {
+        return btree_stop(mapped);
+    }
+    return 1;
+}
+
+size_t btree_mapped_next(const void* mapped, size_t item_id) {
+    if ((mapped == NULL) || (item_id == btree_stop(mapped)) || (item_id >= ((const BTreeMapped*)mapped)->count)) {
+        return btree_stop(mapped);
+    }
+    return item_id + 1;
+}
+
+size_t btree_mapped_lower_bound(const void* mapped, const void* key) {
+    if ((mapped == NULL) || (key == NULL)) {
+        return btree_stop(mapped);
+    }
+    const size_t index = lower_bound_index(mapped, key);
+    return (index < ((const BTreeMapped*)mapped)->count) ? index + 1 : btree_stop(mapped);
+}
+
+const void* btree_mapped_key(const void* mapped, size_t item_id) {
+    if ((mapped == NULL) || (item_id == 0) || (item_id > ((const BTreeMapped*)mapped)->count)) {
+        return NULL;
+    }
+    return record_at(mapped, item_id - 1);
+}
+
+const void* btree_mapped_value(const void* mapped, size_t item_id) {
+    const unsigned char* key = btree_mapped_key(mapped, item_id);
+    return (key == NULL) ? NULL : key + ((const BTreeMapped*)mapped)->value_offset;
+}
@@ -0,0 +1,739 @@
+// Ahead of every system header, so <pthread.h> declares the rwlock API
+// even under strict -std=c11.
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "btree.h"
+#include "btree_thread.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BTREE_RCU_NODE_BYTES 512
+#define BTREE_RCU_MIN_ORDER 4
+#define BTREE_RCU_MAX_ALIGN 16
+// Deeper than any tree that fits in memory with at least 2 keys per node.
+#define BTREE_RCU_MAX_HEIGHT 64
+// Reader slots are padded to this size, so a reader entering and leaving
+// a read section writes a cache line no other thread writes.
+#define BTREE_RCU_READER_BYTES 128
+
+typedef struct BTreeRcuGarbage BTreeRcuGarbage;
+typedef struct BTreeRcuNode BTreeRcuNode;
+typedef struct BTreeRcuEntry BTreeRcuEntry;
+typedef struct BTreeRcuReader BTreeRcuReader;
+typedef struct BTreeRcuRun BTreeRcuRun;
+typedef struct BTreeRcu BTreeRcu;
+
+// Header of everything a writer unlinks. It waits in the garbage list until
+// no reader can still reach it; destroy runs on entries just before they are
+// freed.
+struct BTreeRcuGarbage {
+    BTreeRcuGarbage* next_garbage;
+    size_t epoch;
+    void(*destroy)(void*);
+    bool is_entry;
+};
+
+// Nodes never change once published. Internal nodes keep count keys and
+// count + 1 children in links, leaves count keys and count entries.
+struct BTreeRcuNode {
+    BTreeRcuGarbage garbage;
+    size_t count;
+    bool is_leaf;
+};
+
+struct BTreeRcuEntry {
+    BTreeRcuGarbage garbage;
+    BTreeItem item;
+};
+
+// epoch is the global epoch the reader entered its read section under, 0
+// outside of one. Only the owning thread writes it.
+struct BTreeRcuReader {
+    volatile size_t epoch;
+    BTreeRcuReader* next_reader;
+    BTreeRcu* tree;
+    unsigned char padding[BTREE_RCU_READER_BYTES];
+};
+
+// Keys and links of a node being rebuilt by a writer, with room for two
+// full nodes and the separator between them.
+struct BTreeRcuRun {
+    unsigned char* keys;
+    void** links;
+    size_t count;
+    bool is_leaf;
+};
+
+// Writers are serialized by writer_latch. A write copies the path from the
+// leaf up, publishes the new root with one atomic store and retires what it
+// replaced at the current epoch. The epoch moves on once every reader inside
+// a read section has entered under it, and garbage two epochs old can no
+// longer be reached by anyone.
+struct BTreeRcu {
+    size_t key_size;
+    size_t value_size;
+    size_t order;
+    size_t keys_offset;
+    size_t links_offset;
+    size_t node_size;
+    size_t entry_key_offset;
+    size_t entry_value_offset;
+    size_t entry_size;
+    int(*comp)(const void*, const void*);
+    BTreeRcuNode* volatile root;
+    volatile size_t size;
+    volatile size_t epoch;
+    BTreeLatch writer_latch;
+    BTreeRcuReader* readers;
+    BTreeRcuGarbage* garbage_head;
+    BTreeRcuGarbage* garbage_tail;
+    BTreeRcuRun runs[3];
+};
+
+// Nodes made by one write, freed again if the write fails before it is
+// published, and siblings it replaced, retired once it is.
+typedef struct {
+    BTreeRcuNode* fresh[2 * BTREE_RCU_MAX_HEIGHT + 1];
+    size_t fresh_count;
+    BTreeRcuNode* stale[BTREE_RCU_MAX_HEIGHT];
+    size_t stale_count;
+} BTreeRcuWrite;
+
+static size_t align_up(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+static size_t size_alignment(size_t size) {
+    size_t alignment = 1;
+    while ((alignment < BTREE_RCU_MAX_ALIGN) && (size % (alignment * 2) == 0)) {
+        alignment *= 2;
+    }
+    return alignment;
+}
+
+static void setup_layout(BTreeRcu* tree) {
+    const size_t slot_size = tree->key_size + sizeof(void*);
+    tree->keys_offset = align_up(sizeof(BTreeRcuNode), BTREE_RCU_MAX_ALIGN);
+    tree->order = BTREE_RCU_MIN_ORDER;
+    if (BTREE_RCU_NODE_BYTES > tree->keys_offset + 2 * slot_size) {
+        const size_t room = BTREE_RCU_NODE_BYTES - tree->keys_offset - 2 * slot_size;
+        if (room / slot_size > tree->order) {
+            tree->order = room / slot_size;
+        }
+    }
+    tree->links_offset = align_up(tree->keys_offset + tree->order * tree->key_size, sizeof(void*));
+    tree->node_size = tree->links_offset + (tree->order + 1) * sizeof(void*);
+    tree->entry_key_offset = align_up(sizeof(BTreeRcuEntry), size_alignment(tree->key_size));
+    tree->entry_value_offset = align_up(tree->entry_key_offset + tree->key_size, size_alignment(tree->value_size));
+    tree->entry_size = tree->entry_value_offset + tree->value_size;
+}
+
+static bool setup_runs(BTreeRcu* tree) {
+    for (size_t i = 0; i < 3; i++) {
+        tree->runs[i].keys = malloc((2 * tree->order + 2) * tree->key_size);
+        tree->runs[i].links = malloc((2 * tree->order + 3) * sizeof(void*));
+        if ((tree->runs[i].keys == NULL) || (tree->runs[i].links == NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void free_runs(BTreeRcu* tree) {
+    for (size_t i = 0; i < 3; i++) {
+        free(tree->runs[i].keys);
+        free(tree->runs[i].links);
+    }
+}
+
+static unsigned char* node_key(const BTreeRcu* tree, const BTreeRcuNode* node, size_t index) {
+    return (unsigned char*)node + tree->keys_offset + index * tree->key_size;
+}
+
+static void** node_links(const BTreeRcu* tree, const BTreeRcuNode* node) {
+    return (void**)((unsigned char*)node + tree->links_offset);
+}
+
+static BTreeRcuNode* node_child(const BTreeRcu* tree, const BTreeRcuNode* node, size_t index) {
+    return node_links(tree, node)[index];
+}
+
+static BTreeRcuEntry* node_entry(const BTreeRcu* tree, const BTreeRcuNode* node, size_t index) {
+    return node_links(tree, node)[index];
+}
+
+static size_t link_count(bool is_leaf, size_t count) {
+    return is_leaf ? count : count + 1;
+}
+
+static size_t lower_bound(const BTreeRcu* tree, const unsigned char* keys, size_t count, const void* key, bool* found) {
+    size_t low = 0;
+    size_t high = count;
+    *found = false;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        const int route = tree->comp(keys + middle * tree->key_size, key);
+        if (route < 0) {
+            low = middle + 1;
+        }
+        else {
+            if (route == 0) {
+                *found = true;
+            }
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Equal keys go right, as in btree.c. A NULL key routes to the far left.
+static size_t child_index(const BTreeRcu* tree, const BTreeRcuNode* node, const void* key) {
+    if (key == NULL) {
+        return 0;
+    }
+    bool found = false;
+    const size_t index = lower_bound(tree, node_key(tree, node, 0), node->count, key, &found);
+    return found ? index + 1 : index;
+}
+
+// The epoch store is sequentially consistent, so a writer that misses it
+// has published its root before the load below.
+static BTreeRcuNode* enter_read(BTreeRcuReader* reader) {
+    btree_atomic_store(&reader->epoch, btree_atomic_load(&reader->tree->epoch));
+    return btree_atomic_load_pointer((void* const volatile*)&reader->tree->root);
+}
+
+static void leave_read(BTreeRcuReader* reader) {
+    btree_atomic_store(&reader->epoch, 0);
+}
+
+static void free_garbage(BTreeRcuGarbage* garbage) {
+    if (garbage->is_entry && (garbage->destroy != NULL)) {
+        garbage->destroy(&((BTreeRcuEntry*)garbage)->item);
+    }
+    free(garbage);
+}
+
+static void retire(BTreeRcu* tree, BTreeRcuGarbage* garbage, void(*destroy)(void*)) {
+    garbage->next_garbage = NULL;
+    garbage->epoch = tree->epoch;
+    garbage->destroy = destroy;
+    if (tree->garbage_tail != NULL) {
+        tree->garbage_tail->next_garbage = garbage;
+    }
+    else {
+        tree->garbage_head = garbage;
+    }
+    tree->garbage_tail = garbage;
+}
+
+// Moves the epoch on when no reader is inside a read section entered under
+// an older one, then frees everything retired two or more epochs ago.
+static void reclaim(BTreeRcu* tree) {
+    const size_t epoch = tree->epoch;
+    bool quiet = true;
+    for (BTreeRcuReader* reader = tree->readers; reader != NULL; reader = reader->next_reader) {
+        const size_t seen = btree_atomic_load(&reader->epoch);
+        if ((seen != 0) && (seen != epoch)) {
+            quiet = false;
+            break;
+        }
+    }
+    if (quiet) {
+        btree_atomic_store(&tree->epoch, epoch + 1);
+    }
+    while ((tree->garbage_head != NULL) && (tree->garbage_head->epoch + 2 <= tree->epoch)) {
+        BTreeRcuGarbage* garbage = tree->garbage_head;
+        tree->garbage_head = garbage->next_garbage;
+        if (tree->garbage_head == NULL) {
+            tree->garbage_tail = NULL;
+        }
+        free_garbage(garbage);
+    }
+}
+
+static BTreeRcuEntry* build_entry(const BTreeRcu* tree, const void* key, const void* value) {
+    BTreeRcuEntry* entry = malloc(tree->entry_size);
+    if (entry == NULL) {
+        return NULL;
+    }
+    unsigned char* entry_key = (unsigned char*)entry + tree->entry_key_offset;
+    memcpy(entry_key, key, tree->key_size);
+    entry->garbage.is_entry = true;
+    entry->item.key = entry_key;
+    entry->item.value = (unsigned char*)entry + tree->entry_value_offset;
+    memcpy(entry->item.value, value, tree->value_size);
+    return entry;
+}
+
+static void load_run(const BTreeRcu* tree, BTreeRcuRun* run, const BTreeRcuNode* node) {
+    run->is_leaf = node->is_leaf;
+    run->count = node->count;
+    memcpy(run->keys, node_key(tree, node, 0), node->count * tree->key_size);
+    memcpy(run->links, node_links(tree, node), link_count(node->is_leaf, node->count) * sizeof(void*));
+}
+
+// Inserts key at index and link at link_index.
+static void run_insert(const BTreeRcu* tree, BTreeRcuRun* run, size_t index, const void* key, size_t link_index, void* link) {
+    const size_t links = link_count(run->is_leaf, run->count);
+    unsigned char* slot = run->keys + index * tree->key_size;
+    memmove(slot + tree->key_size, slot, (run->count - index) * tree->key_size);
+    memcpy(slot, key, tree->key_size);
+    memmove(run->links + link_index + 1, run->links + link_index, (links - link_index) * sizeof(void*));
+    run->links[link_index] = link;
+    run->count++;
+}
+
+// Removes the key at index and the link at link_index.
+static void run_remove(const BTreeRcu* tree, BTreeRcuRun* run, size_t index, size_t link_index) {
+    const size_t links = link_count(run->is_leaf, run->count);
+    unsigned char* slot = run->keys + index * tree->key_size;
+    memmove(slot, slot + tree->key_size, (run->count - index - 1) * tree->key_size);
+    memmove(run->links + link_index, run->links + link_index + 1, (links - link_index - 1) * sizeof(void*));
+    run->count--;
+}
+
+// Appends the keys and links of one node to a run that is empty or, when
+// internal nodes are joined, gets separator in between.
+static void run_append(const BTreeRcu* tree, BTreeRcuRun* run, const void* separator, const unsigned char* keys, size_t count, void* const* links) {
+    const size_t at = (separator != NULL) ? run->count + 1 : run->count;
+    if (separator != NULL) {
+        memcpy(run->keys + run->count * tree->key_size, separator, tree->key_size);
+        run->count++;
+    }
+    memcpy(run->keys + run->count * tree->key_size, keys, count * tree->key_size);
+    memcpy(run->links + at, links, link_count(run->is_leaf, count) * sizeof(void*));
+    run->count += count;
+}
+
+static BTreeRcuNode* emit_node(const BTreeRcu* tree, BTreeRcuWrite* write, const BTreeRcuRun* run, size_t first, size_t count) {
+    BTreeRcuNode* node = malloc(tree->node_size);
+    if (node == NULL) {
+        return NULL;
+    }
+    write->fresh[write->fresh_count++] = node;
+    node->garbage.is_entry = false;
+    node->is_leaf = run->is_leaf;
+    node->count = count;
+    memcpy(node_key(tree, node, 0), run->keys + first * tree->key_size, count * tree->key_size);
+    memcpy(node_links(tree, node), run->links + first, link_count(run->is_leaf, count) * sizeof(void*));
+    return node;
+}
+
+// Turns a run into one node, or into two when it does not fit. The key
+// between them is left in separator, pointing into the run.
+static bool emit_run(const BTreeRcu* tree, BTreeRcuWrite* write, const BTreeRcuRun* run, BTreeRcuNode** left, BTreeRcuNode** right, const void** separator) {
+    *right = NULL;
+    if (run->count <= tree->order) {
+        *left = emit_node(tree, write, run, 0, run->count);
+        return *left != NULL;
+    }
+    const size_t middle = run->count / 2;
+    const size_t first = run->is_leaf ? middle : middle + 1;
+    *left = emit_node(tree, write, run, 0, middle);
+    if (*left == NULL) {
+        return false;
+    }
+    *right = emit_node(tree, write, run, first, run->count - first);
+    *separator = run->keys + middle * tree->key_size;
+    return *right != NULL;
+}
+
+// Puts the rebuilt child back at index of its parent, loaded into parent.
+// A child left under half full is joined with a sibling and the key between
+// them, then split again if the result does not fit one node.
+static bool place_child(BTreeRcu* tree, BTreeRcuWrite* write, const BTreeRcuRun* child, BTreeRcuRun* parent, size_t index) {
+    BTreeRcuNode* left = NULL;
+    BTreeRcuNode* right = NULL;
+    const void* separator = NULL;
+    if (child->count >= tree->order / 2) {
+        if (!emit_run(tree, write, child, &left, &right, &separator)) {
+            return false;
+        }
+        parent->links[index] = left;
+        if (right != NULL) {
+            run_insert(tree, parent, index, separator, index + 1, right);
+        }
+        return true;
+    }
+
+    const size_t first = (index > 0) ? index - 1 : index;
+    const void* between = child->is_leaf ? NULL : parent->keys + first * tree->key_size;
+    BTreeRcuNode* sibling = parent->links[(index > 0) ? index - 1 : index + 1];
+    BTreeRcuRun* joined = &tree->runs[2];
+    joined->is_leaf = child->is_leaf;
+    joined->count = 0;
+    if (index > 0) {
+        run_append(tree, joined, NULL, node_key(tree, sibling, 0), sibling->count, node_links(tree, sibling));
+        run_append(tree, joined, between, child->keys, child->count, child->links);
+    }
+    else {
+        run_append(tree, joined, NULL, child->keys, child->count, child->links);
+        run_append(tree, joined, between, node_key(tree, sibling, 0), sibling->count, node_links(tree, sibling));
+    }
+    if (!emit_run(tree, write, joined, &left, &right, &separator)) {
+        return false;
+    }
+    write->stale[write->stale_count++] = sibling;
+    parent->links[first] = left;
+    if (right != NULL) {
+        parent->links[first + 1] = right;
+        memcpy(parent->keys + first * tree->key_size, separator, tree->key_size);
+    }
+    else {
+        run_remove(tree, parent, first, first + 1);
+    }
+    return true;
+}
+
+// Records the nodes from the root down to the leaf for key and the child
+// index taken at each. Returns the depth.
+static size_t find_path(const BTreeRcu* tree, const void* key, BTreeRcuNode** path, size_t* slots) {
+    size_t depth = 0;
+    BTreeRcuNode* node = tree->root;
+    while (!node->is_leaf) {
+        path[depth] = node;
+        slots[depth] = child_index(tree, node, key);
+        node = node_child(tree, node, slots[depth]);
+        depth++;
+    }
+    path[depth++] = node;
+    return depth;
+}
+
+// Rebuilds the path from the changed leaf, held in runs[0], up to the root
+// and publishes it. An empty leaf root leaves the tree empty and an internal
+// root left with one child hands the root to that child.
+static bool publish_path(BTreeRcu* tree, BTreeRcuWrite* write, BTreeRcuNode** path, const size_t* slots, size_t depth) {
+    BTreeRcuRun* child = &tree->runs[0];
+    BTreeRcuRun* parent = &tree->runs[1];
+    for (size_t level = depth - 1; level > 0; level--) {
+        load_run(tree, parent, path[level - 1]);
+        if (!place_child(tree, write, child, parent, slots[level - 1])) {
+            return false;
+        }
+        BTreeRcuRun* swap = child;
+        child = parent;
+        parent = swap;
+    }
+
+    BTreeRcuNode* root = NULL;
+    if (!child->is_leaf && (child->count == 0)) {
+        root = child->links[0];
+    }
+    else if (child->count > 0) {
+        BTreeRcuNode* right = NULL;
+        const void* separator = NULL;
+        if (!emit_run(tree, write, child, &root, &right, &separator)) {
+            return false;
+        }
+        if (right != NULL) {
+            parent->is_leaf = false;
+            parent->count = 1;
+            memcpy(parent->keys, separator, tree->key_size);
+            parent->links[0] = root;
+            parent->links[1] = right;
+            root = emit_node(tree, write, parent, 0, 1);
+            if (root == NULL) {
+                return false;
+            }
+        }
+    }
+    btree_atomic_store_pointer((void* volatile*)&tree->root, root);
+    for (size_t level = 0; level < depth; level++) {
+        retire(tree, &path[level]->garbage, NULL);
+    }
+    for (size_t i = 0; i < write->stale_count; i++) {
+        retire(tree, &write->stale[i]->garbage, NULL);
+    }
+    return true;
+}
+
+static void abandon_write(BTreeRcuWrite* write) {
+    for (size_t i = 0; i < write->fresh_count; i++) {
+        free(write->fresh[i]);
+    }
+}
+
+
+void* btree_create_rcu(size_t keySize, size_t valueSize, int(*compare)(const void*, const void*)) {
+    if ((keySize == 0) || (valueSize == 0) || (compare == NULL)) {
+        return NULL;
+    }
+    BTreeRcu* tree = calloc(sizeof(BTreeRcu), 1);
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->key_size = keySize;
+    tree->value_size = valueSize;
+    tree->comp = compare;
+    tree->epoch = 1;
+    setup_layout(tree);
+    if (!setup_runs(tree)) {
+        free_runs(tree);
+        free(tree);
+        return NULL;
+    }
+    btree_latch_init(&tree->writer_latch);
+    return tree;
+}
+
+// Not thread-safe: every reader must have been freed. The deferred destroys
+// of removed items run before those of the items still in the tree.
+void btree_rcu_destroy(void* btree, void(*destroy)(void*)) {
+    if (btree == NULL) {
+        return;
+    }
+    BTreeRcu* tree = btree;
+    while (tree->garbage_head != NULL) {
+        BTreeRcuGarbage* garbage = tree->garbage_head;
+        tree->garbage_head = garbage->next_garbage;
+        free_garbage(garbage);
+    }
+    BTreeRcuNode* path[BTREE_RCU_MAX_HEIGHT];
+    size_t slots[BTREE_RCU_MAX_HEIGHT];
+    size_t depth = 0;
+    if (tree->root != NULL) {
+        path[0] = tree->root;
+        slots[0] = 0;
+        depth = 1;
+    }
+    while (depth > 0) {
+        BTreeRcuNode* node = path[depth - 1];
+        if (!node->is_leaf && (slots[depth - 1] <= node->count)) {
+            path[depth] = node_child(tree, node, slots[depth - 1]++);
+            slots[depth] = 0;
+            depth++;
+            continue;
+        }
+        if (node->is_leaf) {
+            for (size_t i = 0; i < node->count; i++) {
+                BTreeRcuEntry* entry = node_entry(tree, node, i);
+                if (destroy != NULL) {
+                    destroy(&entry->item);
+                }
+                free(entry);
+            }
+        }
+        free(node);
+        depth--;
+    }
+    btree_latch_free(&tree->writer_latch);
+    free_runs(tree);
+    free(tree);
+}
+
+// Each reading thread registers once and reads through its own reader.
+void* btree_rcu_reader(void* btree) {
+    if (btree == NULL) {
+        return NULL;
+    }
+    BTreeRcu* tree = btree;
+    BTreeRcuReader* reader = calloc(sizeof(BTreeRcuReader), 1);
+    if (reader == NULL) {
+        return NULL;
+    }
+    reader->tree = tree;
+    btree_latch_write_lock(&tree->writer_latch);
+    reader->next_reader = tree->readers;
+    tree->readers = reader;
+    btree_latch_write_unlock(&tree->writer_latch);
+    return reader;
+}
+
+void btree_rcu_reader_free(void* reader) {
+    if (reader == NULL) {
+        return;
+    }
+    BTreeRcuReader* unlinked = reader;
+    BTreeRcu* tree = unlinked->tree;
+    btree_latch_write_lock(&tree->writer_latch);
+    BTreeRcuReader** link = &tree->readers;
+    while (*link != unlinked) {
+        link = &(*link)->next_reader;
+    }
+    *link = unlinked->next_reader;
+    btree_latch_write_unlock(&tree->writer_latch);
+    free(unlinked);
+}
+
+size_t btree_rcu_count(const void* btree) {
+    if (btree == NULL) {
+        return 0;
+    }
+    return btree_atomic_load(&((const BTreeRcu*)btree)->size);
+}
+
+bool btree_rcu_get(void* reader, const void* key, void* value) {
+    if ((reader == NULL) || (key == NULL)) {
+        return false;
+    }
+    BTreeRcuReader* self = reader;
+    const BTreeRcu* tree = self->tree;
+    const BTreeRcuNode* node = enter_read(self);
+    bool found = false;
+    if (node != NULL) {
+        while (!node->is_leaf) {
+            node = node_child(tree, node, child_index(tree, node, key));
+        }
+        const size_t slot = lower_bound(tree, node_key(tree, node, 0), node->count, key, &found);
+        if (found && (value != NULL)) {
+            memcpy(value, node_entry(tree, node, slot)->item.value, tree->value_size);
+        }
+    }
+    leave_read(self);
+    return found;
+}
+
+// visit gets the items themselves: they stay valid until scan returns, even
+// if a writer removes them meanwhile. Items are read-only to visit, and
+// visit must not read through the same reader.
+size_t btree_rcu_scan(void* reader, const void* low, const void* high, bool(*visit)(void* item, void* context), void* context) {
+    if ((reader == NULL) || (visit == NULL)) {
+        return 0;
+    }
+    BTreeRcuReader* self = reader;
+    const BTreeRcu* tree = self->tree;
+    const BTreeRcuNode* path[BTREE_RCU_MAX_HEIGHT];
+    size_t slots[BTREE_RCU_MAX_HEIGHT];
+    size_t depth = 0;
+    size_t visited = 0;
+    bool running = true;
+    const void* bound = low;
+    const BTreeRcuNode* node = enter_read(self);
+    while (running && (node != NULL)) {
+        while (!node->is_leaf) {
+            const size_t index = child_index(tree, node, bound);
+            path[depth] = node;
+            slots[depth++] = index + 1;
+            node = node_child(tree, node, index);
+        }
+        bool found = false;
+        size_t slot = (bound != NULL) ? lower_bound(tree, node_key(tree, node, 0), node->count, bound, &found) : 0;
+        bound = NULL;
+        for (; running && (slot < node->count); slot++) {
+            BTreeItem* item = &node_entry(tree, node, slot)->item;
+            if ((high != NULL) && (tree->comp(item->key, high) >= 0)) {
+                running = false;
+                break;
+            }
+            visited++;
+            running = visit(item, context);
+        }
+        while ((depth > 0) && (slots[depth - 1] > path[depth - 1]->count)) {
+            depth--;
+        }
+        node = (depth > 0) ? node_child(tree, path[depth - 1], slots[depth - 1]++) : NULL;
+    }
+    leave_read(self);
+    return visited;
+}
+
+// Overwriting a key publishes a new entry in place of the old one, so a
+// reader never sees a value half written; destroy runs on the old item once
+// no reader can still see it.
+bool btree_rcu_put(void* btree, const void* key, const void* value, bool* createFlag, void(*destroy)(void*)) {
+    if ((btree == NULL) || (key == NULL) || (value == NULL)) {
+        return false;
+    }
+    BTreeRcu* tree = btree;
+    BTreeRcuEntry* entry = build_entry(tree, key, value);
+    if (entry == NULL) {
+        return false;
+    }
+    btree_latch_write_lock(&tree->writer_latch);
+    BTreeRcuWrite write;
+    write.fresh_count = 0;
+    write.stale_count = 0;
+    BTreeRcuNode* path[BTREE_RCU_MAX_HEIGHT];
+    size_t slots[BTREE_RCU_MAX_HEIGHT];
+    size_t depth = 0;
+    BTreeRcuRun* leaf = &tree->runs[0];
+    if (tree->root != NULL) {
+        depth = find_path(tree, key, path, slots);
+        load_run(tree, leaf, path[depth - 1]);
+    }
+    else {
+        leaf->is_leaf = true;
+        leaf->count = 0;
+    }
+    bool found = false;
+    BTreeRcuEntry* replaced = NULL;
+    const size_t slot = lower_bound(tree, leaf->keys, leaf->count, key, &found);
+    if (found) {
+        replaced = leaf->links[slot];
+        leaf->links[slot] = entry;
+    }
+    else {
+        run_insert(tree, leaf, slot, key, slot, entry);
+    }
+
+    bool published = false;
+    if (depth > 0) {
+        published = publish_path(tree, &write, path, slots, depth);
+    }
+    else {
+        BTreeRcuNode* root = emit_node(tree, &write, leaf, 0, 1);
+        if (root != NULL) {
+            btree_atomic_store_pointer((void* volatile*)&tree->root, root);
+            published = true;
+        }
+    }
+    if (published) {
+        if (replaced != NULL) {
+            retire(tree, &replaced->garbage, destroy);
+        }
+        else {
+            btree_atomic_add(&tree->size, 1);
+        }
+        reclaim(tree);
+    }
+    else {
+        abandon_write(&write);
+        free(entry);
+    }
+    btree_latch_write_unlock(&tree->writer_latch);
+    if (published && (createFlag != NULL)) {
+        *createFlag = !found;
+    }
+    return published;
+}
+
+// destroy runs on the removed item once no reader can still see it. Fails
+// when the key is missing or memory for the new path runs out.
+bool btree_rcu_remove(void* btree, const void* key, void(*destroy)(void*)) {
+    if ((btree == NULL) || (key == NULL)) {
+        return false;
+    }
+    BTreeRcu* tree = btree;
+    btree_latch_write_lock(&tree->writer_latch);
+    bool published = false;
+    if (tree->root != NULL) {
+        BTreeRcuWrite write;
+        write.fresh_count = 0;
+        write.stale_count = 0;
+        BTreeRcuNode* path[BTREE_RCU_MAX_HEIGHT];
+        size_t slots[BTREE_RCU_MAX_HEIGHT];
+        const size_t depth = find_path(tree, key, path, slots);
+        BTreeRcuRun* leaf = &tree->runs[0];
+        load_run(tree, leaf, path[depth - 1]);
+        bool found = false;
+        const size_t slot = lower_bound(tree, leaf->keys, leaf->count, key, &found);
+        if (found) {
+            BTreeRcuEntry* entry = leaf->links[slot];
+            run_remove(tree, leaf, slot, slot);
+            published = publish_path(tree, &write, path, slots, depth);
+            if (published) {
+                retire(tree, &entry->garbage, destroy);
+                btree_atomic_add(&tree->size, (size_t)-1);
+                reclaim(tree);
+            }
+            else {
+                abandon_write(&write);
+            }
+        }
+    }
+    btree_latch_write_unlock(&tree->writer_latch);
+    return published;
+}
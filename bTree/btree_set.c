@@ -0,0 +1,234 @@
+// Ahead of every system header, so <pthread.h> declares the rwlock API
+// even under strict -std=c11.
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "btree.h"
+#include "btree_thread.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Parts smaller than this are not worth a thread of their own.
+#define BTREE_SET_MIN_PART 16384
+#define BTREE_SET_MAX_THREADS 64
+
+typedef enum {
+    BTREE_SET_UNION,
+    BTREE_SET_INTERSECT,
+    BTREE_SET_DIFFERENCE
+} BTreeSetOperation;
+
+typedef struct BTreeSetPart BTreeSetPart;
+
+// One slice of the key range: the items of lhs with ranks in
+// [lhs_begin, lhs_end) against those of rhs in [rhs_begin, rhs_end).
+// Output starts at slot lhs_begin + rhs_begin, which no earlier part can
+// reach, and the parts are closed up once all of them are done. The items
+// of both slices are listed first, into lhs_items and rhs_items.
+struct BTreeSetPart {
+    const void* lhs;
+    const void* rhs;
+    BTreeSetOperation operation;
+    size_t lhs_begin;
+    size_t lhs_end;
+    size_t rhs_begin;
+    size_t rhs_end;
+    const BTreeItem** lhs_items;
+    const BTreeItem** rhs_items;
+    unsigned char* keys;
+    unsigned char* values;
+    size_t produced;
+    bool failed;
+};
+
+typedef struct {
+    const BTreeItem** items;
+    size_t left;
+} BTreeSetGather;
+
+static void emit(BTreeSetPart* part, const BTreeItem* item, size_t key_size, size_t value_size) {
+    memcpy(part->keys + part->produced * key_size, item->key, key_size);
+    memcpy(part->values + part->produced * value_size, item->value, value_size);
+    part->produced++;
+}
+
+static bool gather_item(void* item, void* context) {
+    BTreeSetGather* gather = context;
+    *gather->items++ = item;
+    return --gather->left > 0;
+}
+
+// Lists the items of ranks [begin, end) through btree_range, which costs
+// O(1) per item on live trees and snapshots alike; stepping through the
+// item ids of a snapshot would descend from the root for every item.
+// False when the first item can not be found or the slice comes up short.
+static bool gather_items(const void* tree, size_t begin, size_t end, const BTreeItem** items) {
+    if (begin == end) {
+        return true;
+    }
+    BTreeSetGather gather;
+    gather.items = items;
+    gather.left = end - begin;
+    const BTreeItem* low = btree_current(tree, btree_select(tree, begin));
+    if (low == NULL) {
+        return false;
+    }
+    btree_range(tree, low->key, NULL, gather_item, &gather);
+    return gather.left == 0;
+}
+
+static void merge_part(void* argument) {
+    BTreeSetPart* part = argument;
+    const size_t key_size = btree_key_size(part->lhs);
+    const size_t value_size = btree_value_size(part->lhs);
+    const size_t lhs_count = part->lhs_end - part->lhs_begin;
+    const size_t rhs_count = part->rhs_end - part->rhs_begin;
+    part->produced = 0;
+    part->failed = !gather_items(part->lhs, part->lhs_begin, part->lhs_end, part->lhs_items) ||
+        !gather_items(part->rhs, part->rhs_begin, part->rhs_end, part->rhs_items);
+    if (part->failed) {
+        return;
+    }
+    size_t lhs_at = 0;
+    size_t rhs_at = 0;
+    while ((lhs_at < lhs_count) && (rhs_at < rhs_count)) {
+        const BTreeItem* lhs_item = part->lhs_items[lhs_at];
+        const BTreeItem* rhs_item = part->rhs_items[rhs_at];
+        const int order = btree_compare(part->lhs, lhs_item->key, rhs_item->key);
+        if (order <= 0) {
+            if ((part->operation == BTREE_SET_UNION) || ((order == 0) == (part->operation == BTREE_SET_INTERSECT))) {
+                emit(part, lhs_item, key_size, value_size);
+            }
+            lhs_at++;
+        }
+        if (order >= 0) {
+            if ((order > 0) && (part->operation == BTREE_SET_UNION)) {
+                emit(part, rhs_item, key_size, value_size);
+            }
+            rhs_at++;
+        }
+    }
+    for (; (lhs_at < lhs_count) && (part->operation != BTREE_SET_INTERSECT); lhs_at++) {
+        emit(part, part->lhs_items[lhs_at], key_size, value_size);
+    }
+    for (; (rhs_at < rhs_count) && (part->operation == BTREE_SET_UNION); rhs_at++) {
+        emit(part, part->rhs_items[rhs_at], key_size, value_size);
+    }
+}
+
+// Cuts the key range at keys of the larger tree picked at even ranks, so
+// both inputs split at the same keys. Returns how many parts there are, 0
+// when a cut key can not be found.
+static size_t plan_parts(BTreeSetPart* parts, size_t threads, const void* lhs, const void* rhs) {
+    const size_t lhs_count = btree_count(lhs);
+    const size_t rhs_count = btree_count(rhs);
+    const void* larger = (lhs_count >= rhs_count) ? lhs : rhs;
+    const size_t larger_count = btree_count(larger);
+    size_t count = (threads < BTREE_SET_MAX_THREADS) ? threads : BTREE_SET_MAX_THREADS;
+    if (count > (lhs_count + rhs_count) / BTREE_SET_MIN_PART) {
+        count = (lhs_count + rhs_count) / BTREE_SET_MIN_PART;
+    }
+    if (count < 1) {
+        count = 1;
+    }
+    size_t lhs_at = 0;
+    size_t rhs_at = 0;
+    for (size_t i = 0; i < count; i++) {
+        parts[i].lhs_begin = lhs_at;
+        parts[i].rhs_begin = rhs_at;
+        if (i + 1 < count) {
+            const BTreeItem* split = btree_current(larger, btree_select(larger, (i + 1) * larger_count / count));
+            if (split == NULL) {
+                return 0;
+            }
+            lhs_at = btree_rank(lhs, split->key);
+            rhs_at = btree_rank(rhs, split->key);
+        }
+        else {
+            lhs_at = lhs_count;
+            rhs_at = rhs_count;
+        }
+        parts[i].lhs_end = lhs_at;
+        parts[i].rhs_end = rhs_at;
+    }
+    return count;
+}
+
+static void* combine(const void* lhs, const void* rhs, size_t threads, BTreeSetOperation operation) {
+    if ((lhs == NULL) || (rhs == NULL) || (btree_key_size(lhs) != btree_key_size(rhs)) || (btree_value_size(lhs) != btree_value_size(rhs))) {
+        return NULL;
+    }
+    const size_t key_size = btree_key_size(lhs);
+    const size_t value_size = btree_value_size(lhs);
+    const size_t capacity = btree_count(lhs) + ((operation == BTREE_SET_UNION) ? btree_count(rhs) : 0);
+    void* result = btree_create_like(lhs);
+    unsigned char* keys = malloc(capacity * key_size + 1);
+    unsigned char* values = malloc(capacity * value_size + 1);
+    const BTreeItem** items = malloc((btree_count(lhs) + btree_count(rhs) + 1) * sizeof(const BTreeItem*));
+    if ((result == NULL) || (keys == NULL) || (values == NULL) || (items == NULL)) {
+        btree_destroy(result, NULL);
+        free(keys);
+        free(values);
+        free(items);
+        return NULL;
+    }
+
+    BTreeSetPart parts[BTREE_SET_MAX_THREADS];
+    BTreeThread workers[BTREE_SET_MAX_THREADS];
+    bool started[BTREE_SET_MAX_THREADS];
+    const size_t count = plan_parts(parts, (threads == 0) ? btree_thread_hardware() : threads, lhs, rhs);
+    for (size_t i = 0; i < count; i++) {
+        // Only a union takes items from rhs, so only there do they move
+        // the output of later parts.
+        const size_t offset = parts[i].lhs_begin + ((operation == BTREE_SET_UNION) ? parts[i].rhs_begin : 0);
+        parts[i].lhs = lhs;
+        parts[i].rhs = rhs;
+        parts[i].operation = operation;
+        parts[i].lhs_items = items + parts[i].lhs_begin;
+        parts[i].rhs_items = items + btree_count(lhs) + parts[i].rhs_begin;
+        parts[i].keys = keys + offset * key_size;
+        parts[i].values = values + offset * value_size;
+    }
+    for (size_t i = 1; i < count; i++) {
+        started[i] = btree_thread_start(&workers[i], merge_part, &parts[i]);
+    }
+    if (count > 0) {
+        merge_part(&parts[0]);
+    }
+    bool built = (count > 0) && !parts[0].failed;
+    size_t total = (count > 0) ? parts[0].produced : 0;
+    for (size_t i = 1; i < count; i++) {
+        if (started[i]) {
+            btree_thread_join(&workers[i]);
+        }
+        else {
+            merge_part(&parts[i]);
+        }
+        memmove(keys + total * key_size, parts[i].keys, parts[i].produced * key_size);
+        memmove(values + total * value_size, parts[i].values, parts[i].produced * value_size);
+        total += parts[i].produced;
+        built = built && !parts[i].failed;
+    }
+    built = built && ((total == 0) || btree_build_sorted(result, keys, values, total, false));
+    free(keys);
+    free(values);
+    free(items);
+    if (!built) {
+        btree_destroy(result, NULL);
+        return NULL;
+    }
+    return result;
+}
+
+
+void* btree_union(const void* lhs, const void* rhs, size_t threads) {
+    return combine(lhs, rhs, threads, BTREE_SET_UNION);
+}
+
+void* btree_intersect(const void* lhs, const void* rhs, size_t threads) {
+    return combine(lhs, rhs, threads, BTREE_SET_INTERSECT);
+}
+
+void* btree_difference(const void* lhs, const void* rhs, size_t threads) {
+    return combine(lhs, rhs, threads, BTREE_SET_DIFFERENCE);
+}
@@ -0,0 +1,353 @@
+// Ahead of every system header, so <pthread.h> declares the rwlock API
+// even under strict -std=c11.
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "btree.h"
+#include "btree_thread.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Shards are padded to this size, so latches of neighbouring shards never
+// share a cache line.
+#define BTREE_SHARDED_SHARD_BYTES 128
+
+typedef struct BTreeShard BTreeShard;
+typedef struct BTreeSharded BTreeSharded;
+
+struct BTreeShard {
+    BTreeLatch latch;
+    void* tree;
+    unsigned char padding[BTREE_SHARDED_SHARD_BYTES];
+};
+
+// Shard i holds the keys in [splits[i - 1], splits[i]), the first and last
+// shard are open at their outer end. Only the first active_count shards,
+// one more than there are split points, ever receive keys.
+struct BTreeSharded {
+    size_t key_size;
+    size_t value_size;
+    int(*comp)(const void*, const void*);
+    size_t shard_count;
+    size_t active_count;
+    unsigned char* splits;
+    BTreeShard* shards;
+};
+
+static const unsigned char* split_key(const BTreeSharded* sharded, size_t index) {
+    return sharded->splits + index * sharded->key_size;
+}
+
+// Keys equal to a split point go right, as separators do in btree.c.
+static size_t shard_of(const BTreeSharded* sharded, const void* key) {
+    size_t low = 0;
+    size_t high = sharded->active_count - 1;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (sharded->comp(split_key(sharded, middle), key) <= 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void destroy_trees(void** trees, size_t count, void(*destroy)(void*)) {
+    for (size_t i = 0; i < count; i++) {
+        btree_destroy(trees[i], destroy);
+    }
+    free(trees);
+}
+
+static void** create_trees(const BTreeSharded* sharded) {
+    void** trees = calloc(sizeof(void*), sharded->shard_count);
+    if (trees == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sharded->shard_count; i++) {
+        trees[i] = btree_create(sharded->key_size, sharded->value_size, sharded->comp);
+        if (trees[i] == NULL) {
+            destroy_trees(trees, i, NULL);
+            return NULL;
+        }
+    }
+    return trees;
+}
+
+// Picks up to shard_count - 1 distinct split points from count ascending
+// keys at even quantiles. Returns how many were kept.
+static size_t pick_splits(const BTreeSharded* sharded, unsigned char* splits, const void* (*key_at)(const void* source, size_t index), const void* source, size_t count) {
+    size_t kept = 0;
+    for (size_t i = 1; i < sharded->shard_count; i++) {
+        const void* key = key_at(source, i * count / sharded->shard_count);
+        if ((kept > 0) && (sharded->comp(splits + (kept - 1) * sharded->key_size, key) >= 0)) {
+            continue;
+        }
+        memcpy(splits + kept * sharded->key_size, key, sharded->key_size);
+        kept++;
+    }
+    return kept;
+}
+
+typedef struct {
+    const unsigned char* keys;
+    size_t key_size;
+} BTreeShardedSample;
+
+static const void* sample_key(const void* source, size_t index) {
+    const BTreeShardedSample* sample = source;
+    return sample->keys + index * sample->key_size;
+}
+
+
+void* btree_create_sharded(
+    size_t keySize,
+    size_t valueSize,
+    int(*compare)(const void*, const void*),
+    size_t shards,
+    const void* sample,
+    size_t sampleCount) {
+    if ((keySize == 0) || (valueSize == 0) || (compare == NULL)) {
+        return NULL;
+    }
+    BTreeSharded* sharded = calloc(sizeof(BTreeSharded), 1);
+    if (sharded == NULL) {
+        return NULL;
+    }
+    sharded->key_size = keySize;
+    sharded->value_size = valueSize;
+    sharded->comp = compare;
+    sharded->shard_count = (shards == 0) ? btree_thread_hardware() : shards;
+    sharded->active_count = 1;
+    const bool sampled = (sample != NULL) && (sampleCount > 0);
+    unsigned char* sorted = sampled ? malloc(keySize * sampleCount) : NULL;
+    void** trees = create_trees(sharded);
+    sharded->splits = malloc(keySize * sharded->shard_count);
+    sharded->shards = calloc(sizeof(BTreeShard), sharded->shard_count);
+    if ((sampled && (sorted == NULL)) || (trees == NULL) || (sharded->splits == NULL) || (sharded->shards == NULL)) {
+        if (trees != NULL) {
+            destroy_trees(trees, sharded->shard_count, NULL);
+        }
+        free(sorted);
+        free(sharded->splits);
+        free(sharded->shards);
+        free(sharded);
+        return NULL;
+    }
+    if (sampled) {
+        memcpy(sorted, sample, keySize * sampleCount);
+        qsort(sorted, sampleCount, keySize, compare);
+        BTreeShardedSample source;
+        source.keys = sorted;
+        source.key_size = keySize;
+        sharded->active_count = 1 + pick_splits(sharded, sharded->splits, sample_key, &source, sampleCount);
+        free(sorted);
+    }
+    for (size_t i = 0; i < sharded->shard_count; i++) {
+        btree_latch_init(&sharded->shards[i].latch);
+        sharded->shards[i].tree = trees[i];
+    }
+    free(trees);
+    return sharded;
+}
+
+// Not thread-safe: nothing may use the container any more.
+void btree_sharded_destroy(void* sharded, void(*destroy)(void*)) {
+    if (sharded == NULL) {
+        return;
+    }
+    BTreeSharded* container = sharded;
+    for (size_t i = 0; i < container->shard_count; i++) {
+        btree_latch_free(&container->shards[i].latch);
+        btree_destroy(container->shards[i].tree, destroy);
+    }
+    free(container->shards);
+    free(container->splits);
+    free(container);
+}
+
+// Copies every stored item into keys and values, in ascending key order.
+static void gather_items(const BTreeSharded* sharded, unsigned char* keys, unsigned char* values) {
+    for (size_t i = 0; i < sharded->active_count; i++) {
+        const void* tree = sharded->shards[i].tree;
+        for (size_t id = btree_first(tree); id != btree_stop(tree); id = btree_next(tree, id)) {
+            const BTreeItem* item = btree_current(tree, id);
+            memcpy(keys, item->key, sharded->key_size);
+            memcpy(values, item->value, sharded->value_size);
+            keys += sharded->key_size;
+            values += sharded->value_size;
+        }
+    }
+}
+
+// Recomputes the split points from the keys now stored so that the shards
+// hold equal shares, and moves the keys accordingly. Not thread-safe.
+// Values of moved keys are copied bytewise, so pointers previously returned
+// for them are invalidated. Leaves the container unchanged on failure.
+bool btree_sharded_rebalance(void* sharded) {
+    if (sharded == NULL) {
+        return false;
+    }
+    BTreeSharded* container = sharded;
+    const size_t total = btree_sharded_count(container);
+    unsigned char* splits = malloc(container->key_size * container->shard_count);
+    unsigned char* keys = malloc(container->key_size * total + 1);
+    unsigned char* values = malloc(container->value_size * total + 1);
+    void** trees = create_trees(container);
+    if ((splits == NULL) || (keys == NULL) || (values == NULL) || (trees == NULL)) {
+        if (trees != NULL) {
+            destroy_trees(trees, container->shard_count, NULL);
+        }
+        free(values);
+        free(keys);
+        free(splits);
+        return false;
+    }
+    gather_items(container, keys, values);
+    BTreeShardedSample source;
+    source.keys = keys;
+    source.key_size = container->key_size;
+    const size_t kept = (total > 0) ? pick_splits(container, splits, sample_key, &source, total) : 0;
+
+    // Items are gathered in order, so each new shard is built from one run.
+    size_t from = 0;
+    for (size_t target = 0; target <= kept; target++) {
+        size_t to = total;
+        if (target < kept) {
+            to = from;
+            while (container->comp(splits + target * container->key_size, keys + to * container->key_size) > 0) {
+                to++;
+            }
+        }
+        if (!btree_build_sorted(trees[target], keys + from * container->key_size, values + from * container->value_size, to - from, false)) {
+            destroy_trees(trees, container->shard_count, NULL);
+            free(values);
+            free(keys);
+            free(splits);
+            return false;
+        }
+        from = to;
+    }
+    free(values);
+    free(keys);
+    for (size_t i = 0; i < container->shard_count; i++) {
+        btree_destroy(container->shards[i].tree, NULL);
+        container->shards[i].tree = trees[i];
+    }
+    free(trees);
+    free(container->splits);
+    container->splits = splits;
+    container->active_count = kept + 1;
+    return true;
+}
+
+size_t btree_sharded_count(const void* sharded) {
+    if (sharded == NULL) {
+        return 0;
+    }
+    const BTreeSharded* container = sharded;
+    size_t count = 0;
+    for (size_t i = 0; i < container->active_count; i++) {
+        BTreeShard* shard = &container->shards[i];
+        btree_latch_read_lock(&shard->latch);
+        count += btree_count(shard->tree);
+        btree_latch_read_unlock(&shard->latch);
+    }
+    return count;
+}
+
+size_t btree_sharded_shards(const void* sharded) {
+    if (sharded == NULL) {
+        return 0;
+    }
+    return ((const BTreeSharded*)sharded)->active_count;
+}
+
+// The value stays at the returned address until its key is removed. Only
+// the key's own shard is latched, so threads working on different key
+// ranges never wait for each other.
+void* btree_sharded_insert(void* sharded, const void* key, bool* createFlag) {
+    if ((sharded == NULL) || (key == NULL)) {
+        return NULL;
+    }
+    BTreeSharded* container = sharded;
+    BTreeShard* shard = &container->shards[shard_of(container, key)];
+    btree_latch_write_lock(&shard->latch);
+    void* value = btree_insert(shard->tree, key, createFlag);
+    btree_latch_write_unlock(&shard->latch);
+    return value;
+}
+
+void* btree_sharded_item(const void* sharded, const void* key) {
+    if ((sharded == NULL) || (key == NULL)) {
+        return NULL;
+    }
+    const BTreeSharded* container = sharded;
+    BTreeShard* shard = &container->shards[shard_of(container, key)];
+    btree_latch_read_lock(&shard->latch);
+    void* value = btree_item(shard->tree, key);
+    btree_latch_read_unlock(&shard->latch);
+    return value;
+}
+
+void btree_sharded_remove(void* sharded, const void* key, void(*destroy)(void*)) {
+    if ((sharded == NULL) || (key == NULL)) {
+        return;
+    }
+    BTreeSharded* container = sharded;
+    BTreeShard* shard = &container->shards[shard_of(container, key)];
+    btree_latch_write_lock(&shard->latch);
+    btree_remove(shard->tree, key, destroy);
+    btree_latch_write_unlock(&shard->latch);
+}
+
+// Ordered iteration runs through the shards in key order and must not
+// overlap writes.
+static BTreeShardedCursor first_from(const BTreeSharded* container, size_t shard) {
+    BTreeShardedCursor cursor;
+    for (cursor.shard = shard; cursor.shard < container->active_count; cursor.shard++) {
+        cursor.item_id = btree_first(container->shards[cursor.shard].tree);
+        if (cursor.item_id != btree_stop(NULL)) {
+            return cursor;
+        }
+    }
+    cursor.shard = 0;
+    cursor.item_id = btree_stop(NULL);
+    return cursor;
+}
+
+BTreeShardedCursor btree_sharded_first(const void* sharded) {
+    if (sharded == NULL) {
+        BTreeShardedCursor cursor;
+        cursor.shard = 0;
+        cursor.item_id = btree_stop(NULL);
+        return cursor;
+    }
+    return first_from(sharded, 0);
+}
+
+BTreeShardedCursor btree_sharded_next(const void* sharded, BTreeShardedCursor cursor) {
+    if ((sharded == NULL) || (cursor.item_id == btree_stop(NULL))) {
+        cursor.item_id = btree_stop(NULL);
+        return cursor;
+    }
+    const BTreeSharded* container = sharded;
+    if (cursor.shard >= container->active_count) {
+        cursor.item_id = btree_stop(NULL);
+        return cursor;
+    }
+    cursor.item_id = btree_next(container->shards[cursor.shard].tree, cursor.item_id);
+    if (cursor.item_id == btree_stop(NULL)) {
+        return first_from(container, cursor.shard + 1);
+    }
+    return cursor;
+}
+
+void* btree_sharded_current(const void* sharded, BTreeShardedCursor cursor) {
+    if ((sharded == NULL) || (cursor.shard >= ((const BTreeSharded*)sharded)->active_count)) {
+        return NULL;
+    }
+    return btree_current(((const BTreeSharded*)sharded)->shards[cursor.shard].tree, cursor.item_id);
+}
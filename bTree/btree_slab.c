@@ -0,0 +1,202 @@
+// Ahead of every system header, so strict -std=c11 still declares the
+// mmap flags MAP_ANONYMOUS and MAP_HUGETLB used below.
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+#include "btree.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define BTREE_SLAB_CHUNK_BYTES ((size_t)2 * 1024 * 1024)
+#define BTREE_SLAB_ALIGN 16
+#define BTREE_SLAB_CLASSES 8
+
+typedef struct BTreeSlabChunk BTreeSlabChunk;
+typedef struct BTreeSlabClass BTreeSlabClass;
+typedef struct BTreeSlab BTreeSlab;
+
+
+struct BTreeSlabChunk {
+    BTreeSlabChunk* next_chunk;
+    size_t size;
+    bool huge_page;
+};
+
+// Released blocks of one size, chained through their first word.
+struct BTreeSlabClass {
+    size_t size;
+    void* free_blocks;
+};
+
+struct BTreeSlab {
+    size_t chunk_size;
+    bool huge_pages;
+    BTreeSlabChunk* chunks;
+    unsigned char* cursor;
+    unsigned char* limit;
+    BTreeSlabClass classes[BTREE_SLAB_CLASSES];
+};
+
+static size_t chunk_header_size(void) {
+    return (sizeof(BTreeSlabChunk) + BTREE_SLAB_ALIGN - 1) / BTREE_SLAB_ALIGN * BTREE_SLAB_ALIGN;
+}
+
+// Huge pages are best effort: when the system has none reserved (or the
+// process lacks the privilege on Windows) the chunk comes from malloc.
+static BTreeSlabChunk* map_huge_chunk(size_t size) {
+#if defined(_WIN32)
+    const SIZE_T page = GetLargePageMinimum();
+    if ((page == 0) || (size % page != 0)) {
+        return NULL;
+    }
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+#elif defined(MAP_HUGETLB)
+    void* chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    return (chunk == MAP_FAILED) ? NULL : chunk;
+#else
+    (void)size;
+    return NULL;
+#endif
+}
+
+static void unmap_huge_chunk(BTreeSlabChunk* chunk) {
+#if defined(_WIN32)
+    VirtualFree(chunk, 0, MEM_RELEASE);
+#elif defined(MAP_HUGETLB)
+    munmap(chunk, chunk->size);
+#else
+    (void)chunk;
+#endif
+}
+
+static bool add_chunk(BTreeSlab* slab, size_t block_size) {
+    size_t size = slab->chunk_size;
+    if (size < chunk_header_size() + block_size) {
+        size = chunk_header_size() + block_size;
+    }
+    BTreeSlabChunk* chunk = NULL;
+    bool huge_page = false;
+    if (slab->huge_pages) {
+        size = (size + BTREE_SLAB_CHUNK_BYTES - 1) / BTREE_SLAB_CHUNK_BYTES * BTREE_SLAB_CHUNK_BYTES;
+        chunk = map_huge_chunk(size);
+        huge_page = (chunk != NULL);
+    }
+    if (chunk == NULL) {
+        chunk = malloc(size);
+        if (chunk == NULL) {
+            return false;
+        }
+    }
+    chunk->size = size;
+    chunk->huge_page = huge_page;
+    chunk->next_chunk = slab->chunks;
+    slab->chunks = chunk;
+    slab->cursor = (unsigned char*)chunk + chunk_header_size();
+    slab->limit = (unsigned char*)chunk + size;
+    return true;
+}
+
+static BTreeSlabClass* find_class(BTreeSlab* slab, size_t size) {
+    for (size_t i = 0; i < BTREE_SLAB_CLASSES; i++) {
+        BTreeSlabClass* slab_class = &slab->classes[i];
+        if (slab_class->size == size) {
+            return slab_class;
+        }
+        if (slab_class->size == 0) {
+            slab_class->size = size;
+            return slab_class;
+        }
+    }
+    return NULL;
+}
+
+static size_t block_size(size_t size) {
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+    return (size + BTREE_SLAB_ALIGN - 1) / BTREE_SLAB_ALIGN * BTREE_SLAB_ALIGN;
+}
+
+static void* slab_allocate(void* context, size_t size) {
+    BTreeSlab* slab = context;
+    size = block_size(size);
+    BTreeSlabClass* slab_class = find_class(slab, size);
+    if ((slab_class != NULL) && (slab_class->free_blocks != NULL)) {
+        void* block = slab_class->free_blocks;
+        slab_class->free_blocks = *(void**)block;
+        return block;
+    }
+    if ((slab->cursor == NULL) || ((size_t)(slab->limit - slab->cursor) < size)) {
+        if (!add_chunk(slab, size)) {
+            return NULL;
+        }
+    }
+    void* block = slab->cursor;
+    slab->cursor += size;
+    return block;
+}
+
+// Blocks of a size that did not get a class stay unused until release_all.
+static void slab_release(void* context, void* block, size_t size) {
+    BTreeSlab* slab = context;
+    if (block == NULL) {
+        return;
+    }
+    BTreeSlabClass* slab_class = find_class(slab, block_size(size));
+    if (slab_class == NULL) {
+        return;
+    }
+    *(void**)block = slab_class->free_blocks;
+    slab_class->free_blocks = block;
+}
+
+static void slab_release_all(void* context) {
+    BTreeSlab* slab = context;
+    while (slab->chunks != NULL) {
+        BTreeSlabChunk* chunk = slab->chunks;
+        slab->chunks = chunk->next_chunk;
+        if (chunk->huge_page) {
+            unmap_huge_chunk(chunk);
+        }
+        else {
+            free(chunk);
+        }
+    }
+    slab->cursor = NULL;
+    slab->limit = NULL;
+    memset(slab->classes, 0, sizeof(slab->classes));
+}
+
+
+void* btree_slab_create(size_t chunkSize, bool hugePages) {
+    BTreeSlab* slab = calloc(sizeof(BTreeSlab), 1);
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->chunk_size = (chunkSize == 0) ? BTREE_SLAB_CHUNK_BYTES : chunkSize;
+    slab->huge_pages = hugePages;
+    return slab;
+}
+
+void btree_slab_destroy(void* slab) {
+    if (slab == NULL) {
+        return;
+    }
+    slab_release_all(slab);
+    free(slab);
+}
+
+BTreeAllocator btree_slab_allocator(void* slab) {
+    BTreeAllocator allocator;
+    allocator.allocate = slab_allocate;
+    allocator.release = slab_release;
+    allocator.release_all = slab_release_all;
+    allocator.context = slab;
+    return allocator;
+}
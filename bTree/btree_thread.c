@@ -0,0 +1,305 @@
+#include "btree_thread.h"
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+static DWORD WINAPI thread_entry(LPVOID argument) {
+    BTreeThread* thread = argument;
+    thread->routine(thread->argument);
+    return 0;
+}
+
+bool btree_thread_start(BTreeThread* thread, void(*routine)(void*), void* argument) {
+    thread->routine = routine;
+    thread->argument = argument;
+    thread->handle = CreateThread(NULL, 0, thread_entry, thread, 0, NULL);
+    return thread->handle != NULL;
+}
+
+void btree_thread_join(BTreeThread* thread) {
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+}
+
+size_t btree_thread_hardware(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors == 0) ? 1 : (size_t)info.dwNumberOfProcessors;
+}
+
+void btree_latch_init(BTreeLatch* latch) {
+    InitializeSRWLock((PSRWLOCK)&latch->state);
+}
+
+void btree_latch_free(BTreeLatch* latch) {
+    (void)latch;
+}
+
+void btree_latch_read_lock(BTreeLatch* latch) {
+    AcquireSRWLockShared((PSRWLOCK)&latch->state);
+}
+
+void btree_latch_read_unlock(BTreeLatch* latch) {
+    ReleaseSRWLockShared((PSRWLOCK)&latch->state);
+}
+
+void btree_latch_write_lock(BTreeLatch* latch) {
+    AcquireSRWLockExclusive((PSRWLOCK)&latch->state);
+}
+
+void btree_latch_write_unlock(BTreeLatch* latch) {
+    ReleaseSRWLockExclusive((PSRWLOCK)&latch->state);
+}
+
+typedef CONDITION_VARIABLE BTreePoolSignal;
+static SRWLOCK pool_lock = SRWLOCK_INIT;
+static BTreePoolSignal pool_wake = CONDITION_VARIABLE_INIT;
+static BTreePoolSignal pool_done = CONDITION_VARIABLE_INIT;
+
+static void lock_pool(void) {
+    AcquireSRWLockExclusive(&pool_lock);
+}
+
+static void unlock_pool(void) {
+    ReleaseSRWLockExclusive(&pool_lock);
+}
+
+static void wait_pool(BTreePoolSignal* signal) {
+    SleepConditionVariableSRW(signal, &pool_lock, INFINITE, 0);
+}
+
+static void wake_pool(BTreePoolSignal* signal) {
+    WakeAllConditionVariable(signal);
+}
+
+size_t btree_atomic_add(volatile size_t* target, size_t delta) {
+#ifdef _WIN64
+    return (size_t)InterlockedExchangeAdd64((volatile LONG64*)target, (LONG64)delta) + delta;
+#else
+    return (size_t)InterlockedExchangeAdd((volatile LONG*)target, (LONG)delta) + delta;
+#endif
+}
+
+size_t btree_atomic_load(const volatile size_t* target) {
+    MemoryBarrier();
+    return *target;
+}
+
+void btree_atomic_store(volatile size_t* target, size_t value) {
+#ifdef _WIN64
+    InterlockedExchange64((volatile LONG64*)target, (LONG64)value);
+#else
+    InterlockedExchange((volatile LONG*)target, (LONG)value);
+#endif
+}
+
+void* btree_atomic_load_pointer(void* const volatile* target) {
+    MemoryBarrier();
+    return *target;
+}
+
+void btree_atomic_store_pointer(void* volatile* target, void* value) {
+    InterlockedExchangePointer((void* volatile*)target, value);
+}
+
+bool btree_atomic_compare_exchange(volatile size_t* target, size_t expected, size_t desired) {
+#ifdef _WIN64
+    return (size_t)InterlockedCompareExchange64((volatile LONG64*)target, (LONG64)desired, (LONG64)expected) == expected;
+#else
+    return (size_t)InterlockedCompareExchange((volatile LONG*)target, (LONG)desired, (LONG)expected) == expected;
+#endif
+}
+
+bool btree_atomic_compare_exchange_pointer(void* volatile* target, void* expected, void* desired) {
+    return InterlockedCompareExchangePointer(target, desired, expected) == expected;
+}
+
+#else
+#include <unistd.h>
+
+static void* thread_entry(void* argument) {
+    BTreeThread* thread = argument;
+    thread->routine(thread->argument);
+    return NULL;
+}
+
+bool btree_thread_start(BTreeThread* thread, void(*routine)(void*), void* argument) {
+    thread->routine = routine;
+    thread->argument = argument;
+    return pthread_create(&thread->handle, NULL, thread_entry, thread) == 0;
+}
+
+void btree_thread_join(BTreeThread* thread) {
+    pthread_join(thread->handle, NULL);
+}
+
+size_t btree_thread_hardware(void) {
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count < 1) ? 1 : (size_t)count;
+}
+
+void btree_latch_init(BTreeLatch* latch) {
+    pthread_rwlock_init(latch, NULL);
+}
+
+void btree_latch_free(BTreeLatch* latch) {
+    pthread_rwlock_destroy(latch);
+}
+
+void btree_latch_read_lock(BTreeLatch* latch) {
+    pthread_rwlock_rdlock(latch);
+}
+
+void btree_latch_read_unlock(BTreeLatch* latch) {
+    pthread_rwlock_unlock(latch);
+}
+
+void btree_latch_write_lock(BTreeLatch* latch) {
+    pthread_rwlock_wrlock(latch);
+}
+
+void btree_latch_write_unlock(BTreeLatch* latch) {
+    pthread_rwlock_unlock(latch);
+}
+
+typedef pthread_cond_t BTreePoolSignal;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static BTreePoolSignal pool_wake = PTHREAD_COND_INITIALIZER;
+static BTreePoolSignal pool_done = PTHREAD_COND_INITIALIZER;
+
+static void lock_pool(void) {
+    pthread_mutex_lock(&pool_lock);
+}
+
+static void unlock_pool(void) {
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void wait_pool(BTreePoolSignal* signal) {
+    pthread_cond_wait(signal, &pool_lock);
+}
+
+static void wake_pool(BTreePoolSignal* signal) {
+    pthread_cond_broadcast(signal);
+}
+
+size_t btree_atomic_add(volatile size_t* target, size_t delta) {
+    return __atomic_add_fetch(target, delta, __ATOMIC_SEQ_CST);
+}
+
+size_t btree_atomic_load(const volatile size_t* target) {
+    return __atomic_load_n(target, __ATOMIC_SEQ_CST);
+}
+
+void btree_atomic_store(volatile size_t* target, size_t value) {
+    __atomic_store_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+void* btree_atomic_load_pointer(void* const volatile* target) {
+    return __atomic_load_n(target, __ATOMIC_SEQ_CST);
+}
+
+void btree_atomic_store_pointer(void* volatile* target, void* value) {
+    __atomic_store_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+bool btree_atomic_compare_exchange(volatile size_t* target, size_t expected, size_t desired) {
+    return __atomic_compare_exchange_n(target, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+bool btree_atomic_compare_exchange_pointer(void* volatile* target, void* expected, void* desired) {
+    return __atomic_compare_exchange_n(target, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+typedef struct BTreePoolJob BTreePoolJob;
+
+// One btree_pool_run call: items [claimed, count) are still to be handed
+// out, finished counts those done. Lives on the caller's stack and is
+// queued in pool_jobs while items are left to claim.
+struct BTreePoolJob {
+    void(*routine)(void*);
+    unsigned char* arguments;
+    size_t argument_size;
+    size_t count;
+    size_t claimed;
+    size_t finished;
+    BTreePoolJob* next_job;
+};
+
+// Workers are started on demand and kept for the life of the process, so
+// fanning out costs a wake-up rather than a thread start and join. Every
+// field below is guarded by pool_lock.
+static BTreeThread pool_workers[BTREE_POOL_MAX_WORKERS];
+static size_t pool_size;
+static BTreePoolJob* pool_jobs;
+
+// Hands out the next item of job and unqueues the job after its last one.
+static void* claim_item(BTreePoolJob* job) {
+    void* argument = job->arguments + job->claimed * job->argument_size;
+    if (++job->claimed == job->count) {
+        BTreePoolJob** link = &pool_jobs;
+        while (*link != job) {
+            link = &(*link)->next_job;
+        }
+        *link = job->next_job;
+    }
+    return argument;
+}
+
+static void run_item(BTreePoolJob* job, void* argument) {
+    unlock_pool();
+    job->routine(argument);
+    lock_pool();
+    if (++job->finished == job->count) {
+        wake_pool(&pool_done);
+    }
+}
+
+static void pool_worker(void* unused) {
+    (void)unused;
+    lock_pool();
+    for (;;) {
+        while (pool_jobs == NULL) {
+            wait_pool(&pool_wake);
+        }
+        BTreePoolJob* job = pool_jobs;
+        run_item(job, claim_item(job));
+    }
+}
+
+void btree_pool_run(void(*routine)(void*), void* arguments, size_t argumentSize, size_t count) {
+    if ((routine == NULL) || (count == 0)) {
+        return;
+    }
+    BTreePoolJob job;
+    job.routine = routine;
+    job.arguments = arguments;
+    job.argument_size = argumentSize;
+    job.count = count;
+    job.claimed = 0;
+    job.finished = 0;
+    job.next_job = NULL;
+    lock_pool();
+    // The caller works on its own job too, so count - 1 workers keep every
+    // item busy, and the job still finishes when none could be started.
+    while ((pool_size + 1 < count) && (pool_size < BTREE_POOL_MAX_WORKERS) &&
+        btree_thread_start(&pool_workers[pool_size], pool_worker, NULL)) {
+        pool_size++;
+    }
+    BTreePoolJob** tail = &pool_jobs;
+    while (*tail != NULL) {
+        tail = &(*tail)->next_job;
+    }
+    *tail = &job;
+    wake_pool(&pool_wake);
+    while (job.claimed < job.count) {
+        run_item(&job, claim_item(&job));
+    }
+    while (job.finished < job.count) {
+        wait_pool(&pool_done);
+    }
+    unlock_pool();
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <stdbool.h> // bool
+#include <stddef.h>  // size_t
+
+// Minimal portable threads for the library's internal fan-out work.
+
+#ifdef _WIN32
+typedef void* BTreeThreadHandle;
+// Storage of an SRWLOCK, which is a single pointer.
+typedef struct { void* state; } BTreeLatch;
+#else
+// Strict -std=c11 hides the rwlock API unless POSIX is asked for; this only
+// helps when no system header was included before.
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include <pthread.h>
+typedef pthread_t BTreeThreadHandle;
+typedef pthread_rwlock_t BTreeLatch;
+#endif
+
+typedef
+struct BTreeThread
+{
+    BTreeThreadHandle handle;
+    void(*routine)(void*);
+    void* argument;
+}
+BTreeThread;
+
+bool btree_thread_start(BTreeThread* thread, void(*routine)(void*), void* argument);
+void btree_thread_join(BTreeThread* thread);
+size_t btree_thread_hardware(void);
+
+// Runs routine on count arguments, argumentSize bytes apart, on threads of
+// a process-wide pool and the calling thread, and returns once every call
+// has finished. Calls from several threads at once share the workers.
+#define BTREE_POOL_MAX_WORKERS 64
+void btree_pool_run(void(*routine)(void*), void* arguments, size_t argumentSize, size_t count);
+
+// Reader-writer latch: any number of readers or one writer.
+void btree_latch_init(BTreeLatch* latch);
+void btree_latch_free(BTreeLatch* latch);
+void btree_latch_read_lock(BTreeLatch* latch);
+void btree_latch_read_unlock(BTreeLatch* latch);
+void btree_latch_write_lock(BTreeLatch* latch);
+void btree_latch_write_unlock(BTreeLatch* latch);
+
+// Sequentially consistent loads and stores; add returns the new value.
+size_t btree_atomic_add(volatile size_t* target, size_t delta);
+size_t btree_atomic_load(const volatile size_t* target);
+void btree_atomic_store(volatile size_t* target, size_t value);
+void* btree_atomic_load_pointer(void* const volatile* target);
+void btree_atomic_store_pointer(void* volatile* target, void* value);
+// Stores desired only if target still holds expected; true when it did.
+bool btree_atomic_compare_exchange(volatile size_t* target, size_t expected, size_t desired);
+bool btree_atomic_compare_exchange_pointer(void* volatile* target, void* expected, void* desired);
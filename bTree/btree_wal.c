@@ -0,0 +1,522 @@
+// Ahead of every system header, so strict -std=c11 still declares the POSIX
+// file calls used below (fsync, ftruncate).
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "btree.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A durable tree lives in two files next to path:
+//   path.ckpt   the last checkpoint, written by btree_save
+//   path.wal    the operations since that checkpoint: a BTreeLogHeader,
+//               then records of a checksum, a kind byte, the key and, for
+//               puts, the value
+// Operations are blind writes of whole values, so replaying a log over a
+// checkpoint that already holds some of it changes nothing. That makes a
+// crash between writing a checkpoint and emptying the log harmless, as
+// long as the log is emptied only once the new checkpoint is on disk,
+// directory entry included.
+#define BTREE_LOG_MAGIC "BTREEWAL"
+#define BTREE_LOG_VERSION 1
+#define BTREE_LOG_BYTE_ORDER 0x01020304u
+#define BTREE_LOG_BUFFER_BYTES ((size_t)64 * 1024)
+#define BTREE_LOG_PUT 1
+#define BTREE_LOG_REMOVE 2
+
+#ifdef _WIN32
+typedef HANDLE BTreeLogFile;
+#else
+typedef int BTreeLogFile;
+#endif
+
+typedef struct BTreeLogHeader BTreeLogHeader;
+typedef struct BTreeDurable BTreeDurable;
+
+struct BTreeLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t key_size;
+    uint64_t value_size;
+};
+
+struct BTreeDurable {
+    void* tree;
+    size_t key_size;
+    size_t value_size;
+    char* checkpoint_path;
+    char* log_path;
+    BTreeLogFile log;
+    // Bytes of the log including those still buffered.
+    uint64_t log_bytes;
+    uint64_t checkpoint_bytes;
+    size_t group_ops;
+    size_t pending_ops;
+    bool failed;
+    size_t used;
+    size_t buffer_bytes;
+    unsigned char* buffer;
+    unsigned char* record;
+    // Keys read back are copied here, so compare sees them aligned.
+    unsigned char* key;
+};
+
+static size_t record_size(const BTreeDurable* durable, unsigned char kind) {
+    return sizeof(uint64_t) + 1 + durable->key_size + ((kind == BTREE_LOG_PUT) ? durable->value_size : 0);
+}
+
+// FNV-1a over kind, key and value: enough to tell a torn or unwritten
+// record from a whole one.
+static uint64_t checksum(const unsigned char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+#ifndef _WIN32
+// A new file survives a crash only once its directory entry is synced too.
+static bool sync_directory(const char* path) {
+    const char* slash = strrchr(path, '/');
+    const size_t length = ((slash == NULL) || (slash == path)) ? 1 : (size_t)(slash - path);
+    char* directory = malloc(length + 1);
+    if (directory == NULL) {
+        return false;
+    }
+    memcpy(directory, (slash == NULL) ? "." : path, length);
+    directory[length] = 0;
+    const int file = open(directory, O_RDONLY);
+    free(directory);
+    if (file < 0) {
+        return false;
+    }
+    const bool synced = fsync(file) == 0;
+    close(file);
+    return synced;
+}
+#endif
+
+// On Windows the directory entry of a new file is flushed along with the
+// file itself, which replay_log syncs once it has written the header.
+static bool open_log(const char* path, BTreeLogFile* file) {
+#ifdef _WIN32
+    *file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    return *file != INVALID_HANDLE_VALUE;
+#else
+    *file = open(path, O_RDWR | O_CREAT, 0644);
+    if (*file < 0) {
+        return false;
+    }
+    if (!sync_directory(path)) {
+        close(*file);
+        return false;
+    }
+    return true;
+#endif
+}
+
+static void close_log(BTreeLogFile file) {
+#ifdef _WIN32
+    CloseHandle(file);
+#else
+    close(file);
+#endif
+}
+
+// Reads up to size bytes into data and sets done to how many arrived;
+// fewer only at the end of the file. False on a read error, which must
+// not be taken for the end of the log.
+static bool read_log(BTreeLogFile file, void* data, size_t size, size_t* done) {
+    unsigned char* bytes = data;
+    *done = 0;
+    while (*done < size) {
+#ifdef _WIN32
+        DWORD part = 0;
+        if (!ReadFile(file, bytes + *done, (DWORD)(size - *done), &part, NULL)) {
+            return false;
+        }
+#else
+        const ssize_t part = read(file, bytes + *done, size - *done);
+        if ((part < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (part < 0) {
+            return false;
+        }
+#endif
+        if (part == 0) {
+            break;
+        }
+        *done += (size_t)part;
+    }
+    return true;
+}
+
+static bool write_log(BTreeLogFile file, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    while (size > 0) {
+#ifdef _WIN32
+        DWORD part = 0;
+        if (!WriteFile(file, bytes, (DWORD)size, &part, NULL) || (part == 0)) {
+            return false;
+        }
+#else
+        const ssize_t part = write(file, bytes, size);
+        if (part <= 0) {
+            return false;
+        }
+#endif
+        bytes += part;
+        size -= (size_t)part;
+    }
+    return true;
+}
+
+static bool sync_log(BTreeLogFile file) {
+#ifdef _WIN32
+    return FlushFileBuffers(file) != 0;
+#else
+    return fsync(file) == 0;
+#endif
+}
+
+// Cuts the log at length and continues writing there.
+static bool cut_log(BTreeLogFile file, uint64_t length) {
+#ifdef _WIN32
+    LARGE_INTEGER position;
+    position.QuadPart = (LONGLONG)length;
+    return SetFilePointerEx(file, position, NULL, FILE_BEGIN) && SetEndOfFile(file) && sync_log(file);
+#else
+    return (ftruncate(file, (off_t)length) == 0) && (lseek(file, (off_t)length, SEEK_SET) == (off_t)length) && sync_log(file);
+#endif
+}
+
+static bool file_exists(const char* path) {
+#ifdef _WIN32
+    return GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES;
+#else
+    struct stat status;
+    return stat(path, &status) == 0;
+#endif
+}
+
+static char* suffixed_path(const char* path, const char* suffix) {
+    const size_t length = strlen(path);
+    const size_t suffix_length = strlen(suffix);
+    char* joined = malloc(length + suffix_length + 1);
+    if (joined != NULL) {
+        memcpy(joined, path, length);
+        memcpy(joined + length, suffix, suffix_length + 1);
+    }
+    return joined;
+}
+
+static void free_durable(BTreeDurable* durable, void(*destroy)(void*)) {
+    btree_destroy(durable->tree, destroy);
+    free(durable->checkpoint_path);
+    free(durable->log_path);
+    free(durable->buffer);
+    free(durable->record);
+    free(durable->key);
+    free(durable);
+}
+
+// Hands buffered records to the OS, without waiting for the disk.
+static bool flush_buffer(BTreeDurable* durable) {
+    if ((durable->used > 0) && !write_log(durable->log, durable->buffer, durable->used)) {
+        durable->failed = true;
+    }
+    durable->used = 0;
+    return !durable->failed;
+}
+
+static void apply_put(BTreeDurable* durable, const unsigned char* key, const unsigned char* value, bool* createFlag) {
+    void* stored = btree_insert(durable->tree, key, createFlag);
+    if (stored != NULL) {
+        memcpy(stored, value, durable->value_size);
+    }
+    else {
+        durable->failed = true;
+    }
+}
+
+// Loads the checkpoint with btree_build_sorted. A checkpoint that exists
+// but can not be read fails recovery rather than losing its contents.
+static bool load_checkpoint(BTreeDurable* durable, int(*compare)(const void*, const void*)) {
+    if (!file_exists(durable->checkpoint_path)) {
+        return true;
+    }
+    void* mapped = btree_open_mmap(durable->checkpoint_path, compare);
+    if ((mapped == NULL) || (btree_mapped_key_size(mapped) != durable->key_size) || (btree_mapped_value_size(mapped) != durable->value_size)) {
+        btree_mapped_close(mapped);
+        return false;
+    }
+    const size_t count = btree_mapped_count(mapped);
+    unsigned char* keys = malloc(count * durable->key_size + 1);
+    unsigned char* values = malloc(count * durable->value_size + 1);
+    bool loaded = (keys != NULL) && (values != NULL);
+    if (loaded) {
+        size_t index = 0;
+        for (size_t id = btree_mapped_first(mapped); id != btree_stop(mapped); id = btree_mapped_next(mapped, id)) {
+            memcpy(keys + index * durable->key_size, btree_mapped_key(mapped, id), durable->key_size);
+            memcpy(values + index * durable->value_size, btree_mapped_value(mapped, id), durable->value_size);
+            index++;
+        }
+        loaded = (count == 0) || btree_build_sorted(durable->tree, keys, values, count, false);
+    }
+    free(keys);
+    free(values);
+    btree_mapped_close(mapped);
+    return loaded;
+}
+
+// Replays the log up to its first incomplete or damaged record, which
+// marks where the last run stopped, and cuts the rest off so that new
+// records follow the last good one. A read error fails recovery and
+// leaves the log as it is.
+static bool replay_log(BTreeDurable* durable) {
+    BTreeLogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BTREE_LOG_MAGIC, sizeof(header.magic));
+    header.version = BTREE_LOG_VERSION;
+    header.byte_order = BTREE_LOG_BYTE_ORDER;
+    header.key_size = durable->key_size;
+    header.value_size = durable->value_size;
+
+    BTreeLogHeader found;
+    size_t header_read = 0;
+    if (!read_log(durable->log, &found, sizeof(found), &header_read)) {
+        return false;
+    }
+    if (header_read == sizeof(found)) {
+        if (memcmp(&found, &header, sizeof(header)) != 0) {
+            return false;
+        }
+    }
+    else if (!cut_log(durable->log, 0) || !write_log(durable->log, &header, sizeof(header)) || !sync_log(durable->log)) {
+        return false;
+    }
+    durable->log_bytes = sizeof(header);
+    if (header_read != sizeof(found)) {
+        return true;
+    }
+
+    // Records are parsed out of the buffer, refilled as they run out.
+    size_t filled = 0;
+    if (!read_log(durable->log, durable->buffer, durable->buffer_bytes, &filled)) {
+        return false;
+    }
+    size_t at = 0;
+    while (true) {
+        if ((filled - at < record_size(durable, BTREE_LOG_PUT)) && (filled == durable->buffer_bytes)) {
+            memmove(durable->buffer, durable->buffer + at, filled - at);
+            filled -= at;
+            at = 0;
+            size_t more = 0;
+            if (!read_log(durable->log, durable->buffer + filled, durable->buffer_bytes - filled, &more)) {
+                return false;
+            }
+            filled += more;
+        }
+        if (filled - at < record_size(durable, BTREE_LOG_REMOVE)) {
+            break;
+        }
+        const unsigned char* record = durable->buffer + at;
+        const unsigned char kind = record[sizeof(uint64_t)];
+        if (((kind != BTREE_LOG_PUT) && (kind != BTREE_LOG_REMOVE)) || (filled - at < record_size(durable, kind))) {
+            break;
+        }
+        uint64_t stored = 0;
+        memcpy(&stored, record, sizeof(stored));
+        const size_t size = record_size(durable, kind);
+        if (stored != checksum(record + sizeof(uint64_t), size - sizeof(uint64_t))) {
+            break;
+        }
+        memcpy(durable->key, record + sizeof(uint64_t) + 1, durable->key_size);
+        if (kind == BTREE_LOG_PUT) {
+            bool isCreated = false;
+            apply_put(durable, durable->key, record + sizeof(uint64_t) + 1 + durable->key_size, &isCreated);
+        }
+        else {
+            btree_remove(durable->tree, durable->key, NULL);
+        }
+        at += size;
+        durable->log_bytes += size;
+    }
+    return !durable->failed && cut_log(durable->log, durable->log_bytes);
+}
+
+static bool append_record(BTreeDurable* durable, unsigned char kind, const void* key, const void* value) {
+    const size_t size = record_size(durable, kind);
+    unsigned char* record = durable->record;
+    record[sizeof(uint64_t)] = kind;
+    memcpy(record + sizeof(uint64_t) + 1, key, durable->key_size);
+    if (kind == BTREE_LOG_PUT) {
+        memcpy(record + sizeof(uint64_t) + 1 + durable->key_size, value, durable->value_size);
+    }
+    const uint64_t sum = checksum(record + sizeof(uint64_t), size - sizeof(uint64_t));
+    memcpy(record, &sum, sizeof(sum));
+    if ((durable->used + size > durable->buffer_bytes) && !flush_buffer(durable)) {
+        return false;
+    }
+    memcpy(durable->buffer + durable->used, record, size);
+    durable->used += size;
+    durable->log_bytes += size;
+    durable->pending_ops++;
+    if ((durable->checkpoint_bytes != 0) && (durable->log_bytes >= durable->checkpoint_bytes)) {
+        return btree_durable_checkpoint(durable);
+    }
+    if ((durable->group_ops != 0) && (durable->pending_ops >= durable->group_ops)) {
+        return btree_durable_commit(durable);
+    }
+    return true;
+}
+
+
+// Returns NULL when the files can not be read or were written for other
+// key or value sizes, so that nothing recorded in them is overwritten.
+void* btree_create_durable(
+    const char* path,
+    size_t keySize,
+    size_t valueSize,
+    int(*compare)(const void*, const void*),
+    size_t groupOps,
+    size_t checkpointBytes) {
+    if ((path == NULL) || (keySize == 0) || (valueSize == 0) || (compare == NULL)) {
+        return NULL;
+    }
+    BTreeDurable* durable = calloc(sizeof(BTreeDurable), 1);
+    if (durable == NULL) {
+        return NULL;
+    }
+    durable->key_size = keySize;
+    durable->value_size = valueSize;
+    durable->group_ops = groupOps;
+    durable->checkpoint_bytes = checkpointBytes;
+    durable->tree = btree_create(keySize, valueSize, compare);
+    durable->checkpoint_path = suffixed_path(path, ".ckpt");
+    durable->log_path = suffixed_path(path, ".wal");
+    durable->record = malloc(record_size(durable, BTREE_LOG_PUT));
+    durable->key = malloc(keySize);
+    // The buffer takes at least two records, as replay needs one whole
+    // record after the unparsed rest of the previous read.
+    durable->buffer_bytes = (2 * record_size(durable, BTREE_LOG_PUT) > BTREE_LOG_BUFFER_BYTES) ?
+        2 * record_size(durable, BTREE_LOG_PUT) : BTREE_LOG_BUFFER_BYTES;
+    durable->buffer = malloc(durable->buffer_bytes);
+    if ((durable->tree == NULL) || (durable->checkpoint_path == NULL) || (durable->log_path == NULL) ||
+        (durable->record == NULL) || (durable->key == NULL) || (durable->buffer == NULL)) {
+        free_durable(durable, NULL);
+        return NULL;
+    }
+    if (!load_checkpoint(durable, compare) || !open_log(durable->log_path, &durable->log)) {
+        free_durable(durable, NULL);
+        return NULL;
+    }
+    if (!replay_log(durable)) {
+        close_log(durable->log);
+        free_durable(durable, NULL);
+        return NULL;
+    }
+    return durable;
+}
+
+// Commits what is pending, then frees the tree. Not checkpointed, so the
+// next open replays the log.
+bool btree_durable_close(void* durable, void(*destroy)(void*)) {
+    if (durable == NULL) {
+        return false;
+    }
+    BTreeDurable* store = durable;
+    const bool committed = btree_durable_commit(store);
+    close_log(store->log);
+    free_durable(store, destroy);
+    return committed;
+}
+
+// For reads only: changes made through it would not be logged.
+const void* btree_durable_tree(const void* durable) {
+    if (durable == NULL) {
+        return NULL;
+    }
+    return ((const BTreeDurable*)durable)->tree;
+}
+
+// Copies value in as the value of key and logs it. A false return means
+// the change may not reach the disk, and every later call fails too.
+bool btree_durable_put(void* durable, const void* key, const void* value, bool* createFlag) {
+    if ((durable == NULL) || (key == NULL) || (value == NULL) || (createFlag == NULL)) {
+        return false;
+    }
+    BTreeDurable* store = durable;
+    if (store->failed) {
+        return false;
+    }
+    apply_put(store, key, value, createFlag);
+    return !store->failed && append_record(store, BTREE_LOG_PUT, key, value);
+}
+
+bool btree_durable_remove(void* durable, const void* key, void(*destroy)(void*)) {
+    if ((durable == NULL) || (key == NULL)) {
+        return false;
+    }
+    BTreeDurable* store = durable;
+    if (store->failed) {
+        return false;
+    }
+    if (btree_item(store->tree, key) == NULL) {
+        return true;
+    }
+    btree_remove(store->tree, key, destroy);
+    return append_record(store, BTREE_LOG_REMOVE, key, NULL);
+}
+
+// Group commit: one fsync makes every operation logged so far durable.
+bool btree_durable_commit(void* durable) {
+    if (durable == NULL) {
+        return false;
+    }
+    BTreeDurable* store = durable;
+    if (store->failed) {
+        return false;
+    }
+    if (store->pending_ops == 0) {
+        return true;
+    }
+    if (!flush_buffer(store) || !sync_log(store->log)) {
+        store->failed = true;
+        return false;
+    }
+    store->pending_ops = 0;
+    return true;
+}
+
+// Writes the whole tree as the new checkpoint and empties the log, so
+// that recovery replays only what follows. The log is committed first and
+// cut only after btree_save has put the checkpoint, rename included, on
+// disk: a crash in between replays the log over the new checkpoint.
+bool btree_durable_checkpoint(void* durable) {
+    if (durable == NULL) {
+        return false;
+    }
+    BTreeDurable* store = durable;
+    if (!btree_durable_commit(store)) {
+        return false;
+    }
+    if (!btree_save(store->tree, store->checkpoint_path) || !cut_log(store->log, sizeof(BTreeLogHeader))) {
+        store->failed = true;
+        return false;
+    }
+    store->log_bytes = sizeof(BTreeLogHeader);
+    return true;
+}